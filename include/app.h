@@ -14,6 +14,8 @@ class EmbeddingClient;
 class CompletionClient;
 class SimpleTokenizer;
 class InstanceRegistry;
+class SourceContentCache;
+class RelatedSourceIndex;
 
 class App {
   struct Impl;
@@ -38,6 +40,8 @@ public:
   Settings &refSettings();
   const SimpleTokenizer &tokenizer() const;
   const SourceProcessor &sourceProcessor() const;
+  SourceContentCache *sourceCache() const; // nullptr when disabled
+  const RelatedSourceIndex &relatedSources() const;
   const Chunker &chunker() const;
   const VectorDatabase &db() const;
   VectorDatabase &db();
@@ -47,6 +51,8 @@ public:
 
   bool isValidPrivateAppKey(const std::string &appKey);
   void requestShutdownAsync();
+  // A document stored outside update(), e.g. through the API, joins the related sources
+  void documentAdded(const std::string &path);
 
 public:
   static void printUsage();
@@ -76,6 +82,7 @@ namespace utils {
   time_t getFileModificationTime(const std::string &path);
   int safeStoI(const std::string &s, int def = 0);
   std::string trimmed(std::string_view sv);
+  std::string contentHash(std::string_view data);
 }
 
 #endif // _APP_H_
\ No newline at end of file
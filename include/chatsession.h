@@ -0,0 +1,83 @@
+#ifndef _CHATSESSION_H_
+#define _CHATSESSION_H_
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "database.h"
+
+// Retrieval state of one conversation, kept between chat requests carrying the
+// same session id. Question parts seen before are neither embedded nor searched
+// again, hits of the previous turn stay in play for the follow-up, and the
+// sources read for the previous answer are reused when the same, unchanged files
+// are picked.
+struct ChatSession {
+  struct Query {
+    std::string text;
+    std::vector<float> embedding;
+    std::vector<SearchResult> hits;
+  };
+
+  std::mutex mutex; // one request per conversation at a time
+  uint64_t generation = 0; // database generation the state below belongs to
+
+  std::vector<Query> queries; // oldest first
+  std::vector<SearchResult> previousHits;
+
+  // A source or related file read for the last context. Excerpts searched with
+  // that turn's question are not kept, they are searched again for the next one.
+  struct Source {
+    SearchResult result;
+    size_t tokens = 0;
+    size_t offset = 0; // tokens used before it after the question and attachments
+    bool whole = true; // an excerpt depends on the budget left where it was cut
+  };
+
+  std::string contextKey; // selection, budget and file stamps the sources belong to
+  std::vector<Source> sources;
+  std::vector<Source> related;
+
+  // The kept source for src if it can go in at offset and fits there: a whole file
+  // at any offset, an excerpt only at the offset it was cut at.
+  static const Source *findSource(const std::vector<Source> &kept, const std::string &src, size_t offset,
+    const std::function<bool(const Source &)> &fits);
+
+  const Query *findQuery(const std::string &text) const;
+  void addQuery(Query query);
+  void reset(uint64_t gen);
+};
+
+// Sessions by id, least recently used dropped beyond maxSessions, idle ones after ttl.
+class ChatSessionStore {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t created = 0;
+    size_t expired = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t maxEntries = 0;
+    size_t reusedQueries = 0;  // question parts answered from a session
+    size_t reusedContexts = 0; // requests that took sources over from the previous turn
+  };
+
+  ChatSessionStore(size_t maxSessions, std::chrono::seconds ttl);
+  ~ChatSessionStore();
+
+  // The session for id, a new one when it is unknown or has expired.
+  std::shared_ptr<ChatSession> acquire(const std::string &id);
+  void remove(const std::string &id);
+  void countReuse(size_t queries, bool context);
+
+  Stats stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+};
+
+#endif // _CHATSESSION_H_
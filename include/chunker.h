@@ -3,24 +3,30 @@
 
 #include <vector>
 #include <string>
-#include <regex>
-#include <mutex>
-#include <unordered_map>
+#include <string_view>
+#include <memory>
 #include "tokenizer.h"
 
 
 struct Chunk {
   std::string docUri;
   std::string chunkId;
-  std::string text;
-  std::string raw;
+  // Chunks reference one owned document buffer instead of holding copies of their text.
+  std::shared_ptr<const std::string> doc;
+  size_t offset = 0;
+  size_t length = 0;
   struct {
     size_t tokenCount;
     size_t start;
     size_t end;
     std::string unit;
     std::string type; // e.g. code or text
+    std::string symbol; // enclosing function/class scopes of code chunks, if known
   } metadata;
+  std::string hash; // content hash of the embedder input, set when the chunk is embedded
+
+  std::string_view text() const { return doc ? std::string_view(*doc).substr(offset, length) : std::string_view{}; }
+  std::string str() const { return std::string(text()); }
 };
 
 
@@ -30,21 +36,15 @@ private:
   size_t maxTokens_;
   size_t minTokens_;
   size_t overlapTokens_;
+  size_t parallelMinBytes_ = 0; // 0 = never chunk in parallel
+  size_t parallelThreads_ = 1;
 
-  std::vector<std::regex> functionPatterns_;
-  std::vector<std::regex> sectionPatterns_;
-
-  struct CodeBlock {
-    size_t startLine;
-    size_t endLine;
-    size_t startPos;
-    size_t endPos;
-    std::string type;
+  struct Line {
+    size_t offset; // into the line buffer
+    size_t length; // including the terminating newline
+    size_t tokens;
   };
 
-  mutable std::mutex cacheMutex_;
-  mutable std::unordered_map<std::string, size_t> tokenCache_;
-
 public:
   enum class ContentType { Code, Text, Binary };
 
@@ -52,13 +52,20 @@ public:
 
   std::vector<Chunk> chunkText(const std::string &text, const std::string &uri = "", bool semantic = true) const;
 
+  // Documents of at least minBytes are tokenized in line-aligned parts on up to `threads`
+  // threads (0 = all cores). The chunks are identical to sequential chunking.
+  void setParallel(size_t minBytes, size_t threads = 0);
+
 private:
   std::vector<Chunk> postProcessChunks(const std::vector<Chunk> &chunks, ContentType chunkType) const;
-  size_t tokenCount(const std::string &text) const;
+  size_t tokenCount(std::string_view text) const;
+  size_t segmentCount(size_t bytes) const;
+  size_t mergedTokenCount(const Chunk &a, const Chunk &b) const;
   std::vector<Chunk> splitIntoTextChunks(std::string text, const std::string &docId) const;
   std::vector<Chunk> splitIntoLineChunks(const std::string &text, const std::string &docId) const;
   std::vector<Chunk> splitIntoSemanticChunks(const std::string &text, const std::string &docId) const;
-  std::vector<std::string> splitIntoLines(const std::string &text) const;
+  void splitIntoLines(std::string_view text, std::string &buffer, std::vector<Line> &lines) const;
+  std::shared_ptr<const std::string> layoutLines(const std::string &text, std::vector<Line> &lines, std::vector<size_t> &firstLine) const;
 
 public:
   static std::string contentTypeToStr(Chunker::ContentType t);
@@ -0,0 +1,44 @@
+#ifndef _CTXPACKER_H_
+#define _CTXPACKER_H_
+
+#include <string>
+#include <vector>
+#include "database.h"
+
+class SimpleTokenizer;
+
+// Token-budgeted selection of the LLM context. Pinned candidates (attachments
+// and sources the caller has already budgeted) are kept in their order. The
+// others compete for the rest of the budget and item count; a chunk covering
+// mostly the same characters of a source as a better one is dropped as a
+// duplicate. The pick is the most relevant set under both limits, solved as a
+// knapsack with an item count; token costs are rounded up to 1/1024 of the
+// remaining budget, so it is exact for small budgets and otherwise loses at
+// most what fits in one such slice per item.
+class ContextPacker {
+public:
+  struct Candidate {
+    SearchResult result; // similarityScore is the relevance
+    size_t tokens = 0;   // exact cost in the prompt
+    bool pinned = false;
+  };
+  struct Packed {
+    std::vector<SearchResult> results; // pinned first, then the picks in input order
+    size_t tokens = 0;
+    float relevance = 0; // sum of the scores of the unpinned picks
+    size_t duplicates = 0;
+  };
+
+  ContextPacker(size_t budgetTokens, size_t maxItems);
+
+  Packed pack(const std::vector<Candidate> &candidates) const;
+
+  // Longest prefix of text within maxTokens, by bisection on the exact count
+  static std::string truncate(const SimpleTokenizer &tokenizer, const std::string &text, size_t maxTokens);
+
+private:
+  size_t budget_;
+  size_t maxItems_;
+};
+
+#endif // _CTXPACKER_H_
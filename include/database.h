@@ -8,6 +8,7 @@
 #include <optional>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
 
 
 struct SearchResult {
@@ -20,6 +21,7 @@ struct SearchResult {
   size_t end = 0;
   float similarityScore = 0;
   float distance = 0;
+  std::string symbol;
 };
 
 
@@ -45,15 +47,25 @@ struct DatabaseStats {
 class VectorDatabase {
 protected:
   mutable std::mutex mutex_;
+  std::atomic<uint64_t> generation_{ 0 };
 public:
   enum class DistanceMetric { L2, Cosine };
 
   virtual ~VectorDatabase() = default;
 
+  // Bumped by every change that can alter search results, so callers
+  // can tell whether results computed earlier are still valid.
+  uint64_t generation() const { return generation_; }
+
   virtual size_t addDocument(const Chunk &chunk, const std::vector<float> &embedding) = 0;
   virtual std::vector<size_t> addDocuments(const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings) = 0;
 
   virtual std::vector<SearchResult> search(const std::vector<float> &query, size_t top_k = 10) const = 0;
+  // One result list per query; the queries are searched in parallel
+  virtual std::vector<std::vector<SearchResult>> searchBatch(const std::vector<std::vector<float>> &queries, size_t top_k = 10) const = 0;
+  // Exact top-k among the chunks of one source, one result list per query
+  virtual std::vector<std::vector<SearchResult>> searchSource(const std::vector<std::vector<float>> &queries,
+    const std::string &sourceId, size_t top_k) const = 0;
   virtual std::vector<SearchResult> searchWithFilter(const std::vector<float> &query,
     const std::string &sourceFilter = "",
     const std::string &typeFilter = "",
@@ -68,8 +80,11 @@ public:
   virtual std::vector<FileMetadata> getTrackedFiles() const = 0;
   virtual std::unordered_map<std::string, size_t> getChunkCountsBySources() const = 0;
   virtual std::optional<SearchResult> getChunkData(size_t chunkId) const = 0;
+  virtual std::unordered_map<size_t, SearchResult> getChunksData(const std::vector<size_t> &chunkIds) const = 0;
   virtual std::vector<size_t> getChunkIdsBySource(const std::string &sourceId) const = 0;
   virtual std::vector<float> getEmbeddingVector(size_t chunkId) const = 0;
+  // Stored embeddings of chunks whose content hash is among `hashes`, keyed by hash
+  virtual std::unordered_map<std::string, std::vector<float>> getEmbeddingsByHash(const std::vector<std::string> &hashes) const = 0;
 
   virtual DatabaseStats getStats() const = 0;
   virtual void persist() = 0;
@@ -96,6 +111,9 @@ public:
   size_t addDocument(const Chunk &chunk, const std::vector<float> &embedding) override;
   std::vector<size_t> addDocuments(const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings) override;
   std::vector<SearchResult> search(const std::vector<float> &queryEmbedding, size_t topK = 10) const override;
+  std::vector<std::vector<SearchResult>> searchBatch(const std::vector<std::vector<float>> &queryEmbeddings, size_t topK = 10) const override;
+  std::vector<std::vector<SearchResult>> searchSource(const std::vector<std::vector<float>> &queryEmbeddings,
+    const std::string &sourceId, size_t topK) const override;
   std::vector<SearchResult> searchWithFilter(const std::vector<float> &queryEmbedding,
     const std::string &sourceFilter = "",
     const std::string &typeFilter = "",
@@ -110,6 +128,7 @@ public:
   std::vector<FileMetadata> getTrackedFiles() const override;
   std::unordered_map<std::string, size_t> getChunkCountsBySources() const override;
   std::vector<float> getEmbeddingVector(size_t chunkId) const override;
+  std::unordered_map<std::string, std::vector<float>> getEmbeddingsByHash(const std::vector<std::string> &hashes) const override;
 
   void beginTransaction() override { executeSql("BEGIN TRANSACTION"); }
   void commit() override { executeSql("COMMIT"); }
@@ -132,8 +151,10 @@ private:
   void initializeDatabase();
   void initializeVectorIndex();
   void executeSql(const std::string &sql);
+  bool hasColumn(const std::string &table, const std::string &column) const;
   size_t insertMetadata(const Chunk &chunk);
   std::optional<SearchResult> getChunkData(size_t chunkId) const override;
+  std::unordered_map<size_t, SearchResult> getChunksData(const std::vector<size_t> &chunkIds) const override;
   std::vector<size_t> getChunkIdsBySource(const std::string &sourceId) const override;
   //void compactIndex();
 };
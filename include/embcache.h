@@ -0,0 +1,86 @@
+#ifndef _EMBCACHE_H_
+#define _EMBCACHE_H_
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Persistent embedding store shared by all EmbeddingClient instances.
+// Entries are keyed by the model identity and the exact text sent to the
+// server (document/query format already applied), so re-embedding the same
+// content after a `clear`, a provider switch or in another project is free.
+// The table is capped at maxEntries and evicts the least recently used rows.
+class EmbeddingCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t stores = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t maxEntries = 0;
+  };
+
+  EmbeddingCache(const std::string &path, size_t maxEntries);
+  ~EmbeddingCache();
+
+  static std::string makeKey(std::string_view model, std::string_view text);
+
+  // Fills embeddings[i] for every cached key and leaves misses empty.
+  // Returns the number of hits.
+  size_t lookup(const std::vector<std::string> &keys, std::vector<std::vector<float>> &embeddings);
+  void store(const std::vector<std::string> &keys, const std::vector<std::vector<float>> &embeddings);
+
+  Stats stats() const;
+  std::string path() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+};
+
+// In-memory LRU of query embeddings shared by the search and chat handlers.
+// Entries expire after ttl; whitespace differences between queries are
+// ignored so re-typed searches hit as well.
+class QueryEmbeddingCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t expired = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t maxEntries = 0;
+  };
+
+  QueryEmbeddingCache(size_t maxEntries, std::chrono::seconds ttl);
+
+  static std::string makeKey(std::string_view model, std::string_view query);
+
+  bool lookup(const std::string &key, std::vector<float> &embedding);
+  void store(const std::string &key, const std::vector<float> &embedding);
+
+  Stats stats() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+  struct Entry {
+    std::string key;
+    std::vector<float> embedding;
+    Clock::time_point expires;
+  };
+
+  size_t maxEntries_;
+  std::chrono::seconds ttl_;
+  std::list<Entry> lru_; // most recent first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+};
+
+#endif // _EMBCACHE_H_
@@ -5,12 +5,15 @@
 #include <string>
 #include <memory>
 #include <functional>
+#include <string_view>
 #include <nlohmann/json.hpp>
 
 
 class App;
 struct SearchResult;
 struct ApiConfig;
+class EmbeddingCache;
+class QueryEmbeddingCache;
 
 
 class InferenceClient {
@@ -18,6 +21,20 @@ public:
   InferenceClient(const ApiConfig &cfg, size_t timeout);
   virtual ~InferenceClient();
 
+  // All clients share one pool of keep-alive connections per scheme://host:port
+  struct PoolStats {
+    size_t created = 0;
+    size_t reused = 0;
+    size_t expired = 0;
+    size_t discarded = 0;
+    size_t idle = 0;
+  };
+  static void configurePool(size_t maxIdlePerHost, size_t idleTimeoutMs);
+  static PoolStats poolStats();
+  // Opens a connection to the endpoint in the background unless one is already pooled,
+  // so a request sent a moment later skips the handshakes.
+  void prewarm() const;
+
 protected:
   struct Impl;
   std::unique_ptr<Impl> imp;
@@ -31,25 +48,93 @@ protected:
 class EmbeddingClient : public InferenceClient {
 public:
   enum class EncodeType { Document, Query };
+  using ProgressFn = std::function<void(size_t done, size_t total)>;
   EmbeddingClient(const ApiConfig &cfg, size_t timeout);
-  void generateEmbeddings(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddingsList, EmbeddingClient::EncodeType et) const;
+  // Texts that are not cached are split into token-bounded batches sent concurrently,
+  // onProgress reports the number of texts embedded so far.
+  void generateEmbeddings(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddingsList, EmbeddingClient::EncodeType et,
+    const ProgressFn &onProgress = {}) const;
   void generateEmbeddings(const std::string &text, std::vector<float> &embeddings, EmbeddingClient::EncodeType et) const;
 
   static float calculateL2Norm(const std::vector<float> &vec);
+
+  // Upper bounds for the adaptive batching; the number of requests in flight adapts per endpoint.
+  // A busy server asking to wait longer than maxRetryAfterMs fails the batch instead.
+  static void configureBatching(size_t maxConcurrency, size_t batchTokens, size_t maxBatchItems, size_t retryAttempts, size_t maxRetryAfterMs);
+  // Query embeddings still pending after the endpoint's p95 latency (initialDelayMs until
+  // enough requests were timed) are sent to a second endpoint as well; the first answer wins.
+  static void configureHedging(bool enabled, size_t initialDelayMs);
+
+  // Embedding endpoints that batches may be spread across. Enabled entries serving the
+  // same model with the same formats as a client's own endpoint share its work; peers
+  // returning vectors of another dimension than vectorDim are ejected.
+  static void configureEndpoints(const std::vector<ApiConfig> &apis, size_t vectorDim);
+  struct EndpointStats {
+    std::string apiUrl;
+    size_t requests = 0;
+    size_t errors = 0;
+    size_t inFlight = 0;
+    double limit = 0;
+    double msPerToken = 0;
+    bool ejected = false;
+    double p50Ms = 0; // latency of query requests
+    double p95Ms = 0;
+    size_t hedges = 0; // requests sent as a hedge, and how many answered first
+    size_t hedgeWins = 0;
+  };
+  static std::vector<EndpointStats> endpointStats();
+
+  // Process-wide embedding cache consulted before any request is sent, owned by App.
+  static void setCache(EmbeddingCache *cache);
+  static EmbeddingCache *cache();
+  // Process-wide in-memory cache of query embeddings, checked before the disk cache.
+  static void setQueryCache(QueryEmbeddingCache *cache);
+  static QueryEmbeddingCache *queryCache();
+  // Always ask this very server, e.g. when testing a provider
+  void bypassCache(bool bypass = true) { bypassCache_ = bypass; }
+
 private:
+  bool bypassCache_ = false;
+
   std::vector<std::string> prepareContent(const std::vector<std::string> &texts, EmbeddingClient::EncodeType et) const;
+  void embedContent(const std::vector<std::string> &content, std::vector<std::vector<float>> &embeddingsList, EncodeType et,
+    const ProgressFn &onProgress) const;
+  void requestEmbeddings(const std::vector<std::string> &content, std::vector<std::vector<float>> &embeddingsList, EncodeType et,
+    const ProgressFn &onProgress) const;
+  bool postHedged(const std::vector<ApiConfig> &apis, const std::vector<std::string> &content, size_t tokens,
+    std::vector<std::vector<float>> &embeddingsList) const;
+  std::vector<ApiConfig> endpoints() const;
+  static void postBatch(const ApiConfig &api, size_t timeoutMs, const std::vector<std::string> &content, std::vector<std::vector<float>> &embeddingsList);
+  std::string cacheModelKey() const;
 };
 
 class CompletionClient : public InferenceClient {
   const App &app_;
 public:
+  // Token counts as reported by the server; reported stays false when the
+  // response carried no usage (e.g. streaming without stream_usage).
+  struct Usage {
+    size_t promptTokens = 0;
+    size_t cachedTokens = 0;
+    size_t completionTokens = 0;
+    bool reported = false;
+  };
+  // Receives every upstream stream event as is, without the blank line ending it
+  using RawEventFn = std::function<void(std::string_view event)>;
+
   CompletionClient(const ApiConfig &cfg, size_t timeout, const App &a);
+  // The context goes into a leading system message (instructions, then the sources in
+  // a stable order) so that consecutive requests share a prefix the server can cache.
+  // With onRawEvent set, streamed events are relayed through it and onStream only
+  // gets status and error messages.
   std::string generateCompletion(
     const nlohmann::json &messages, 
     const std::vector<SearchResult> &searchRes, 
     float temperature,
     size_t maxTokens,
-    std::function<void(const std::string &)> onStream) const;
+    std::function<void(const std::string &)> onStream,
+    Usage *usage = nullptr,
+    const RawEventFn &onRawEvent = {}) const;
 
 private:
 };
@@ -0,0 +1,41 @@
+#ifndef _SEARCHCACHE_H_
+#define _SEARCHCACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct SearchResult;
+
+// LRU of complete search result sets. Query vectors are reduced to a
+// random-hyperplane LSH signature, so queries whose embeddings differ only
+// by a few degrees share an entry. Entries belong to one database
+// generation and are dropped as soon as a newer generation is seen.
+class SearchResultCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t invalidations = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t maxEntries = 0;
+  };
+
+  SearchResultCache(size_t maxEntries, size_t lshBits = 64);
+  ~SearchResultCache();
+
+  bool lookup(const std::vector<float> &query, size_t topK, const std::string &filter,
+    uint64_t generation, std::vector<SearchResult> &results);
+  void store(const std::vector<float> &query, size_t topK, const std::string &filter,
+    uint64_t generation, const std::vector<SearchResult> &results);
+
+  Stats stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+};
+
+#endif // _SEARCHCACHE_H_
@@ -21,6 +21,11 @@ struct ApiConfig {
   bool enabled = true;
   bool stream = true;
   size_t contextLength = 0;
+  // Prompt cache hint sent with completions: "cache_prompt" (llama-server) or
+  // "cache_control" (Anthropic style content blocks); empty for providers that
+  // cache prefixes on their own.
+  std::string promptCache;
+  bool streamUsage = false; // ask for token usage at the end of a stream
   struct {
     float input = 0;
     float output = 0;
@@ -52,6 +57,13 @@ struct ApiConfig {
 
 };
 
+// Limits of one class of server routes, see server.admission
+struct AdmissionConfig {
+  size_t maxConcurrent = 0; // 0: bounded by the worker capacity only
+  size_t maxQueue = 0;      // requests allowed to wait for a slot
+  float shedAt = 1.0f;      // share of the worker capacity in use above which the class is refused
+};
+
 class Settings {
 private:
   nlohmann::json config_;
@@ -85,21 +97,37 @@ public:
   size_t chunkingMinTokens() const { return config_["chunking"].value("nof_min_tokens", size_t(50)); }
   float chunkingOverlap() const { return config_["chunking"].value("overlap_percentage", 0.1f); }
   bool chunkingSemantic() const { return config_["chunking"].value("semantic", false); }
+  size_t chunkingParallelMinKb() const { return config_["chunking"].value("parallel_min_kb", size_t(1024)); }
+  size_t chunkingThreads() const { return config_["chunking"].value("threads", size_t(0)); }
 
   ApiConfig embeddingCurrentApi() const;
   std::vector<ApiConfig> embeddingApis() const;
   size_t embeddingTimeoutMs() const { return config_["embedding"].value("timeout_ms", size_t(10'000)); }
-  size_t embeddingBatchSize() const { return config_["embedding"].value("batch_size", size_t(4)); }
+  size_t embeddingBatchSize() const { return config_["embedding"].value("batch_size", size_t(16)); }
+  size_t embeddingBatchTokens() const { return config_["embedding"].value("batch_tokens", size_t(2048)); }
+  size_t embeddingMaxConcurrency() const { return config_["embedding"].value("max_concurrency", size_t(4)); }
+  size_t embeddingRetryAttempts() const { return config_["embedding"].value("retry_attempts", size_t(3)); }
+  size_t embeddingMaxRetryAfterMs() const { return config_["embedding"].value("max_retry_after_ms", size_t(30'000)); }
+  bool embeddingHedgeQueries() const { return config_["embedding"].value("hedge_queries", false); }
+  size_t embeddingHedgeDelayMs() const { return config_["embedding"].value("hedge_initial_delay_ms", size_t(200)); }
   size_t embeddingTopK() const { return config_["embedding"].value("top_k", size_t(5)); }
   std::string embeddingPrependLabelFormat() const {
     return config_["embedding"].value("prepend_label_format", std::string(""));
   }
+  bool embeddingCacheEnabled() const { return config_["embedding"].value("cache_enabled", true); }
+  std::string embeddingCachePath() const { return config_["embedding"].value("cache_path", "./embedding_cache.db"); }
+  size_t embeddingCacheMaxEntries() const { return config_["embedding"].value("cache_max_entries", size_t(200'000)); }
+  size_t embeddingQueryCacheSize() const { return config_["embedding"].value("query_cache_size", size_t(1000)); }
+  size_t embeddingQueryCacheTtlSec() const { return config_["embedding"].value("query_cache_ttl_s", size_t(600)); }
 
   ApiConfig generationCurrentApi() const;
   std::vector<ApiConfig> generationApis() const;
   size_t generationTimeoutMs() const { return config_["generation"].value("timeout_ms", size_t(20'000)); }
   size_t generationMaxFullSources() const { return config_["generation"].value("max_full_sources", size_t(2)); }
   size_t generationMaxRelatedPerSource() const { return config_["generation"].value("max_related_per_source", size_t(3)); }
+  size_t generationSourceCacheMb() const { return config_["generation"].value("source_cache_mb", size_t(64)); }
+  size_t generationSessionCacheSize() const { return config_["generation"].value("session_cache_size", size_t(200)); }
+  size_t generationSessionTtlS() const { return config_["generation"].value("session_ttl_s", size_t(1800)); }
   //size_t generationMaxContextTokens() const { return config_["generation"].value("max_context_tokens", size_t(20'000)); }
   size_t generationMaxChunks() const { return config_["generation"].value("max_chunks", size_t(5)); }
   float generationDefaultTemperature() const { return config_["generation"].value("default_temperature", 0.5f); }
@@ -125,6 +153,8 @@ public:
   size_t databaseVectorDim() const { return config_["database"].value("vector_dim", size_t(768)); }
   size_t databaseMaxElements() const { return config_["database"].value("max_elements", size_t(100'000)); }
   std::string databaseDistanceMetric() const { return config_["database"].value("distance_metric", "cosine"); }
+  size_t databaseResultCacheSize() const { return config_["database"].value("result_cache_size", size_t(0)); }
+  size_t databaseResultCacheLshBits() const { return config_["database"].value("result_cache_lsh_bits", size_t(64)); }
 
   size_t filesMaxFileSizeMb() const { return config_["source"].value("max_file_size_mb", size_t(10)); }
   std::string filesEncoding() const { return config_["source"].value("encoding", "utf-8"); }
@@ -144,6 +174,25 @@ public:
     return config_.contains("logging") ? config_["logging"].value("log_to_console", true) : true;
   }
 
+  size_t connectionPoolMaxIdlePerHost() const {
+    return config_.contains("connection_pool") ? config_["connection_pool"].value("max_idle_per_host", size_t(8)) : size_t(8);
+  }
+  size_t connectionPoolIdleTimeoutMs() const {
+    return config_.contains("connection_pool") ? config_["connection_pool"].value("idle_timeout_ms", size_t(5000)) : size_t(5000);
+  }
+
+  size_t serverWorkerThreads() const {
+    return config_.contains("server") ? config_["server"].value("worker_threads", size_t(8)) : size_t(8);
+  }
+  size_t serverMaxStreams() const {
+    return config_.contains("server") ? config_["server"].value("max_streams", size_t(32)) : size_t(32);
+  }
+  bool serverAdmissionEnabled() const;
+  size_t serverReservedWorkers() const;
+  size_t serverMaxQueueWaitMs() const;
+  // cls is "interactive", "chat" or "bulk"
+  AdmissionConfig serverAdmission(const std::string &cls) const;
+
   void initProjectIdIfMissing(bool hydrateFile);
   void initProjectTitleIfMissing(bool hydrateFile);
 
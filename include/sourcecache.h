@@ -0,0 +1,54 @@
+#ifndef _SOURCECACHE_H_
+#define _SOURCECACHE_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+// Sanitized text and token count of local source files used as chat context.
+// Every lookup checks the file's mtime and size, and the updater drops the
+// files it re-indexes, so a hit never serves stale content. Bounded by the
+// total size of the cached text, least recently used files go first.
+class SourceContentCache {
+public:
+  struct Entry {
+    std::string content;
+    size_t tokens = 0;
+  };
+  // What a file is recognized by; taken before reading it, see store
+  struct Stamp {
+    std::filesystem::file_time_type mtime;
+    uintmax_t size = 0;
+    bool operator==(const Stamp &) const = default;
+  };
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t invalidations = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t maxBytes = 0;
+  };
+
+  explicit SourceContentCache(size_t maxBytes);
+  ~SourceContentCache();
+
+  static bool stampOf(const std::string &path, Stamp &stamp);
+
+  bool lookup(const std::string &path, Entry &entry);
+  // stamp is the file's stamp from before its content was read; nothing is stored
+  // when the file has changed since.
+  void store(const std::string &path, const Stamp &stamp, const Entry &entry);
+  void invalidate(const std::string &path);
+  void clear();
+
+  Stats stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+};
+
+#endif // _SOURCECACHE_H_
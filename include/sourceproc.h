@@ -4,6 +4,9 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
 #include "settings.h"
 
 
@@ -22,7 +25,6 @@ public:
   void setSettings(const Settings &s) { settings_ = s; }
   std::vector<SourceProcessor::Data> collectSources(bool readContent);
   SourceProcessor::Data fetchSource(const std::string &uri) const;
-  std::vector<std::string> filterRelatedSources(const std::vector<std::string> &sources, const std::string &src) const;
   static bool readFile(const std::string &uri, std::string &data);
 
 private:
@@ -34,4 +36,36 @@ private:
   static bool hasValidExtension(const std::string &filepath, const std::vector<std::string> &extensions);
 };
 
+// Tracked files by stem. A file is related to a source when its stem equals
+// or contains the source's stem; matches come in tracking order, the source
+// itself excluded, without scanning every file. Stems are kept in a suffix array,
+// so a lookup costs a binary search plus the number of matches. The updater
+// adds and removes files as it goes; the array is re-sorted lazily on the
+// next lookup after a change.
+class RelatedSourceIndex {
+public:
+  void rebuild(const std::vector<std::string> &paths);
+  void add(const std::string &path);
+  void remove(const std::string &path);
+  // At most maxResults tracked files related to `path`, in tracking order
+  std::vector<std::string> find(const std::string &path, size_t maxResults) const;
+  size_t size() const;
+
+private:
+  struct File {
+    std::string path;
+    std::string stem;
+    bool removed = false;
+  };
+  void sortSuffixes() const;
+
+  mutable std::vector<File> files_;
+  mutable std::unordered_map<std::string, size_t> byPath_; // live files only
+  mutable std::string text_;             // stems, each terminated by '\0'
+  mutable std::vector<uint32_t> suffixes_;
+  mutable std::vector<uint32_t> owner_;  // file of each text position
+  mutable bool dirty_ = false;
+  mutable std::mutex mutex_;
+};
+
 #endif // _SOURCEPROC_H_
\ No newline at end of file
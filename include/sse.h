@@ -0,0 +1,43 @@
+#ifndef _SSE_H_
+#define _SSE_H_
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+// Incremental reader of a server-sent events stream. Received bytes go into one
+// buffer whose consumed front is dropped only once it outweighs the rest, so every
+// byte is scanned once and moved a bounded number of times however long the stream
+// runs. Events are handed out as views into the buffer, without the blank line
+// that ends them.
+class SseParser {
+public:
+  using EventFn = std::function<bool(std::string_view event)>;
+
+  // Calls onEvent for every event completed by data; stops and returns false as
+  // soon as onEvent does.
+  bool feed(const char *data, size_t len, const EventFn &onEvent);
+  // Bytes of the event not completed yet
+  std::string_view pending() const;
+
+  // Payload of the event's data lines, joined by newlines when there are several
+  // (only then is scratch used); empty for comments and keep-alives.
+  static std::string_view data(std::string_view event, std::string &scratch);
+
+private:
+  std::string buf_;
+  size_t head_ = 0; // start of the first unconsumed event
+  size_t scan_ = 0; // searched for its end up to here
+};
+
+namespace sse {
+  // Reads choices[0].delta.content (reasoning_content when there is no content) of an
+  // OpenAI style stream chunk in one pass, without building a document. Returns false
+  // for malformed input; needsFull is set when the chunk carries usage or timings.
+  bool extractDelta(std::string_view json, std::string &content, bool &needsFull);
+
+  // Appends s as a quoted JSON string.
+  void appendJsonString(std::string &out, std::string_view s);
+}
+
+#endif // _SSE_H_
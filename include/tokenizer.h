@@ -5,10 +5,11 @@
 #include <string_view>
 #include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
 #include "nlohmann/json.hpp"
 
 class SimpleTokenizer {
-  mutable std::mutex mutex_;
+  mutable std::shared_mutex mutex_; // cache hits only take a shared lock
   mutable std::unordered_map<std::string, size_t> cache_;
 private:
   nlohmann::json vocab_;
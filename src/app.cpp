@@ -2,6 +2,8 @@
 #include "settings.h"
 #include "database.h"
 #include "inference.h"
+#include "embcache.h"
+#include "sourcecache.h"
 #include "chunker.h"
 #include "tokenizer.h"
 #include "sourceproc.h"
@@ -16,6 +18,7 @@
 #include <sstream>
 #include <ctime>
 #include <cmath>
+#include <cstring>
 #include <iomanip>
 #include <unordered_map>
 #include <unordered_set>
@@ -119,6 +122,34 @@ std::string utils::trimmed(std::string_view sv)
   return (wsfront < wsback ? std::string(wsfront, wsback) : std::string{});
 }
 
+// 64-bit content fingerprint (XXH64-style single lane) as 16 hex digits.
+std::string utils::contentHash(std::string_view data)
+{
+  constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+  constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+  constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+  constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+  constexpr uint64_t P5 = 0x27D4EB2F165667C5ull;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  uint64_t h = P5 + data.size();
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t k;
+    std::memcpy(&k, data.data() + i, 8);
+    k = rotl(k * P2, 31) * P1;
+    h = rotl(h ^ k, 27) * P1 + P4;
+  }
+  for (; i < data.size(); ++i) {
+    h = rotl(h ^ (static_cast<unsigned char>(data[i]) * P5), 11) * P1;
+  }
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return fmt::format("{:016x}", h);
+}
+
 
 namespace {
 
@@ -132,35 +163,103 @@ namespace {
     return url.substr(0, pos);
   }
 
-  size_t addEmbedChunks(const std::vector<Chunk> &chunks, size_t batchSize, const EmbeddingClient &ec, VectorDatabase &db, std::string_view prependlabelFmt) {
+  // The exact text sent to the embedder for a chunk
+  std::string embeddingInput(const Chunk &chunk, std::string_view prependlabelFmt) {
+    std::string text = chunk.str();
+    if (!prependlabelFmt.empty()) {
+      std::string info;
+      try {
+        info = std::filesystem::path(chunk.docUri).filename().string();
+      } catch (...) {
+        info = chunk.docUri;
+      }
+      auto label = fmt::vformat(prependlabelFmt, fmt::make_format_args(info));
+      text = label + "\n\n" + text;
+    }
+    return text;
+  }
+
+  using EmbeddingsByHash = std::unordered_map<std::string, std::vector<float>>;
+
+  // Chunks with their embedding inputs, each hash set to that of its input
+  struct HashedChunks {
+    std::vector<Chunk> chunks;
+    std::vector<std::string> texts;
+  };
+
+  HashedChunks hashChunks(const std::vector<Chunk> &chunks, std::string_view prependlabelFmt) {
+    HashedChunks hc{ chunks, {} };
+    hc.texts.reserve(chunks.size());
+    for (auto &chunk : hc.chunks) {
+      hc.texts.push_back(embeddingInput(chunk, prependlabelFmt));
+      chunk.hash = utils::contentHash(hc.texts.back());
+    }
+    return hc;
+  }
+
+  // Embeddings already stored for chunks with the same content, e.g. the unchanged parts
+  // of a modified file or a vendored copy of an indexed file.
+  EmbeddingsByHash findReusableEmbeddings(const HashedChunks &hc, const VectorDatabase &db, const EmbeddingsByHash *known = nullptr) {
+    std::vector<std::string> hashes;
+    hashes.reserve(hc.chunks.size());
+    for (const auto &chunk : hc.chunks) {
+      if (!known || !known->count(chunk.hash)) hashes.push_back(chunk.hash);
+    }
+    return hashes.empty() ? EmbeddingsByHash{} : db.getEmbeddingsByHash(hashes);
+  }
+
+  // known: embeddings looked up before, only the other hashes are queried
+  size_t addEmbedChunks(HashedChunks hc, size_t batchSize, const EmbeddingClient &ec, VectorDatabase &db,
+    const EmbeddingsByHash *known = nullptr) {
     size_t totalTokens = 0;
-    size_t iBatch = 1;
-    const size_t nofBatches = static_cast<size_t>(std::ceil(chunks.size() / double(batchSize)));
-    for (size_t i = 0; i < chunks.size(); i += batchSize) {
-      size_t end = (std::min)(i + batchSize, chunks.size());
-      std::vector<Chunk> batch(chunks.begin() + i, chunks.begin() + end);
-      std::vector<std::vector<float>> embeddings;
-      std::vector<std::string> texts;
-      for (const auto &chunk : batch) {
-        auto text = chunk.text;
-        if (!prependlabelFmt.empty()) {
-          std::string info;
-          try {
-            info = std::filesystem::path(chunk.docUri).filename().string();
-          } catch (...) {
-            info = chunk.docUri;
-          }
-          auto label = fmt::vformat(prependlabelFmt, fmt::make_format_args(info));
-          text = label + "\n\n" + text;
-        }
-        texts.push_back(std::move(text));
-        totalTokens += chunk.metadata.tokenCount;
+    auto &hashed = hc.chunks;
+    auto &texts = hc.texts;
+    auto reusable = findReusableEmbeddings(hc, db, known);
+    if (known) reusable.insert(known->begin(), known->end());
+
+    // Only content not seen before goes to the embedder, once per distinct hash
+    std::vector<std::vector<float>> embeddings(hashed.size());
+    std::vector<size_t> missing;
+    std::unordered_map<std::string, size_t> firstByHash;
+    size_t nofReused = 0;
+    for (size_t i = 0; i < hashed.size(); ++i) {
+      if (auto it = reusable.find(hashed[i].hash); it != reusable.end()) {
+        embeddings[i] = it->second;
+        nofReused++;
+      } else if (firstByHash.emplace(hashed[i].hash, i).second) {
+        missing.push_back(i);
       }
-      std::cout << "GENERATING embeddings for batch " << iBatch++ << "/" << nofBatches << "\r" << std::flush;
-      ec.generateEmbeddings(texts, embeddings, EmbeddingClient::EncodeType::Document);
-      db.addDocuments(batch, embeddings);
-      std::cout << "  Processed all chunks.                     \r" << std::flush;
     }
+    if (!missing.empty()) {
+      // the client batches by tokens and keeps several requests in flight
+      std::vector<std::string> missingTexts;
+      missingTexts.reserve(missing.size());
+      for (size_t i : missing) {
+        missingTexts.push_back(std::move(texts[i]));
+        totalTokens += hashed[i].metadata.tokenCount;
+      }
+      std::vector<std::vector<float>> missingEmbeddings;
+      ec.generateEmbeddings(missingTexts, missingEmbeddings, EmbeddingClient::EncodeType::Document, [](size_t done, size_t total) {
+        std::cout << "GENERATING embeddings " << done << "/" << total << "\r" << std::flush;
+        });
+      for (size_t k = 0; k < missing.size() && k < missingEmbeddings.size(); ++k) {
+        embeddings[missing[k]] = std::move(missingEmbeddings[k]);
+      }
+    }
+    for (size_t i = 0; i < hashed.size(); ++i) {
+      if (embeddings[i].empty()) embeddings[i] = embeddings[firstByHash.at(hashed[i].hash)];
+    }
+    if (0 < nofReused) {
+      LOG_MSG << "  Reused" << nofReused << "of" << hashed.size() << "embeddings";
+    }
+    // Insert in document order, chunk ids follow the source layout
+    for (size_t i = 0; i < hashed.size(); i += batchSize) {
+      size_t end = (std::min)(i + batchSize, hashed.size());
+      std::vector<Chunk> batch(std::make_move_iterator(hashed.begin() + i), std::make_move_iterator(hashed.begin() + end));
+      std::vector<std::vector<float>> batchEmbeddings(std::make_move_iterator(embeddings.begin() + i), std::make_move_iterator(embeddings.begin() + end));
+      db.addDocuments(batch, batchEmbeddings);
+    }
+    std::cout << "  Processed all chunks.                     \r" << std::flush;
     return totalTokens;
   }
 
@@ -254,7 +353,6 @@ namespace {
         LOG_MSG << "Updating:" << filepath;
         try {
           db_->beginTransaction();
-          db_->deleteDocumentsBySource(filepath);
           std::string content;
           SourceProcessor::readFile(filepath, content);
           if (content.empty()) {
@@ -263,7 +361,11 @@ namespace {
             continue;
           }
           auto chunks = chunker.chunkText(content, filepath);
-          addEmbedChunks(chunks, batchSize_, client, *db_, app_.settings().embeddingPrependLabelFormat());
+          // Unchanged chunks keep their embeddings; collect them before the old chunks go
+          auto hashed = hashChunks(chunks, app_.settings().embeddingPrependLabelFormat());
+          auto known = findReusableEmbeddings(hashed, *db_);
+          db_->deleteDocumentsBySource(filepath);
+          addEmbedChunks(std::move(hashed), batchSize_, client, *db_, &known);
           totalUpdated++;
           clearFailure(filepath);
           LOG_MSG << "  Updated with" << chunks.size() << " chunks";
@@ -290,7 +392,7 @@ namespace {
             continue;
           }
           auto chunks = chunker.chunkText(content, filepath);
-          addEmbedChunks(chunks, batchSize_, client, *db_, app_.settings().embeddingPrependLabelFormat());
+          addEmbedChunks(hashChunks(chunks, app_.settings().embeddingPrependLabelFormat()), batchSize_, client, *db_);
           totalUpdated++;
           clearFailure(filepath);
           LOG_MSG << "  Added with" << chunks.size() << " chunks";
@@ -482,9 +584,13 @@ struct App::Impl {
   std::unique_ptr<Settings> settings_;
   std::unique_ptr<AdminAuth> auth_;
   std::unique_ptr<VectorDatabase> db_;
+  std::unique_ptr<EmbeddingCache> embeddingCache_;
+  std::unique_ptr<QueryEmbeddingCache> queryCache_;
+  std::unique_ptr<SourceContentCache> sourceCache_;
   std::unique_ptr<SimpleTokenizer> tokenizer_;
   std::unique_ptr<Chunker> chunker_;
   std::unique_ptr<SourceProcessor> processor_;
+  std::unique_ptr<RelatedSourceIndex> relatedIndex_;
   std::unique_ptr<IncrementalUpdater> updater_;
   std::unique_ptr<HttpServer> httpServer_;
 
@@ -498,6 +604,14 @@ struct App::Impl {
   //std::string projectTitle_;
 
   static std::string binaryName_;
+
+  void reindexRelatedSources() {
+    std::vector<std::string> paths;
+    for (const auto &tf : db_->getTrackedFiles()) {
+      paths.push_back(tf.path);
+    }
+    relatedIndex_->rebuild(paths);
+  }
 };
 std::string App::Impl::binaryName_ = "";
 
@@ -509,6 +623,8 @@ App::App() : imp(new Impl)
 App::~App()
 {
   if (imp->httpServer_) imp->httpServer_->stop();
+  EmbeddingClient::setCache(nullptr);
+  EmbeddingClient::setQueryCache(nullptr);
 }
 
 void App::initialize(/*const std::string &configPath*/)
@@ -527,6 +643,28 @@ void App::initialize(/*const std::string &configPath*/)
 
   imp->db_ = std::make_unique<HnswSqliteVectorDatabase>(dbPath, indexPath, vectorDim, maxElements, metric);
 
+  InferenceClient::configurePool(ss.connectionPoolMaxIdlePerHost(), ss.connectionPoolIdleTimeoutMs());
+  EmbeddingClient::configureBatching(ss.embeddingMaxConcurrency(), ss.embeddingBatchTokens(), ss.embeddingBatchSize(), ss.embeddingRetryAttempts(), ss.embeddingMaxRetryAfterMs());
+  EmbeddingClient::configureHedging(ss.embeddingHedgeQueries(), ss.embeddingHedgeDelayMs());
+  EmbeddingClient::configureEndpoints(ss.embeddingApis(), ss.databaseVectorDim());
+
+  if (ss.embeddingCacheEnabled()) {
+    try {
+      imp->embeddingCache_ = std::make_unique<EmbeddingCache>(ss.embeddingCachePath(), ss.embeddingCacheMaxEntries());
+      EmbeddingClient::setCache(imp->embeddingCache_.get());
+    } catch (const std::exception &e) {
+      LOG_MSG << "Embedding cache disabled:" << e.what();
+    }
+  }
+  if (ss.embeddingQueryCacheSize() > 0) {
+    imp->queryCache_ = std::make_unique<QueryEmbeddingCache>(ss.embeddingQueryCacheSize(), std::chrono::seconds(ss.embeddingQueryCacheTtlSec()));
+    EmbeddingClient::setQueryCache(imp->queryCache_.get());
+  }
+
+  if (ss.generationSourceCacheMb() > 0) {
+    imp->sourceCache_ = std::make_unique<SourceContentCache>(ss.generationSourceCacheMb() * 1024 * 1024);
+  }
+
   imp->tokenizer_ = std::make_unique<SimpleTokenizer>(ss.tokenizerConfigPath());
 
   size_t minTokens = ss.chunkingMinTokens();
@@ -534,7 +672,10 @@ void App::initialize(/*const std::string &configPath*/)
   float overlap = ss.chunkingOverlap();
 
   imp->chunker_ = std::make_unique<Chunker>(*imp->tokenizer_, minTokens, maxTokens, overlap);
+  imp->chunker_->setParallel(ss.chunkingParallelMinKb() * 1024, ss.chunkingThreads());
   imp->processor_ = std::make_unique<SourceProcessor>(*imp->settings_);
+  imp->relatedIndex_ = std::make_unique<RelatedSourceIndex>();
+  imp->reindexRelatedSources();
   imp->updater_ = std::make_unique<IncrementalUpdater>(this, imp->settings_->embeddingBatchSize());
 
   imp->httpServer_ = std::make_unique<HttpServer>(*this);
@@ -556,6 +697,7 @@ bool App::testSettings() const
       std::string textB1 = "float main() { reutrn 0.f; }";
       std::string textC0 = "class Foo { void bar() { std::cout << \"hello\"; } };";
       EmbeddingClient cl{ api, settings().embeddingTimeoutMs() };
+      cl.bypassCache();
       std::vector<float> vA0;
       cl.generateEmbeddings(textA0, vA0, EmbeddingClient::EncodeType::Query);
       if (vA0.size() == 0) {
@@ -720,7 +862,7 @@ void App::embed(bool noPrompt)
 
       LOG_MSG << "  Generated" << chunks.size() << "chunks";
       const size_t batchSize = imp->settings_->embeddingBatchSize();
-      totalTokens += addEmbedChunks(chunks, batchSize, embeddingClient, *imp->db_, settings().embeddingPrependLabelFormat());
+      totalTokens += addEmbedChunks(hashChunks(chunks, settings().embeddingPrependLabelFormat()), batchSize, embeddingClient, *imp->db_);
       std::cout << std::endl;
       totalChunks += chunks.size();
       totalFiles++;
@@ -733,6 +875,7 @@ void App::embed(bool noPrompt)
     }
   }
   imp->db_->persist();
+  imp->reindexRelatedSources();
   LOG_MSG << "\nCompleted!";
   LOG_MSG << "  Files processed:" << totalFiles;
   LOG_MSG << "  Files skipped:" << skippedFiles;
@@ -783,6 +926,7 @@ void App::clear(bool noPrompt)
 {
   if (noPrompt) {
       imp->db_->clear();
+      imp->relatedIndex_->rebuild({});
       LOG_MSG << "Database cleared.";
   } else {
     std::cout << "Are you sure you want to clear all data? [y/N]: ";
@@ -790,6 +934,7 @@ void App::clear(bool noPrompt)
     std::cin >> confirm;
     if (confirm == "y") {
       imp->db_->clear();
+      imp->relatedIndex_->rebuild({});
       LOG_MSG << "Database cleared.";
     } else {
       std::cout << "Cancelled." << std::endl;
@@ -992,6 +1137,11 @@ size_t App::update()
   }
   auto info = imp->updater_->detectChanges(currentFiles);
   imp->updater_->printUpdateSummary(info);
+  if (imp->sourceCache_) {
+    for (const auto *files : { &info.modifiedFiles, &info.deletedFiles }) {
+      for (const auto &path : *files) imp->sourceCache_->invalidate(path);
+    }
+  }
   if (!imp->updater_->needsUpdate(info)) {
     LOG_MSG << "No updates needed. Database is up to date.";
     return 0;
@@ -999,6 +1149,12 @@ size_t App::update()
   LOG_MSG << "Applying updates...";
   EmbeddingClient embeddingClient{ settings().embeddingCurrentApi(), settings().embeddingTimeoutMs() };
   size_t updated = imp->updater_->updateDatabase(embeddingClient, *imp->chunker_, info);
+  for (const auto &path : info.deletedFiles) {
+    imp->relatedIndex_->remove(path);
+  }
+  for (const auto &path : info.newFiles) {
+    if (imp->db_->fileExistsInMetadata(path)) imp->relatedIndex_->add(path);
+  }
   LOG_MSG << "Update completed! " << updated << " file(s) processed.";
 
   imp->lastUpdateTime_ = std::chrono::system_clock::now();
@@ -1042,6 +1198,21 @@ const SourceProcessor &App::sourceProcessor() const
   return *imp->processor_;
 }
 
+const RelatedSourceIndex &App::relatedSources() const
+{
+  return *imp->relatedIndex_;
+}
+
+void App::documentAdded(const std::string &path)
+{
+  if (imp->db_->fileExistsInMetadata(path)) imp->relatedIndex_->add(path);
+}
+
+SourceContentCache *App::sourceCache() const
+{
+  return imp->sourceCache_.get();
+}
+
 const Chunker &App::chunker() const
 {
   return *imp->chunker_;
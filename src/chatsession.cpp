@@ -0,0 +1,138 @@
+#include "chatsession.h"
+#include <list>
+#include <unordered_map>
+
+
+namespace {
+  // question parts remembered per conversation
+  const size_t _maxQueries = 64;
+} // anonymous namespace
+
+
+const ChatSession::Source *ChatSession::findSource(const std::vector<Source> &kept, const std::string &src, size_t offset,
+  const std::function<bool(const Source &)> &fits)
+{
+  for (const auto &s : kept) {
+    if (s.result.sourceId != src) continue;
+    if (!s.whole && s.offset != offset) return nullptr;
+    return fits(s) ? &s : nullptr;
+  }
+  return nullptr;
+}
+
+const ChatSession::Query *ChatSession::findQuery(const std::string &text) const
+{
+  for (const auto &q : queries) {
+    if (q.text == text) return &q;
+  }
+  return nullptr;
+}
+
+void ChatSession::addQuery(Query query)
+{
+  if (findQuery(query.text)) return;
+  if (queries.size() >= _maxQueries) {
+    queries.erase(queries.begin());
+  }
+  queries.push_back(std::move(query));
+}
+
+void ChatSession::reset(uint64_t gen)
+{
+  generation = gen;
+  queries.clear();
+  previousHits.clear();
+  contextKey.clear();
+  sources.clear();
+  related.clear();
+}
+
+//---------------------------------------------------------------------------
+
+
+struct ChatSessionStore::Impl {
+  using Clock = std::chrono::steady_clock;
+  struct Entry {
+    std::string id;
+    std::shared_ptr<ChatSession> session;
+    Clock::time_point expires;
+  };
+
+  size_t maxEntries_ = 0;
+  std::chrono::seconds ttl_{ 0 };
+  std::list<Entry> lru_; // most recent first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+
+  void expire(Clock::time_point now) {
+    while (!lru_.empty() && lru_.back().expires <= now) {
+      index_.erase(lru_.back().id);
+      lru_.pop_back();
+      stats_.expired ++;
+    }
+  }
+};
+
+ChatSessionStore::ChatSessionStore(size_t maxSessions, std::chrono::seconds ttl) : imp(new Impl)
+{
+  imp->maxEntries_ = maxSessions;
+  imp->ttl_ = ttl;
+  imp->stats_.maxEntries = maxSessions;
+}
+
+ChatSessionStore::~ChatSessionStore()
+{
+}
+
+std::shared_ptr<ChatSession> ChatSessionStore::acquire(const std::string &id)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto now = Impl::Clock::now();
+  // the list is ordered by last use, so expired entries collect at the back
+  imp->expire(now);
+  auto it = imp->index_.find(id);
+  if (it != imp->index_.end()) {
+    it->second->expires = now + imp->ttl_;
+    imp->lru_.splice(imp->lru_.begin(), imp->lru_, it->second);
+    imp->stats_.hits ++;
+    return it->second->session;
+  }
+  auto session = std::make_shared<ChatSession>();
+  imp->lru_.push_front({ id, session, now + imp->ttl_ });
+  imp->index_[id] = imp->lru_.begin();
+  imp->stats_.created ++;
+  while (imp->lru_.size() > imp->maxEntries_) {
+    imp->index_.erase(imp->lru_.back().id);
+    imp->lru_.pop_back();
+    imp->stats_.evictions ++;
+  }
+  imp->stats_.entries = imp->lru_.size();
+  return session;
+}
+
+void ChatSessionStore::remove(const std::string &id)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto it = imp->index_.find(id);
+  if (it != imp->index_.end()) {
+    imp->lru_.erase(it->second);
+    imp->index_.erase(it);
+  }
+  imp->stats_.entries = imp->lru_.size();
+}
+
+void ChatSessionStore::countReuse(size_t queries, bool context)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  imp->stats_.reusedQueries += queries;
+  if (context) imp->stats_.reusedContexts ++;
+}
+
+ChatSessionStore::Stats ChatSessionStore::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto s = imp->stats_;
+  s.entries = imp->lru_.size();
+  return s;
+}
@@ -1,14 +1,19 @@
 #include "chunker.h"
-#include <sstream>
 #include <algorithm>
 #include <string>
 #include <string_view>
 #include <unordered_set>
+#include <unordered_map>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <iterator>
+#include <filesystem>
 #include <utils_log/logger.hpp>
 
 namespace {
   struct Unit {
-    std::string text;
+    std::string_view text;
     size_t tokens;
     size_t startChar;
     size_t endChar;
@@ -33,47 +38,132 @@ namespace {
     static constexpr double BINARY_THRESHOLD = 0.3;
     static constexpr size_t BINARY_CHECK_BYTES = 1024;
 
-    // Precompiled optimized regexes (thread-safe after initialization)
-    struct RegexPatterns {
-      std::regex classStruct;
-      std::regex functionDef;
-      std::regex accessModifiers;
-      std::regex imports;
-      std::regex varDeclarations;
-      std::regex controlFlow;
-      std::regex arrowFunctions;
-      std::regex loneBraces;
-      std::regex comments;
-      std::regex markdownFence;
-
-      RegexPatterns() :
-        classStruct(R"(\b(class|struct|interface|enum|trait)\s+\w+)",
-          std::regex_constants::optimize),
-        functionDef(R"(\b(def|function|func|fn|lambda|const\s+\w+\s*=\s*\([^)]*\)\s*=>)\s*)",
-          std::regex_constants::optimize),
-        accessModifiers(R"(\b(public|private|protected|static|final|virtual|override|async|await)\b)",
-          std::regex_constants::optimize),
-        imports(R"(^[ \t]*(#include|#import|import\s+\{|from\s+\S+\s+import|using\s+\w+))",
-          std::regex_constants::optimize),
-        varDeclarations(R"(\b(var|let|const|auto|int|float|double|bool|void|string)\s+\w+\s*[=;:])",
-          std::regex_constants::optimize),
-        controlFlow(R"(\bif\s*\(.*\)\s*\{|\bfor\s*\(.*\)|\bwhile\s*\()",
-          std::regex_constants::optimize),
-        arrowFunctions(R"(=>\s*\{|function\s*\(|:\s*function)",
-          std::regex_constants::optimize),
-        loneBraces(R"(^\s*[\{\}]\s*$)",
-          std::regex_constants::optimize),
-        comments(R"(^[ \t]*/[/*]|^[ \t]*\*|^[ \t]*//)",
-          std::regex_constants::optimize),
-        markdownFence(R"(^```)",
-          std::regex_constants::optimize)
-      {
+    // Hand-written scanners for the code indicators below (formerly nine std::regex
+    // searches per line). The union of matches is kept equivalent to:
+    //   \b(class|struct|interface|enum|trait)\s+\w+
+    //   \b(def|function|func|fn|lambda)
+    //   \b(public|private|protected|static|final|virtual|override|async|await)\b
+    //   ^[ \t]*(#include|#import|import\s+\{|from\s+\S+\s+import|using\s+\w+)
+    //   \b(var|let|const|auto|int|float|double|bool|void|string)\s+\w+\s*[=;:]
+    //   \bif\s*\(.*\)\s*\{|\bfor\s*\(.*\)|\bwhile\s*\(
+    //   =>\s*\{|function\s*\(|:\s*function
+    //   ^\s*[\{\}]\s*$
+    //   ^[ \t]*(//|/\*|\*)
+    static bool isWord(char c) {
+      return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    static bool isSpace(char c) {
+      return std::isspace(static_cast<unsigned char>(c));
+    }
+
+    static size_t skipSpaces(std::string_view s, size_t i) {
+      while (i < s.size() && isSpace(s[i])) i++;
+      return i;
+    }
+
+    static size_t skipWord(std::string_view s, size_t i) {
+      while (i < s.size() && isWord(s[i])) i++;
+      return i;
+    }
+
+    template <size_t N>
+    static bool isOneOf(std::string_view w, const std::string_view(&list)[N]) {
+      return std::find(std::begin(list), std::end(list), w) != std::end(list);
+    }
+
+    // Keyword followed by whitespace and a word: `class Foo`, `using namespace`.
+    static bool followedBySpaceWord(std::string_view s, size_t i) {
+      size_t j = skipSpaces(s, i);
+      return i < j && j < s.size() && isWord(s[j]);
+    }
+
+    static bool matchesLineStart(std::string_view line) {
+      size_t i = line.find_first_not_of(" \t");
+      if (i == std::string_view::npos) return false;
+      std::string_view rest = line.substr(i);
+      if (rest.starts_with("//") || rest.starts_with("/*") || rest.starts_with("*")) return true;
+      if (rest.starts_with("#include") || rest.starts_with("#import")) return true;
+      if (rest.starts_with("import")) {
+        size_t j = skipSpaces(rest, 6);
+        if (6 < j && j < rest.size() && rest[j] == '{') return true;
       }
-    };
+      if (rest.starts_with("using") && followedBySpaceWord(rest, 5)) return true;
+      if (rest.starts_with("from")) {
+        size_t j = skipSpaces(rest, 4);
+        size_t k = j;
+        while (k < rest.size() && !isSpace(rest[k])) k++;
+        size_t m = skipSpaces(rest, k);
+        if (4 < j && j < k && k < m && rest.substr(m).starts_with("import")) return true;
+      }
+      // Lone brace
+      size_t b = skipSpaces(line, 0);
+      if (b < line.size() && (line[b] == '{' || line[b] == '}') && skipSpaces(line, b + 1) == line.size()) return true;
+      return false;
+    }
+
+    static bool matchesKeyword(std::string_view line, size_t start, size_t end) {
+      static constexpr std::string_view typeKeywords[] = { "class", "struct", "interface", "enum", "trait" };
+      static constexpr std::string_view funcPrefixes[] = { "def", "func", "fn", "lambda" };
+      static constexpr std::string_view modifiers[] = {
+        "public", "private", "protected", "static", "final", "virtual", "override", "async", "await" };
+      static constexpr std::string_view declKeywords[] = {
+        "var", "let", "const", "auto", "int", "float", "double", "bool", "void", "string" };
+      std::string_view w = line.substr(start, end - start);
+      for (auto p : funcPrefixes) {
+        if (w.starts_with(p)) return true;
+      }
+      if (isOneOf(w, modifiers)) return true;
+      if (isOneOf(w, typeKeywords) && followedBySpaceWord(line, end)) return true;
+      if (isOneOf(w, declKeywords) && followedBySpaceWord(line, end)) {
+        size_t j = skipWord(line, skipSpaces(line, end));
+        j = skipSpaces(line, j);
+        if (j < line.size() && (line[j] == '=' || line[j] == ';' || line[j] == ':')) return true;
+      }
+      if (w == "if" || w == "for" || w == "while") {
+        size_t j = skipSpaces(line, end);
+        if (j == line.size() || line[j] != '(') return false;
+        if (w == "while") return true;
+        // `.*` does not cross line terminators
+        std::string_view rest = line.substr(j + 1);
+        rest = rest.substr(0, rest.find_first_of("\r\n"));
+        for (size_t k = rest.find(')'); k != std::string_view::npos; k = rest.find(')', k + 1)) {
+          if (w == "for") return true;
+          size_t m = skipSpaces(line, j + 1 + k + 1);
+          if (m < line.size() && line[m] == '{') return true;
+        }
+      }
+      return false;
+    }
 
-    static const RegexPatterns &getPatterns() {
-      static RegexPatterns patterns;
-      return patterns;
+    static bool matchesAnywhere(std::string_view line) {
+      for (size_t i = line.find("=>"); i != std::string_view::npos; i = line.find("=>", i + 1)) {
+        size_t j = skipSpaces(line, i + 2);
+        if (j < line.size() && line[j] == '{') return true;
+      }
+      for (size_t i = line.find("function"); i != std::string_view::npos; i = line.find("function", i + 1)) {
+        size_t j = skipSpaces(line, i + 8);
+        if (j < line.size() && line[j] == '(') return true;
+      }
+      for (size_t i = line.find(':'); i != std::string_view::npos; i = line.find(':', i + 1)) {
+        if (line.substr(skipSpaces(line, i + 1)).starts_with("function")) return true;
+      }
+      return false;
+    }
+
+    static bool hasCodeIndicator(std::string_view line) {
+      if (matchesLineStart(line) || matchesAnywhere(line)) return true;
+      size_t i = 0;
+      while (i < line.size()) {
+        if (!isWord(line[i])) {
+          i++;
+          continue;
+        }
+        size_t end = skipWord(line, i);
+        if (matchesKeyword(line, i, end)) return true;
+        i = end;
+      }
+      return false;
     }
 
     inline static const std::unordered_set<std::string> codeExtensions = {
@@ -111,7 +201,6 @@ namespace {
     }
 
     static bool hasMarkdownCodeBlocks(std::string_view text) {
-      const auto &patterns = getPatterns();
       int fenceCount = 0;
       size_t pos = 0;
       size_t linesChecked = 0;
@@ -120,14 +209,8 @@ namespace {
         size_t lineEnd = text.find('\n', pos);
         if (lineEnd == std::string_view::npos) lineEnd = text.size();
         std::string_view line = text.substr(pos, lineEnd - pos);
-        std::string lineStr(line); // Regex needs std::string
-        try {
-          if (std::regex_search(lineStr, patterns.markdownFence)) {
-            fenceCount++;
-          }
-        } catch (const std::regex_error &) {
-          // UTF-8 issues - bail out
-          return false;
+        if (line.starts_with("```")) {
+          fenceCount++;
         }
         pos = lineEnd + 1;
         linesChecked++;
@@ -135,15 +218,6 @@ namespace {
       return fenceCount >= 2;
     }
 
-    static bool tryRegexSearch(const std::string &line, const std::regex &pattern) {
-      try {
-        return std::regex_search(line, pattern);
-      } catch (const std::regex_error &) {
-        // Non-UTF8 or malformed input
-        return false;
-      }
-    }
-
   public:
     static Chunker::ContentType detectContentType(const std::string &text, const std::string &uri) {
       std::string_view textView(text);
@@ -158,7 +232,6 @@ namespace {
       if (textExtensions.count(ext)) {
         return Chunker::ContentType::Text;
       }
-      const auto &patterns = getPatterns();
       size_t totalLines = 0;
       size_t nonEmptyLines = 0;
       size_t codeIndicators = 0;
@@ -190,20 +263,7 @@ namespace {
           return Chunker::ContentType::Code;
         }
 
-        // Convert to string for regex (only if needed)
-        std::string line(lineView);
-
-        // Check patterns with UTF-8 error handling
-        bool matched = false;
-        matched = matched || tryRegexSearch(line, patterns.classStruct);
-        matched = matched || tryRegexSearch(line, patterns.functionDef);
-        matched = matched || tryRegexSearch(line, patterns.accessModifiers);
-        matched = matched || tryRegexSearch(line, patterns.imports);
-        matched = matched || tryRegexSearch(line, patterns.varDeclarations);
-        matched = matched || tryRegexSearch(line, patterns.controlFlow);
-        matched = matched || tryRegexSearch(line, patterns.arrowFunctions);
-        matched = matched || tryRegexSearch(line, patterns.loneBraces);
-        matched = matched || tryRegexSearch(line, patterns.comments);
+        bool matched = hasCodeIndicator(lineView);
 
         if (matched) {
           codeIndicators++;
@@ -263,37 +323,641 @@ namespace {
     }
   };
 
-  std::vector<std::string> splitUnits(const std::string &text) {
-    std::vector<std::string> result;
-    std::string buf;
-    auto flushBuf = [&]() {
-      if (!buf.empty()) {
-        result.push_back(buf);
-        buf.clear();
-      }
-      };
-    for (unsigned char c : text) {
+  // Splits into word / punctuation / whitespace-run units viewing into `text`.
+  std::vector<std::string_view> splitUnits(std::string_view text) {
+    std::vector<std::string_view> result;
+    size_t i = 0;
+    while (i < text.size()) {
+      unsigned char c = text[i];
+      size_t j = i + 1;
       if (std::isspace(c)) {
-        flushBuf();
         // group consecutive whitespace into one unit
-        if (!result.empty() && std::all_of(result.back().begin(), result.back().end(),
-          [](unsigned char x) { return std::isspace(x); })) {
-          result.back().push_back(c);
+        while (j < text.size() && std::isspace(static_cast<unsigned char>(text[j]))) j++;
+      } else if (!std::ispunct(c)) {
+        while (j < text.size() && !std::isspace(static_cast<unsigned char>(text[j])) && !std::ispunct(static_cast<unsigned char>(text[j]))) j++;
+      }
+      // punctuation = its own unit
+      result.push_back(text.substr(i, j - i));
+      i = j;
+    }
+    return result;
+  }
+
+  bool isWordChar(unsigned char c) {
+    return !std::isspace(c) && !std::ispunct(c);
+  }
+
+  // A function, class or namespace scope in source line numbers (endLine exclusive).
+  struct CodeBlock {
+    size_t startLine;
+    size_t endLine;
+    std::string symbol;
+    std::vector<CodeBlock> children;
+  };
+
+  // Lightweight brace/indent-aware scanner locating function, class and namespace scopes.
+  // It is not a parser: it only needs to be right often enough to place chunk boundaries,
+  // anything it does not recognize simply stays unscoped.
+  class CodeStructure {
+  public:
+    enum class Syntax { None, Braces, Indent };
+
+    struct Language {
+      Syntax syntax = Syntax::None;
+      bool preprocessor = false; // '#' at line start is a directive
+      bool quoteStrings = false; // '...' is a string rather than a char literal
+      bool newlineEnds = false;  // statements may end at a line break
+      const char *separator = ".";
+    };
+
+    static Language languageOf(const std::string &uri) {
+      static const Language cLike{ Syntax::Braces, true, false, false, "::" };
+      static const Language rust{ Syntax::Braces, false, false, false, "::" };
+      static const Language csharp{ Syntax::Braces, true, false, false, "." };
+      static const Language java{ Syntax::Braces, false, false, false, "." };
+      static const Language braces{ Syntax::Braces, false, false, true, "." };
+      static const Language script{ Syntax::Braces, false, true, true, "." };
+      static const Language php{ Syntax::Braces, false, true, false, "." };
+      static const Language python{ Syntax::Indent, false, true, false, "." };
+      static const std::unordered_map<std::string, Language> languages = {
+        {".c", cLike}, {".h", cLike}, {".cpp", cLike}, {".hpp", cLike}, {".cc", cLike},
+        {".cxx", cLike}, {".hh", cLike}, {".hxx", cLike}, {".inl", cLike}, {".m", cLike}, {".mm", cLike},
+        {".rs", rust}, {".cs", csharp},
+        {".java", java}, {".go", braces}, {".kt", braces}, {".scala", braces}, {".swift", braces},
+        {".js", script}, {".jsx", script}, {".ts", script}, {".tsx", script}, {".mjs", script}, {".php", php},
+        {".py", python}, {".pyw", python}
+      };
+      std::string ext = std::filesystem::path(uri).extension().string();
+      std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+      auto it = languages.find(ext);
+      return it == languages.end() ? Language{} : it->second;
+    }
+
+    static std::vector<CodeBlock> scan(std::string_view text, const Language &lang) {
+      switch (lang.syntax) {
+      case Syntax::Braces: return scanBraces(text, lang);
+      case Syntax::Indent: return scanIndent(text);
+      default: return {};
+      }
+    }
+
+  private:
+    static constexpr size_t npos = std::string_view::npos;
+
+    static bool isIdentStart(char c) {
+      return std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+    }
+
+    static bool isIdentChar(char c) {
+      return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+    }
+
+    static bool isBlank(char c) {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+    }
+
+    // Skips a literal starting at the quote at i, returns the position past it.
+    static size_t skipLiteral(std::string_view s, size_t i, size_t &line) {
+      char q = s[i];
+      // C++ raw string R"delim( ... )delim"
+      if (q == '"' && 0 < i && s[i - 1] == 'R' && (i < 2 || !isIdentChar(s[i - 2]) || s[i - 2] == '8' || s[i - 2] == 'u' || s[i - 2] == 'U' || s[i - 2] == 'L')) {
+        size_t open = s.find('(', i + 1);
+        if (open != npos && open - i <= 17) {
+          std::string close = ")";
+          close.append(s.substr(i + 1, open - i - 1)).push_back('"');
+          size_t end = s.find(close, open + 1);
+          end = end == npos ? s.size() : end + close.size();
+          line += std::count(s.begin() + i, s.begin() + end, '\n');
+          return end;
+        }
+      }
+      for (size_t j = i + 1; j < s.size(); ++j) {
+        char c = s[j];
+        if (c == '\\') {
+          ++j;
+          if (j < s.size() && s[j] == '\n') ++line;
+        } else if (c == q) {
+          return j + 1;
+        } else if (c == '\n') {
+          if (q != '`') return j; // unterminated, resync at the line end
+          ++line;
+        }
+      }
+      return s.size();
+    }
+
+    // 'x' and '\n' are char literals; Rust lifetimes and digit separators are not.
+    static bool isCharLiteral(std::string_view s, size_t i) {
+      if (i + 2 < s.size() && s[i + 1] != '\\' && s[i + 2] == '\'') return true;
+      if (i + 1 < s.size() && s[i + 1] == '\\') {
+        for (size_t j = i + 3; j < s.size() && j < i + 12; ++j) {
+          if (s[j] == '\'') return true;
+          if (s[j] == '\n') break;
+        }
+      }
+      return false;
+    }
+
+    struct Token {
+      std::string_view text;
+      int depth;
+      bool ident;
+    };
+
+    // Splits a declaration header into identifiers (with qualified names joined) and punctuation.
+    static std::vector<Token> tokenize(std::string_view h) {
+      std::vector<Token> tokens;
+      int depth = 0;
+      size_t i = 0;
+      auto skipSpaces = [&h](size_t j) {
+        while (j < h.size() && std::isspace(static_cast<unsigned char>(h[j]))) j++;
+        return j;
+        };
+      while (i < h.size()) {
+        char c = h[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+          i++;
+        } else if (c == '/' && i + 1 < h.size() && (h[i + 1] == '/' || h[i + 1] == '*')) {
+          size_t end = h[i + 1] == '/' ? h.find('\n', i) : h.find("*/", i + 2);
+          i = end == npos ? h.size() : end + (h[i + 1] == '/' ? 1 : 2);
+        } else if (c == '"' || c == '\'' || c == '`') {
+          size_t line = 0;
+          size_t end = skipLiteral(h, i, line);
+          tokens.push_back({ h.substr(i, end - i), depth, false });
+          i = end;
+        } else if (isIdentStart(c) || (c == '~' && i + 1 < h.size() && isIdentStart(h[i + 1])) ||
+          (c == ':' && i + 2 < h.size() && h[i + 1] == ':' && isIdentStart(h[i + 2]))) {
+          size_t start = i;
+          i += c == ':' ? 2 : 1;
+          for (;;) {
+            while (i < h.size() && isIdentChar(h[i])) i++;
+            size_t sep = h.compare(i, 2, "::") == 0 ? 2 : (i < h.size() && h[i] == '.') ? 1 : 0;
+            if (sep == 0 || h.size() <= i + sep) break;
+            char next = h[i + sep];
+            if (!isIdentStart(next) && next != '~') break;
+            i += sep + (next == '~' ? 1 : 0);
+          }
+          std::string_view word = h.substr(start, i - start);
+          if (word == "template") {
+            // template <...> parameters never name the declaration
+            size_t j = skipSpaces(i);
+            if (j < h.size() && h[j] == '<') {
+              int angles = 0;
+              for (; j < h.size(); ++j) {
+                if (h[j] == '<') angles++;
+                else if (h[j] == '>' && --angles == 0) break;
+              }
+              i = j < h.size() ? j + 1 : h.size();
+              continue;
+            }
+          }
+          if (word.ends_with("operator")) {
+            size_t j = skipSpaces(i);
+            if (h.compare(j, 2, "()") == 0) {
+              j += 2;
+            } else {
+              while (j < h.size() && std::strchr("+-*/%^&|~!=<>[],", h[j])) j++;
+            }
+            i = j;
+            word = h.substr(start, i - start);
+          }
+          tokens.push_back({ word, depth, true });
+        } else if (std::isdigit(static_cast<unsigned char>(c))) {
+          size_t start = i;
+          while (i < h.size() && (isIdentChar(h[i]) || h[i] == '.' || h[i] == '\'')) i++;
+          tokens.push_back({ h.substr(start, i - start), depth, false });
+        } else if (c == '(' || c == '[') {
+          tokens.push_back({ h.substr(i++, 1), depth++, false });
+        } else if (c == ')' || c == ']') {
+          depth = (std::max)(0, depth - 1);
+          tokens.push_back({ h.substr(i++, 1), depth, false });
+        } else {
+          static const std::string_view pairs[] = { "=>", "->", "==", "!=", "<=", ">=" };
+          size_t len = 1;
+          for (auto p : pairs) {
+            if (h.compare(i, 2, p) == 0) {
+              len = 2;
+              break;
+            }
+          }
+          tokens.push_back({ h.substr(i, len), depth, false });
+          i += len;
+        }
+      }
+      return tokens;
+    }
+
+    static bool isOneOf(std::string_view word, std::initializer_list<std::string_view> words) {
+      return std::find(words.begin(), words.end(), word) != words.end();
+    }
+
+    // Decides whether the header in front of '{' opens a named scope.
+    static bool classify(std::string_view header, std::string &symbol) {
+      auto tokens = tokenize(header);
+      const size_t n = tokens.size();
+      auto is = [&tokens, n](size_t k, std::string_view s) { return k < n && tokens[k].text == s; };
+      static const std::initializer_list<std::string_view> control = {
+        "if", "for", "while", "switch", "catch", "with", "sizeof", "return", "foreach", "using", "lock",
+        "fixed", "synchronized", "until", "when", "match", "throw", "delete", "case", "typeof", "await", "yield", "elif",
+        "else", "do", "try", "new", "defined", "assert", "static_assert", "alignof", "guard", "unless", "in", "select",
+        "go", "defer", "loop", "var", "let", "const", "val"
+      };
+      if (n == 0 || (isOneOf(tokens[0].text, control) && !isOneOf(tokens[0].text, { "var", "let", "const", "val" }))) {
+        return false;
+      }
+      size_t assign = npos;
+      bool arrow = false;
+      for (size_t k = 0; k < n; ++k) {
+        if (tokens[k].depth != 0) continue;
+        if (assign == npos && is(k, "=")) assign = k;
+        if (is(k, "=>") || is(k, "function") || is(k, "lambda") || (is(k, "[") && k == assign + 1)) arrow = true;
+      }
+      // class-like declarations
+      for (size_t k = 0; k < n && k < assign; ++k) {
+        const auto &t = tokens[k];
+        if (!t.ident || t.depth != 0 || !isOneOf(t.text, { "class", "struct", "union", "interface", "enum", "trait", "impl", "namespace", "protocol" })) {
+          continue;
+        }
+        size_t j = k + 1;
+        while (is(j, "class") || is(j, "struct")) j++; // enum class
+        if (t.text == "impl") {
+          if (is(j, "<")) {
+            for (int angles = 0; j < n; ++j) {
+              if (is(j, "<")) angles++;
+              else if (is(j, ">") && --angles == 0) break;
+            }
+            j++;
+          }
+          for (size_t f = j; f < n; ++f) {
+            if (is(f, "for") && f + 1 < n && tokens[f + 1].ident) j = f + 1;
+          }
+        }
+        size_t run = j;
+        while (run < n && tokens[run].ident &&
+          !isOneOf(tokens[run].text, { "final", "sealed", "abstract", "extends", "implements", "where", "for", "with", "open" })) {
+          run++;
+        }
+        if (is(run, "*") || is(run, "&") || (is(run, "(") && 1 < run - j)) {
+          break; // a function returning a struct type
+        }
+        if (j < run) {
+          symbol = tokens[run - 1].text;
+        } else if (0 < k && tokens[k - 1].ident && 1 < k && is(k - 2, "type")) {
+          symbol = tokens[k - 1].text; // Go: type Name struct
+        } else {
+          symbol.clear();
+        }
+        return true;
+      }
+      // functions: the identifier in front of the first top-level argument list
+      for (size_t k = 1; k < n; ++k) {
+        if (!is(k, "(") || tokens[k].depth != 0) continue;
+        if (assign < k) break;
+        size_t c = k - 1;
+        if (is(c, ">")) {
+          // generic parameters between the name and the argument list
+          int angles = 0;
+          for (;; --c) {
+            if (is(c, ">")) angles++;
+            else if (is(c, "<") && --angles == 0) break;
+            if (c == 0) break;
+          }
+          if (c == 0) break;
+          c--;
+        }
+        if (!tokens[c].ident) break;
+        auto name = tokens[c].text;
+        if (0 < c && is(c - 1, "@")) continue; // annotation
+        if (isOneOf(name, { "__attribute__", "__declspec", "alignas", "decltype", "func", "function", "fn", "fun", "pub", "explicit", "requires" })) {
+          continue;
+        }
+        if (isOneOf(name, control) || (0 < c && is(c - 1, "new"))) {
+          return false;
+        }
+        symbol = name.starts_with("::") ? name.substr(2) : name;
+        return true;
+      }
+      if (assign != npos && 0 < assign && tokens[assign - 1].ident && arrow) {
+        symbol = tokens[assign - 1].text;
+        return true;
+      }
+      return false;
+    }
+
+    static std::vector<CodeBlock> scanBraces(std::string_view text, const Language &lang) {
+      struct Frame {
+        bool scope = false;
+        std::string symbol;
+        size_t startLine = 0;
+        size_t openLine = 0;
+        // statement state of this level
+        size_t parens = 0;
+        size_t stmtPos = npos;  // first char of the current statement, comments included
+        size_t stmtLine = 0;
+        size_t codePos = npos;  // first code char of the current statement
+        // parent statement state when this frame was opened
+        size_t savedStmtPos = npos;
+        size_t savedStmtLine = 0;
+        size_t savedCodePos = npos;
+        std::vector<CodeBlock> children;
+      };
+      std::vector<Frame> frames(1);
+      size_t line = 0;
+      bool lineStart = true;
+      size_t i = 0;
+      while (i < text.size()) {
+        char c = text[i];
+        if (c == '\n') {
+          Frame &f = frames.back();
+          if (lang.newlineEnds && f.parens == 0 && f.codePos != npos) {
+            size_t j = i + 1;
+            while (j < text.size() && std::isspace(static_cast<unsigned char>(text[j]))) j++;
+            if (j < text.size() && text[j] != '{' && text[j] != '.') f.stmtPos = f.codePos = npos;
+          }
+          line++;
+          lineStart = true;
+          i++;
+          continue;
+        }
+        if (isBlank(c)) {
+          i++;
+          continue;
+        }
+        Frame &f = frames.back();
+        bool atLineStart = lineStart;
+        lineStart = false;
+        if (f.stmtPos == npos) {
+          f.stmtPos = i;
+          f.stmtLine = line;
+        }
+        char next = i + 1 < text.size() ? text[i + 1] : '\0';
+        if (c == '/' && next == '/') {
+          i = text.find('\n', i);
+          if (i == npos) i = text.size();
+          continue;
+        }
+        if (c == '/' && next == '*') {
+          size_t end = text.find("*/", i + 2);
+          end = end == npos ? text.size() : end + 2;
+          line += std::count(text.begin() + i, text.begin() + end, '\n');
+          i = end;
+          continue;
+        }
+        if (lang.preprocessor && c == '#' && atLineStart) {
+          while (i < text.size() && text[i] != '\n') {
+            if (text[i] == '\\' && i + 1 < text.size() && text[i + 1] == '\n') {
+              line++;
+              i++;
+            }
+            i++;
+          }
+          f.stmtPos = f.codePos = npos;
+          continue;
+        }
+        if (f.codePos == npos) f.codePos = i;
+        if (c == '"' || c == '`' || (c == '\'' && (lang.quoteStrings || isCharLiteral(text, i)))) {
+          i = skipLiteral(text, i, line);
+          continue;
+        }
+        switch (c) {
+        case '(':
+        case '[':
+          f.parens++;
+          break;
+        case ')':
+        case ']':
+          if (0 < f.parens) f.parens--;
+          break;
+        case ';':
+          if (f.parens == 0) f.stmtPos = f.codePos = npos;
+          break;
+        case '{': {
+          Frame nf;
+          if (f.parens == 0) nf.scope = classify(text.substr(f.codePos, i - f.codePos), nf.symbol);
+          nf.startLine = f.stmtLine;
+          nf.openLine = line;
+          nf.savedStmtPos = f.stmtPos;
+          nf.savedStmtLine = f.stmtLine;
+          nf.savedCodePos = f.codePos;
+          frames.push_back(std::move(nf));
+          break;
+        }
+        case '}': {
+          if (frames.size() == 1) break; // unbalanced
+          Frame done = std::move(frames.back());
+          frames.pop_back();
+          Frame &p = frames.back();
+          size_t j = i + 1;
+          while (j < text.size() && isBlank(text[j])) j++;
+          bool initializer = done.openLine == line && j < text.size() && (text[j] == ',' || text[j] == '{');
+          if (initializer) {
+            // brace initializer in a member init list, e.g. `: a_{x}, b_{y} {`
+            p.stmtPos = done.savedStmtPos;
+            p.stmtLine = done.savedStmtLine;
+            p.codePos = done.savedCodePos;
+          } else if (p.parens == 0) {
+            p.stmtPos = p.codePos = npos;
+          }
+          if (done.scope && !initializer) {
+            p.children.push_back({ done.startLine, line + 1, std::move(done.symbol), std::move(done.children) });
+          } else {
+            std::move(done.children.begin(), done.children.end(), std::back_inserter(p.children));
+          }
+          break;
+        }
+        default:
+          if (isIdentChar(c)) {
+            while (i + 1 < text.size() && isIdentChar(text[i + 1])) i++;
+          }
+          break;
+        }
+        i++;
+      }
+      // close whatever is left open at the end of the file
+      while (1 < frames.size()) {
+        Frame done = std::move(frames.back());
+        frames.pop_back();
+        if (done.scope) {
+          frames.back().children.push_back({ done.startLine, line + 1, std::move(done.symbol), std::move(done.children) });
         } else {
-          result.emplace_back(1, c);
+          std::move(done.children.begin(), done.children.end(), std::back_inserter(frames.back().children));
+        }
+      }
+      return std::move(frames.front().children);
+    }
+
+    static std::vector<CodeBlock> scanIndent(std::string_view text) {
+      struct Frame {
+        size_t indent;
+        size_t startLine;
+        std::string symbol;
+        std::vector<CodeBlock> children;
+      };
+      std::vector<CodeBlock> root;
+      std::vector<Frame> frames;
+      size_t brackets = 0;
+      std::string_view triple; // open triple-quoted string delimiter
+      size_t lastContent = 0;  // one past the last non-blank line
+      size_t pending = npos;   // decorators and comments right before a definition
+      auto close = [&frames, &root](size_t endLine) {
+        Frame done = std::move(frames.back());
+        frames.pop_back();
+        auto &siblings = frames.empty() ? root : frames.back().children;
+        siblings.push_back({ done.startLine, (std::max)(endLine, done.startLine + 1), std::move(done.symbol), std::move(done.children) });
+        };
+      size_t line = 0;
+      size_t pos = 0;
+      while (pos < text.size()) {
+        size_t eol = text.find('\n', pos);
+        if (eol == npos) eol = text.size();
+        std::string_view s = text.substr(pos, eol - pos);
+        pos = eol + 1;
+        size_t indent = 0;
+        size_t k = 0;
+        for (; k < s.size() && isBlank(s[k]); ++k) indent += s[k] == '\t' ? 8 - indent % 8 : 1;
+        std::string_view rest = s.substr(k);
+        if (rest.empty()) {
+          if (triple.empty() && brackets == 0) pending = npos;
+          line++;
+          continue;
         }
-      } else if (std::ispunct(c)) {
-        flushBuf();
-        // punctuation = its own unit
-        result.emplace_back(1, c);
+        if (triple.empty() && brackets == 0) {
+          bool comment = rest.front() == '#';
+          if (!comment) {
+            size_t endLine = pending == npos ? lastContent : (std::min)(lastContent, pending);
+            while (!frames.empty() && indent <= frames.back().indent) close(endLine);
+          }
+          std::string_view decl = rest.starts_with("async ") ? rest.substr(6) : rest;
+          size_t nameAt = decl.starts_with("def ") ? 4 : decl.starts_with("class ") ? 6 : 0;
+          if (nameAt) {
+            while (nameAt < decl.size() && isBlank(decl[nameAt])) nameAt++;
+            size_t nameEnd = nameAt;
+            while (nameEnd < decl.size() && isIdentChar(decl[nameEnd])) nameEnd++;
+            frames.push_back({ indent, pending == npos ? line : pending, std::string(decl.substr(nameAt, nameEnd - nameAt)), {} });
+            pending = npos;
+          } else if (comment || rest.front() == '@') {
+            if (pending == npos) pending = line;
+          } else {
+            pending = npos;
+          }
+        }
+        // track strings and brackets to find where logical lines start
+        for (size_t j = k; j < s.size(); ++j) {
+          char c = s[j];
+          if (!triple.empty()) {
+            if (c == '\\') j++;
+            else if (s.compare(j, 3, triple) == 0) {
+              j += 2;
+              triple = {};
+            }
+          } else if (c == '#') {
+            break;
+          } else if (c == '"' || c == '\'') {
+            if (s.compare(j, 3, c == '"' ? "\"\"\"" : "'''") == 0) {
+              triple = c == '"' ? "\"\"\"" : "'''";
+              j += 2;
+            } else {
+              for (j++; j < s.size() && s[j] != c; ++j) {
+                if (s[j] == '\\') j++;
+              }
+            }
+          } else if (c == '(' || c == '[' || c == '{') {
+            brackets++;
+          } else if ((c == ')' || c == ']' || c == '}') && 0 < brackets) {
+            brackets--;
+          }
+        }
+        lastContent = line + 1;
+        line++;
+      }
+      while (!frames.empty()) close(lastContent);
+      return root;
+    }
+  };
+
+  // A run of lines packed as a whole: a scope that fits, or a single line.
+  struct Segment {
+    size_t begin; // buffer lines
+    size_t end;
+    size_t tokens;
+    std::string symbol;
+    size_t group; // non-zero for lines of one oversized scope
+  };
+
+  // Flattens scopes into segments: scopes that fit stay whole, oversized ones are opened up.
+  void collectSegments(const std::vector<CodeBlock> &blocks, size_t begin, size_t end, const std::string &scope,
+    const char *separator, const std::vector<size_t> &firstLine, const std::vector<size_t> &tokensBefore,
+    size_t maxTokens, size_t &groups, std::vector<Segment> &out) {
+    auto addLines = [&](size_t from, size_t to, const std::string &symbol, size_t group) {
+      for (size_t l = firstLine[from]; l < firstLine[to]; ++l) {
+        out.push_back({ l, l + 1, tokensBefore[l + 1] - tokensBefore[l], symbol, group });
+      }
+      };
+    size_t cur = begin;
+    for (const auto &b : blocks) {
+      size_t from = (std::max)(b.startLine, cur);
+      size_t to = (std::min)(b.endLine, end);
+      if (to <= from) continue;
+      addLines(cur, from, scope, 0);
+      std::string symbol = scope.empty() ? b.symbol : b.symbol.empty() ? scope : scope + separator + b.symbol;
+      size_t tokens = tokensBefore[firstLine[to]] - tokensBefore[firstLine[from]];
+      if (tokens <= maxTokens) {
+        out.push_back({ firstLine[from], firstLine[to], tokens, std::move(symbol), 0 });
+      } else if (!b.children.empty()) {
+        collectSegments(b.children, from, to, symbol, separator, firstLine, tokensBefore, maxTokens, groups, out);
       } else {
-        buf.push_back(c);
+        addLines(from, to, symbol, ++groups);
       }
+      cur = to;
     }
-    flushBuf();
+    addLines(cur, end, scope, 0);
+  }
+
+  // Joins the distinct symbols of a chunk, leaving out scopes whose members are listed.
+  std::string joinSymbols(const std::vector<std::string> &symbols, std::string_view separator) {
+    std::string result;
+    for (size_t k = 0; k < symbols.size(); ++k) {
+      const auto &s = symbols[k];
+      if (s.empty() || std::find(symbols.begin(), symbols.begin() + k, s) != symbols.begin() + k) continue;
+      bool parent = std::any_of(symbols.begin(), symbols.end(), [&s, separator](const std::string &o) {
+        return s.size() + separator.size() < o.size() && o.starts_with(s) && o.compare(s.size(), separator.size(), separator) == 0;
+        });
+      if (parent) continue;
+      if (!result.empty()) result += ", ";
+      result += s;
+    }
+    return result;
+  }
+
+  // Cuts text into about `parts` pieces, each ending right after a newline (except the last).
+  std::vector<std::string_view> splitAtLines(std::string_view text, size_t parts) {
+    std::vector<std::string_view> result;
+    size_t begin = 0;
+    for (size_t k = 1; k < parts && begin < text.size(); ++k) {
+      size_t cut = text.find('\n', (std::max)(begin, text.size() / parts * k));
+      if (cut == std::string_view::npos) break;
+      result.push_back(text.substr(begin, cut + 1 - begin));
+      begin = cut + 1;
+    }
+    if (begin < text.size() || result.empty()) result.push_back(text.substr(begin));
     return result;
   }
 
+  // Runs f(0..n-1), f(0) on the calling thread; rethrows the first failure.
+  template <class F>
+  void forEachParallel(size_t n, F &&f) {
+    std::vector<std::future<void>> pending;
+    pending.reserve(n);
+    for (size_t k = 1; k < n; ++k) pending.push_back(std::async(std::launch::async, f, k));
+    if (0 < n) f(0);
+    for (auto &p : pending) p.get();
+  }
+
+  void appendSymbol(std::string &symbols, const std::string &symbol) {
+    if (symbol.empty() || symbols == symbol || symbols.ends_with(", " + symbol)) return;
+    if (!symbols.empty()) symbols += ", ";
+    symbols += symbol;
+  }
 
 } // anonymous namespace
 
@@ -303,6 +967,19 @@ Chunker::Chunker(const SimpleTokenizer &tok, size_t min_tok, size_t max_tok, flo
 {
 }
 
+void Chunker::setParallel(size_t minBytes, size_t threads)
+{
+  parallelMinBytes_ = minBytes;
+  parallelThreads_ = threads ? threads : (std::max)(1u, std::thread::hardware_concurrency());
+}
+
+size_t Chunker::segmentCount(size_t bytes) const
+{
+  if (parallelMinBytes_ == 0 || bytes < parallelMinBytes_ || parallelThreads_ < 2) return 1;
+  // keep parts large enough to be worth a thread
+  return std::clamp(bytes / (std::max)(parallelMinBytes_ / 4, size_t(1)), size_t(1), parallelThreads_);
+}
+
 std::vector<Chunk> Chunker::chunkText(const std::string &text, const std::string &uri, bool semantic) const
 {
   std::vector<Chunk> chunks;
@@ -312,7 +989,7 @@ std::vector<Chunk> Chunker::chunkText(const std::string &text, const std::string
       chunks = postProcessChunks(splitIntoTextChunks(text, uri), ContentType::Text);
       break;
     case ContentType::Code:
-      chunks = postProcessChunks(splitIntoLineChunks(text, uri), ContentType::Code);
+      chunks = postProcessChunks(splitIntoSemanticChunks(text, uri), ContentType::Code);
       break;
     default:
       LOG_MSG << "Unsupported content type for URI: " << uri << ". Skipped.";
@@ -342,52 +1019,87 @@ Chunker::ContentType Chunker::detectContentType(const std::string &text, const s
 std::vector<Chunk> Chunker::postProcessChunks(const std::vector<Chunk> &chunks, ContentType chunkType) const
 {
   std::vector<Chunk> processed;
+  processed.reserve(chunks.size());
   for (size_t i = 0; i < chunks.size(); ++i) {
     Chunk chunk = chunks[i];
     chunk.metadata.type = contentTypeToStr(chunkType);
     if (chunk.metadata.tokenCount < minTokens_ && i + 1 < chunks.size()) {
-      Chunk nextChunk = chunks[i + 1];
-      size_t combined_tokens = tokenCount(chunk.text + nextChunk.text);
-      if (combined_tokens <= maxTokens_ && chunk.docUri == nextChunk.docUri) {
-        chunk.text += nextChunk.text;
-        chunk.metadata.tokenCount = combined_tokens;
-        chunk.metadata.end = nextChunk.metadata.end;
-        ++i;
+      const Chunk &nextChunk = chunks[i + 1];
+      if (chunk.doc == nextChunk.doc && chunk.docUri == nextChunk.docUri) {
+        size_t combined_tokens = mergedTokenCount(chunk, nextChunk);
+        if (combined_tokens <= maxTokens_) {
+          chunk.length = nextChunk.offset + nextChunk.length - chunk.offset;
+          chunk.metadata.tokenCount = combined_tokens;
+          chunk.metadata.end = nextChunk.metadata.end;
+          appendSymbol(chunk.metadata.symbol, nextChunk.metadata.symbol);
+          ++i;
+        }
       }
     }
-    processed.push_back(chunk);
+    processed.push_back(std::move(chunk));
   }
   return processed;
 }
 
-size_t Chunker::tokenCount(const std::string &text) const
+size_t Chunker::tokenCount(std::string_view text) const
 {
-  std::lock_guard<std::mutex> lock(cacheMutex_);
-  auto it = tokenCache_.find(text);
-  if (it != tokenCache_.end()) {
-    return it->second;
+  // Whitespace is never a token and a lone punctuation char is always exactly one.
+  if (text.size() == 1 && !isWordChar(text[0])) {
+    return std::ispunct(static_cast<unsigned char>(text[0])) ? 1 : 0;
   }
-  size_t count = tokenizer_.countTokensWithVocab(text);
-  if (10'000 < tokenCache_.size()) {
-    // TODO: more robust cleanup (freq based, etc)
-    tokenCache_.clear();
+  return tokenizer_.countTokensWithVocab(text);
+}
+
+size_t Chunker::mergedTokenCount(const Chunk &a, const Chunk &b) const
+{
+  // Both chunks start and end on unit/line boundaries, where token counts are additive,
+  // so only the overlapping region shared by both needs counting.
+  size_t total = a.metadata.tokenCount + b.metadata.tokenCount;
+  size_t aEnd = a.offset + a.length;
+  if (aEnd <= b.offset) {
+    return total;
   }
-  tokenCache_[text] = count;
-  return count;
+  size_t shared = tokenCount(b.text().substr(0, aEnd - b.offset));
+  return total - (std::min)(shared, total);
 }
 
 std::vector<Chunk> Chunker::splitIntoTextChunks(std::string text, const std::string &uri) const
 {
   auto overlap = overlapTokens_;
   if (maxTokens_ * 0.6 < overlap) overlap = static_cast<size_t>(maxTokens_ * 0.6);
-  text = normalizeWhitespaces(text);
-  auto rawUnits = splitUnits(text);
-  std::vector<Unit> units;
-  size_t charPos = 0;
-  for (auto &uText : rawUnits) {
-    size_t tks = tokenCount(uText);
-    units.push_back({ uText, tks, charPos, charPos + uText.size() });
-    charPos += uText.size();
+  auto doc = std::make_shared<const std::string>(normalizeWhitespaces(text));
+  // Token counting dominates; large documents count their line-aligned parts in parallel.
+  auto parts = splitAtLines(*doc, segmentCount(doc->size()));
+  std::vector<std::vector<Unit>> partUnits(parts.size());
+  forEachParallel(parts.size(), [this, &parts, &partUnits, &doc](size_t k) {
+    size_t charPos = parts[k].data() - doc->data();
+    auto rawUnits = splitUnits(parts[k]);
+    auto &units = partUnits[k];
+    units.reserve(rawUnits.size());
+    for (auto uText : rawUnits) {
+      size_t tks = tokenCount(uText);
+      units.push_back({ uText, tks, charPos, charPos + uText.size() });
+      charPos += uText.size();
+    }
+    });
+  std::vector<Unit> units = std::move(partUnits.front());
+  if (1 < partUnits.size()) {
+    size_t total = 0;
+    for (const auto &pu : partUnits) total += pu.size();
+    units.reserve(total);
+  }
+  for (size_t k = 1; k < partUnits.size(); ++k) {
+    auto from = partUnits[k].begin();
+    // a whitespace run cut at a part edge is one unit
+    if (!units.empty() && from != partUnits[k].end() &&
+      std::isspace(static_cast<unsigned char>(units.back().text.front())) && std::isspace(static_cast<unsigned char>(from->text.front()))) {
+      auto &u = units.back();
+      u.text = std::string_view(u.text.data(), u.text.size() + from->text.size());
+      u.tokens = tokenCount(u.text);
+      u.endChar = from->endChar;
+      ++from;
+    }
+    units.insert(units.end(), from, partUnits[k].end());
   }
   std::vector<Chunk> chunks;
   size_t chunkId = 0;
@@ -403,18 +1115,12 @@ std::vector<Chunk> Chunker::splitIntoTextChunks(std::string text, const std::str
     if (start < end) {
       size_t startChar = units[start].startChar;
       size_t endChar = units[end - 1].endChar;
-      std::string raw;
-#ifdef _DEBUG
-      raw = text.substr(startChar, endChar - startChar);
-      size_t tokensToCheck = tokenCount(raw);
-#endif
-      std::string chunkText;
-      for (size_t i = start; i < end; i++) chunkText += units[i].text;
       chunks.push_back({
           uri,
           uri + "_" + std::to_string(chunkId++),
-          chunkText,
-          raw,
+          doc,
+          startChar,
+          endChar - startChar,
           {tokenCnt, startChar, endChar, "char"}
         });
     }
@@ -436,18 +1142,9 @@ std::vector<Chunk> Chunker::splitIntoTextChunks(std::string text, const std::str
 
 std::vector<Chunk> Chunker::splitIntoLineChunks(const std::string &text, const std::string &uri) const
 {
-  std::vector<std::string> lines;
-  lines.reserve(100);
-  {
-    std::istringstream iss(text);
-    std::string line;
-    while (std::getline(iss, line)) {
-      auto subLines = splitIntoLines(line); // split into more lines if too wide
-      lines.insert(lines.end(),
-        std::make_move_iterator(subLines.begin()),
-        std::make_move_iterator(subLines.end()));
-    }
-  }
+  std::vector<Line> lines;
+  std::vector<size_t> firstLine;
+  auto doc = layoutLines(text, lines, firstLine);
   if (lines.empty()) return {};
   std::vector<Chunk> chunks;
   size_t chunkId = 0;
@@ -455,26 +1152,21 @@ std::vector<Chunk> Chunker::splitIntoLineChunks(const std::string &text, const s
   while (start < lines.size()) {
     size_t tokenCnt = 0;
     size_t end = start;
-    std::string chunkText;
-    chunkText.reserve(maxTokens_ * 4);
     // Accumulate lines until token budget exceeded
     while (end < lines.size()) {
-      auto lineTokens = tokenCount(lines[end]);
+      auto lineTokens = lines[end].tokens;
       if (tokenCnt + lineTokens > maxTokens_) break;
       tokenCnt += lineTokens;
-      chunkText += lines[end];
       end++;
     }
     if (start < end) {
-      std::string raw;
-#ifdef _DEBUG
-      for (size_t i = start; i < end; i++) raw += lines[i];
-#endif
+      size_t offset = lines[start].offset;
       chunks.push_back({
           uri,
           uri + "_" + std::to_string(chunkId++),
-          chunkText,
-          raw,
+          doc,
+          offset,
+          lines[end - 1].offset + lines[end - 1].length - offset,
           {tokenCnt, start, end, "line"}
         });
     }
@@ -483,7 +1175,7 @@ std::vector<Chunk> Chunker::splitIntoLineChunks(const std::string &text, const s
       size_t overlapTokens = 0;
       size_t overlapLines = 0;
       while (start < end - overlapLines - 1) {
-        overlapTokens += tokenCount(lines[end - 1 - overlapLines]);
+        overlapTokens += lines[end - 1 - overlapLines].tokens;
         if (overlapTokens < overlapTokens_) overlapLines++;
         else break;
       }
@@ -495,53 +1187,188 @@ std::vector<Chunk> Chunker::splitIntoLineChunks(const std::string &text, const s
   return chunks;
 }
 
-std::vector<Chunk> Chunker::splitIntoSemanticChunks(const std::string &text, const std::string &docId) const
+std::vector<Chunk> Chunker::splitIntoSemanticChunks(const std::string &text, const std::string &uri) const
 {
-  std::vector<Chunk> chunks;
+  auto lang = CodeStructure::languageOf(uri);
+  auto blocks = CodeStructure::scan(text, lang);
+  if (blocks.empty()) {
+    return splitIntoLineChunks(text, uri);
+  }
+  std::vector<Line> lines;
+  std::vector<size_t> firstLine;
+  auto doc = layoutLines(text, lines, firstLine);
+  if (lines.empty()) return {};
+  std::vector<size_t> tokensBefore(lines.size() + 1, 0);
+  for (size_t l = 0; l < lines.size(); ++l) tokensBefore[l + 1] = tokensBefore[l] + lines[l].tokens;
+  std::vector<Segment> segments;
+  size_t groups = 0;
+  collectSegments(blocks, 0, firstLine.size() - 1, {}, lang.separator, firstLine, tokensBefore, maxTokens_, groups, segments);
 
+  // Pack whole segments, so chunk boundaries fall on scope boundaries wherever a scope fits.
+  std::vector<Chunk> chunks;
+  size_t chunkId = 0;
+  size_t start = 0;
+  while (start < segments.size()) {
+    size_t tokenCnt = segments[start].tokens;
+    size_t end = start + 1;
+    while (end < segments.size() && tokenCnt + segments[end].tokens <= maxTokens_) {
+      // an oversized scope starts a chunk of its own
+      if (0 < segments[end].group && segments[end].group != segments[end - 1].group) break;
+      tokenCnt += segments[end].tokens;
+      end++;
+    }
+    std::vector<std::string> symbols;
+    for (size_t k = start; k < end; ++k) symbols.push_back(segments[k].symbol);
+    std::string symbol = joinSymbols(symbols, lang.separator);
+    size_t first = segments[start].begin;
+    size_t last = segments[end - 1].end;
+    size_t offset = lines[first].offset;
+    chunks.push_back({
+        uri,
+        uri + "_" + std::to_string(chunkId++),
+        doc,
+        offset,
+        lines[last - 1].offset + lines[last - 1].length - offset,
+        {tokenCnt, first, last, "line", {}, std::move(symbol)}
+      });
+    if (segments.size() <= end) break;
+    // Only a scope cut into several chunks gets overlap
+    size_t next = end;
+    size_t group = segments[end].group;
+    if (0 < overlapTokens_ && 0 < group && segments[end - 1].group == group) {
+      size_t overlapTokens = 0;
+      while (start + 1 < next && segments[next - 1].group == group) {
+        overlapTokens += segments[next - 1].tokens;
+        if (overlapTokens_ <= overlapTokens) break;
+        next--;
+      }
+    }
+    start = next;
+  }
   return chunks;
 }
 
+std::shared_ptr<const std::string> Chunker::layoutLines(const std::string &text, std::vector<Line> &lines, std::vector<size_t> &firstLine) const
+{
+  // Lines (newline-terminated, over-wide ones split) are laid out back to back in one
+  // buffer, so every chunk is a contiguous range of it.
+  struct Part {
+    std::string buffer;
+    std::vector<Line> lines;
+    std::vector<size_t> firstLine;
+  };
+  auto views = splitAtLines(text, segmentCount(text.size()));
+  std::vector<Part> parts(views.size());
+  forEachParallel(views.size(), [this, &views, &parts](size_t k) {
+    auto view = views[k];
+    auto &part = parts[k];
+    part.buffer.reserve(view.size() + view.size() / 64 + 1);
+    part.lines.reserve(100);
+    size_t pos = 0;
+    while (pos < view.size()) {
+      size_t eol = view.find('\n', pos);
+      if (eol == std::string_view::npos) eol = view.size();
+      part.firstLine.push_back(part.lines.size());
+      splitIntoLines(view.substr(pos, eol - pos), part.buffer, part.lines); // split into more lines if too wide
+      pos = eol + 1;
+    }
+    });
+  if (parts.size() == 1) {
+    lines = std::move(parts.front().lines);
+    firstLine = std::move(parts.front().firstLine);
+    firstLine.push_back(lines.size());
+    return std::make_shared<std::string>(std::move(parts.front().buffer));
+  }
+  auto buffer = std::make_shared<std::string>();
+  size_t totalSize = 0;
+  size_t totalLines = 0;
+  for (const auto &part : parts) {
+    totalSize += part.buffer.size();
+    totalLines += part.lines.size();
+  }
+  buffer->reserve(totalSize);
+  lines.reserve(totalLines);
+  for (const auto &part : parts) {
+    size_t base = buffer->size();
+    size_t lineBase = lines.size();
+    buffer->append(part.buffer);
+    for (auto line : part.lines) {
+      line.offset += base;
+      lines.push_back(line);
+    }
+    for (auto l : part.firstLine) firstLine.push_back(lineBase + l);
+  }
+  firstLine.push_back(lines.size());
+  return buffer;
+}
+
 std::string Chunker::normalizeWhitespaces(const std::string &str)
 {
   auto start = str.find_first_not_of(" \t\r\n");
   auto end = str.find_last_not_of(" \t\r\n");
-  std::string s = (start == std::string::npos) ? "" : str.substr(start, end - start + 1);
-  // collapse whitespace except newlines into single space
-  s = std::regex_replace(s, std::regex{ "[^\\S\n]+" }, " ");
-  // collapse multiple newlines
-  s = std::regex_replace(s, std::regex{ "\n\\s*\n" }, "\n");
+  if (start == std::string::npos) return {};
+  // Single pass over each whitespace run: blanks before the first newline and after
+  // the last one collapse into a single space, and any number of newlines (with the
+  // blanks between them) collapse into one newline.
+  std::string s;
+  s.reserve(end - start + 1);
+  size_t i = start;
+  while (i <= end) {
+    unsigned char c = str[i];
+    if (!std::isspace(c)) {
+      s.push_back(str[i++]);
+      continue;
+    }
+    bool leading = false;
+    bool newline = false;
+    bool trailing = false;
+    for (; i <= end && std::isspace(static_cast<unsigned char>(str[i])); ++i) {
+      if (str[i] == '\n') {
+        newline = true;
+        trailing = false;
+      } else if (newline) {
+        trailing = true;
+      } else {
+        leading = true;
+      }
+    }
+    if (leading) s.push_back(' ');
+    if (newline) s.push_back('\n');
+    if (trailing) s.push_back(' ');
+  }
   return s;
 }
 
-std::vector<std::string> Chunker::splitIntoLines(const std::string &text) const
+void Chunker::splitIntoLines(std::string_view text, std::string &buffer, std::vector<Line> &lines) const
 {
+  auto appendLine = [&buffer, &lines](std::string_view s, size_t tokens) {
+    size_t offset = buffer.size();
+    buffer.append(s);
+    if (!s.ends_with('\n')) buffer += '\n';
+    lines.push_back({ offset, buffer.size() - offset, tokens });
+    };
   auto nTokens = tokenCount(text);
   if (nTokens <= maxTokens_) {
-    auto s = text;
-    if (!s.ends_with('\n')) s += '\n';
-    return { s };
+    appendLine(text, nTokens);
+    return;
   }
   // Line too long - split by words/punctuation
   auto units = splitUnits(text);
-  std::vector<std::string> result;
-  std::string current;
-  current.reserve(maxTokens_ * 4);
+  size_t currentStart = 0;
+  size_t currentLen = 0;
   size_t currentTokens = 0;
   for (const auto &u : units) {
     size_t uTokens = tokenCount(u);
-    if (maxTokens_ < currentTokens + uTokens && !current.empty()) {
-      if (!current.ends_with('\n')) current += '\n';
-      result.push_back(std::move(current));
-      current.clear();
+    if (maxTokens_ < currentTokens + uTokens && 0 < currentLen) {
+      appendLine(text.substr(currentStart, currentLen), currentTokens);
+      currentStart += currentLen;
+      currentLen = 0;
       currentTokens = 0;
     }
-    current += u;
+    currentLen += u.size();
     currentTokens += uTokens;
   }
-  if (!current.empty()) {
-    if (!current.ends_with('\n')) current += '\n';
-    result.push_back(std::move(current));
+  if (0 < currentLen) {
+    appendLine(text.substr(currentStart, currentLen), currentTokens);
   }
-  return result;
 }
@@ -0,0 +1,179 @@
+#include "ctxpacker.h"
+#include "tokenizer.h"
+#include <algorithm>
+
+
+namespace {
+
+  // chunks overlap by design, only a mostly shared range makes a duplicate
+  bool isDuplicate(const SearchResult &a, const SearchResult &b) {
+    if (a.sourceId != b.sourceId || a.chunkUnit != b.chunkUnit) return false;
+    if (a.chunkId != std::string::npos && a.chunkId == b.chunkId) return true;
+    size_t lo = (std::max)(a.start, b.start);
+    size_t hi = (std::min)(a.end, b.end);
+    if (hi <= lo) return false;
+    size_t shorter = (std::min)(a.end - a.start, b.end - b.start);
+    return 2 * (hi - lo) > shorter;
+  }
+
+  constexpr size_t kTokenSlices = 1024;
+
+  // Most relevant subset of at most maxItems within budget tokens, by dynamic
+  // programming over (item count, token slices). Costs are rounded up to whole
+  // slices, so every subset it considers fits the exact budget.
+  std::vector<size_t> bestSubset(const std::vector<ContextPacker::Candidate> &candidates,
+    const std::vector<size_t> &items, size_t budget, size_t maxItems) {
+    maxItems = (std::min)(maxItems, items.size());
+    if (maxItems == 0) return {};
+    const size_t slice = (std::max)(size_t(1), (budget + kTokenSlices - 1) / kTokenSlices);
+    const size_t cap = budget / slice;
+    const size_t width = cap + 1;
+    const size_t layer = (maxItems + 1) * width;
+    const double none = -1.0;
+    // best[n * width + w]: relevance of n items costing w slices, none if unreachable
+    std::vector<double> best(layer, none);
+    std::vector<bool> took(items.size() * layer, false);
+    best[0] = 0;
+    std::vector<size_t> cost(items.size());
+    for (size_t k = 0; k < items.size(); k ++) {
+      const auto &c = candidates[items[k]];
+      cost[k] = (c.tokens + slice - 1) / slice;
+      if (cost[k] > cap || c.result.similarityScore <= 0) continue;
+      for (size_t n = maxItems; n > 0; n --) {
+        for (size_t w = cap; w + 1 > cost[k]; w --) {
+          double from = best[(n - 1) * width + w - cost[k]];
+          if (from == none) continue;
+          double with = from + c.result.similarityScore;
+          if (best[n * width + w] < with) {
+            best[n * width + w] = with;
+            took[k * layer + n * width + w] = true;
+          }
+        }
+      }
+    }
+    size_t bn = 0, bw = 0;
+    for (size_t n = 0; n <= maxItems; n ++) {
+      for (size_t w = 0; w <= cap; w ++) {
+        if (best[bn * width + bw] < best[n * width + w]) {
+          bn = n;
+          bw = w;
+        }
+      }
+    }
+    // walk back: the last item that improved a cell is the one its value includes
+    std::vector<size_t> picks;
+    for (size_t k = items.size(); k-- > 0 && bn > 0; ) {
+      if (took[k * layer + bn * width + bw]) {
+        picks.push_back(items[k]);
+        bn --;
+        bw -= cost[k];
+      }
+    }
+    return picks;
+  }
+
+} // anonymous namespace
+
+
+ContextPacker::ContextPacker(size_t budgetTokens, size_t maxItems)
+  : budget_(budgetTokens)
+  , maxItems_(maxItems)
+{
+}
+
+ContextPacker::Packed ContextPacker::pack(const std::vector<Candidate> &candidates) const
+{
+  Packed packed;
+  std::vector<size_t> taken;
+  size_t used = 0;
+  for (size_t i = 0; i < candidates.size(); i ++) {
+    const auto &c = candidates[i];
+    if (c.pinned && taken.size() < maxItems_ && used + c.tokens <= budget_) {
+      taken.push_back(i);
+      used += c.tokens;
+    }
+  }
+  const size_t nofPinned = taken.size();
+
+  std::vector<size_t> order;
+  for (size_t i = 0; i < candidates.size(); i ++) {
+    if (!candidates[i].pinned) order.push_back(i);
+  }
+  // relevance per token, ties to the more relevant one
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    const auto &ca = candidates[a];
+    const auto &cb = candidates[b];
+    double da = ca.result.similarityScore / double((std::max)(ca.tokens, size_t(1)));
+    double db = cb.result.similarityScore / double((std::max)(cb.tokens, size_t(1)));
+    return da != db ? da > db : ca.result.similarityScore > cb.result.similarityScore;
+  });
+
+  const size_t remaining = budget_ - used;
+  const size_t slots = maxItems_ - nofPinned;
+  std::vector<size_t> eligible; // not a duplicate of a pinned one or of what precedes it in score order
+  for (size_t i : order) {
+    const auto &c = candidates[i];
+    auto dup = [&](size_t j) { return isDuplicate(c.result, candidates[j].result); };
+    if (std::any_of(taken.begin(), taken.end(), dup) || std::any_of(eligible.begin(), eligible.end(), dup)) {
+      packed.duplicates ++;
+      continue;
+    }
+    eligible.push_back(i);
+  }
+
+  // The rounded knapsack can miss a set that fills the last slices, which the
+  // greedy fill by score per token may still find.
+  std::vector<size_t> greedy;
+  size_t greedyTokens = 0;
+  for (size_t i : eligible) {
+    if (greedy.size() < slots && greedyTokens + candidates[i].tokens <= remaining) {
+      greedy.push_back(i);
+      greedyTokens += candidates[i].tokens;
+    }
+  }
+  auto picks = bestSubset(candidates, eligible, remaining, slots);
+  auto relevanceOf = [&candidates](const std::vector<size_t> &v) {
+    float sum = 0;
+    for (size_t i : v) sum += candidates[i].result.similarityScore;
+    return sum;
+  };
+  if (relevanceOf(picks) < relevanceOf(greedy)) {
+    picks = std::move(greedy);
+  }
+
+  std::sort(picks.begin(), picks.end());
+  packed.tokens = used;
+  for (size_t i : picks) {
+    packed.tokens += candidates[i].tokens;
+  }
+  packed.relevance = relevanceOf(picks);
+  taken.insert(taken.end(), picks.begin(), picks.end());
+  for (size_t i : taken) {
+    packed.results.push_back(candidates[i].result);
+  }
+  return packed;
+}
+
+std::string ContextPacker::truncate(const SimpleTokenizer &tokenizer, const std::string &text, size_t maxTokens)
+{
+  std::string_view sv{ text };
+  if (tokenizer.countTokensWithVocab(sv) <= maxTokens) {
+    return text;
+  }
+  // largest prefix length whose count fits; counts grow with the prefix
+  size_t lo = 0;
+  size_t hi = text.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (tokenizer.countTokensWithVocab(sv.substr(0, mid)) <= maxTokens) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  // do not split a UTF-8 sequence
+  while (lo > 0 && lo < text.size() && (static_cast<unsigned char>(text[lo]) & 0xC0) == 0x80) {
+    lo --;
+  }
+  return text.substr(0, lo);
+}
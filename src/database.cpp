@@ -6,6 +6,10 @@
 #include <filesystem>
 //#include <format>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <unordered_map>
 #include <fstream>
 #include <iterator>
 #include "app.h"
@@ -36,6 +40,18 @@ namespace {
 
   SqliteErrorChecker _checkErr;
 
+  // columns: content, source_id, unit, type, start_pos, end_pos, symbol
+  void readChunkRow(sqlite3_stmt *stmt, int k, SearchResult &result) {
+    result.content = reinterpret_cast<const char *>(sqlite3_column_text(stmt, k++));
+    result.sourceId = reinterpret_cast<const char *>(sqlite3_column_text(stmt, k++));
+    result.chunkUnit = reinterpret_cast<const char *>(sqlite3_column_text(stmt, k++));
+    result.chunkType = reinterpret_cast<const char *>(sqlite3_column_text(stmt, k++));
+    result.start = sqlite3_column_int64(stmt, k++);
+    result.end = sqlite3_column_int64(stmt, k++);
+    const unsigned char *symbol = sqlite3_column_text(stmt, k++);
+    if (symbol) result.symbol = reinterpret_cast<const char *>(symbol);
+  }
+
   struct SqliteStmt {
     sqlite3_stmt *stmt_ = nullptr;
     sqlite3_stmt *&ref() { return stmt_; }
@@ -62,6 +78,17 @@ struct HnswSqliteVectorDatabase::Impl {
   size_t maxElements_ = 0;
   std::string dbPath_;
   std::string indexPath_;
+
+  float similarity(float distance) const {
+    if (metric_ == DistanceMetric::Cosine) {
+      // InnerProduct returns negative dot product
+      // For normalized vectors: similarity = (1 + dot_product) / 2
+      // Or simply: similarity = -distance (if vectors normalized to [-1,1])
+      return 1.0f - distance; // Higher = more similar
+    }
+    // L2 distance
+    return 1.0f / (1.0f + distance);
+  }
 };
 
 
@@ -100,6 +127,7 @@ size_t HnswSqliteVectorDatabase::addDocument(const Chunk &chunk, const std::vect
     LOG_MSG << "Error during upserting a chunk:" << ex.what();
   }
   imp->index_->addPoint(embedding.data(), chunkId, true);
+  generation_++;
   return chunkId;
 }
 
@@ -131,21 +159,10 @@ std::vector<SearchResult> HnswSqliteVectorDatabase::search(const std::vector<flo
     const auto [distance, label] = result.top();
     result.pop();
 
-    float similarity = 0;
-    if (imp->metric_ == DistanceMetric::Cosine) {
-      // InnerProduct returns negative dot product
-      // For normalized vectors: similarity = (1 + dot_product) / 2
-      // Or simply: similarity = -distance (if vectors normalized to [-1,1])
-      similarity = 1.0f - distance; // Higher = more similar
-    } else {
-      // L2 distance
-      similarity = 1.0f / (1.0f + distance);
-    }
-
     auto chunkData = getChunkData(label);
     if (chunkData.has_value()) {
       SearchResult sr = chunkData.value();
-      sr.similarityScore = similarity;
+      sr.similarityScore = imp->similarity(distance);
       sr.chunkId = label;
       sr.distance = distance;
       searchResults.push_back(sr);
@@ -158,6 +175,137 @@ std::vector<SearchResult> HnswSqliteVectorDatabase::search(const std::vector<flo
   return searchResults;
 }
 
+std::vector<std::vector<SearchResult>> HnswSqliteVectorDatabase::searchBatch(const std::vector<std::vector<float>> &queryEmbeddings, size_t topK) const
+{
+  for (const auto &q : queryEmbeddings) {
+    if (q.size() != imp->vectorDim_) {
+      throw std::runtime_error(fmt::format("Query embedding dimension mismatch: actual {}, claimed {}", q.size(), imp->vectorDim_));
+    }
+  }
+  std::vector<std::vector<SearchResult>> searchResults(queryEmbeddings.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (queryEmbeddings.empty() || imp->index_->getCurrentElementCount() == 0) {
+    return searchResults;
+  }
+
+  // hnswlib allows concurrent searches as long as nothing is added, which the lock guarantees
+  std::vector<std::vector<std::pair<float, hnswlib::labeltype>>> hits(queryEmbeddings.size());
+  std::atomic<size_t> next{ 0 };
+  std::exception_ptr error;
+  std::mutex errorMutex;
+  auto worker = [&]() {
+    for (size_t i = next++; i < queryEmbeddings.size(); i = next++) {
+      try {
+        auto result = imp->index_->searchKnn(queryEmbeddings[i].data(), topK);
+        for (; !result.empty(); result.pop()) {
+          hits[i].push_back(result.top());
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!error) error = std::current_exception();
+      }
+    }
+  };
+  size_t nofThreads = (std::min)(queryEmbeddings.size(), size_t((std::max)(std::thread::hardware_concurrency(), 1u)));
+  if (nofThreads <= 1) {
+    worker();
+  } else {
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nofThreads; t ++) {
+      threads.emplace_back(worker);
+    }
+    for (auto &t : threads) t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  // overlapping question chunks tend to find the same chunks, read each one once
+  std::vector<size_t> labels;
+  for (const auto &h : hits) {
+    for (const auto &[distance, label] : h) labels.push_back(label);
+  }
+  std::sort(labels.begin(), labels.end());
+  labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+  const auto chunks = getChunksData(labels);
+  for (size_t i = 0; i < hits.size(); i ++) {
+    for (const auto &[distance, label] : hits[i]) {
+      auto it = chunks.find(label);
+      if (it != chunks.end()) {
+        SearchResult sr = it->second;
+        sr.similarityScore = imp->similarity(distance);
+        sr.chunkId = label;
+        sr.distance = distance;
+        searchResults[i].push_back(std::move(sr));
+      }
+    }
+    std::sort(searchResults[i].begin(), searchResults[i].end(),
+      [](const SearchResult &a, const SearchResult &b) {
+        return a.similarityScore > b.similarityScore;
+      });
+  }
+  return searchResults;
+}
+
+std::vector<std::vector<SearchResult>> HnswSqliteVectorDatabase::searchSource(const std::vector<std::vector<float>> &queryEmbeddings,
+  const std::string &sourceId, size_t topK) const
+{
+  for (const auto &q : queryEmbeddings) {
+    if (q.size() != imp->vectorDim_) {
+      throw std::runtime_error(fmt::format("Query embedding dimension mismatch: actual {}, claimed {}", q.size(), imp->vectorDim_));
+    }
+  }
+  std::vector<std::vector<SearchResult>> searchResults(queryEmbeddings.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (topK == 0) {
+    return searchResults;
+  }
+
+  // A source holds at most a few thousand chunks: scoring all of them with the
+  // index's own (SIMD) distance, reading the vectors in place, is exact and
+  // cheaper than any graph search restricted to them.
+  const auto &index = *imp->index_;
+  std::vector<std::pair<size_t, const char *>> vectors;
+  for (size_t id : getChunkIdsBySource(sourceId)) {
+    auto it = index.label_lookup_.find(id);
+    if (it != index.label_lookup_.end() && !index.isMarkedDeleted(it->second)) {
+      vectors.emplace_back(id, index.getDataByInternalId(it->second));
+    }
+  }
+  auto distFunc = imp->space_->get_dist_func();
+  void *distParam = imp->space_->get_dist_func_param();
+
+  std::vector<std::vector<std::pair<float, size_t>>> hits(queryEmbeddings.size());
+  std::vector<size_t> labels;
+  for (size_t i = 0; i < queryEmbeddings.size(); i ++) {
+    auto &scored = hits[i];
+    scored.reserve(vectors.size());
+    for (const auto &[id, data] : vectors) {
+      scored.emplace_back(distFunc(queryEmbeddings[i].data(), data, distParam), id);
+    }
+    size_t k = (std::min)(topK, scored.size());
+    std::partial_sort(scored.begin(), scored.begin() + k, scored.end());
+    scored.resize(k);
+    for (const auto &hit : scored) labels.push_back(hit.second);
+  }
+
+  std::sort(labels.begin(), labels.end());
+  labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+  const auto chunks = getChunksData(labels);
+  for (size_t i = 0; i < hits.size(); i ++) {
+    for (const auto &[distance, label] : hits[i]) {
+      auto it = chunks.find(label);
+      if (it != chunks.end()) {
+        SearchResult sr = it->second;
+        sr.similarityScore = imp->similarity(distance);
+        sr.distance = distance;
+        searchResults[i].push_back(std::move(sr));
+      }
+    }
+  }
+  return searchResults;
+}
+
 std::vector<SearchResult> HnswSqliteVectorDatabase::searchWithFilter(const std::vector<float> &queryEmbedding,
   const std::string &sourceFilter,
   const std::string &typeFilter,
@@ -201,6 +349,7 @@ void HnswSqliteVectorDatabase::clear()
   } catch (...) {
     rollback();
   }
+  generation_++;
 }
 
 void HnswSqliteVectorDatabase::initializeDatabase()
@@ -222,10 +371,23 @@ void HnswSqliteVectorDatabase::initializeDatabase()
             token_count INTEGER NOT NULL,
             unit TEXT NOT NULL,
             type TEXT NOT NULL,
+            symbol TEXT NOT NULL DEFAULT '',
+            chunk_hash TEXT NOT NULL DEFAULT '',
             created_at DATETIME DEFAULT CURRENT_TIMESTAMP
         )
     )";
     executeSql(chunksTable);
+    if (!hasColumn("chunks", "symbol")) {
+      // databases created before code chunks carried their enclosing scope
+      executeSql("ALTER TABLE chunks ADD COLUMN symbol TEXT NOT NULL DEFAULT ''");
+    }
+    if (!hasColumn("chunks", "chunk_hash")) {
+      // older chunks have no hash and are simply never reused
+      executeSql("ALTER TABLE chunks ADD COLUMN chunk_hash TEXT NOT NULL DEFAULT ''");
+    }
+    executeSql("CREATE INDEX IF NOT EXISTS idx_chunks_hash ON chunks(chunk_hash)");
+    // chunks of one file: excerpts, source search and deletion
+    executeSql("CREATE INDEX IF NOT EXISTS idx_chunks_source ON chunks(source_id)");
 
     const char *filesTable = R"(
         CREATE TABLE IF NOT EXISTS files_metadata (
@@ -277,23 +439,36 @@ void HnswSqliteVectorDatabase::executeSql(const std::string &sql)
   }
 }
 
+bool HnswSqliteVectorDatabase::hasColumn(const std::string &table, const std::string &column) const
+{
+  SqliteStmt stmt;
+  _checkErr = sqlite3_prepare_v2(imp->db_, ("PRAGMA table_info(" + table + ")").c_str(), -1, &stmt.ref(), nullptr);
+  while (sqlite3_step(stmt.ref()) == SQLITE_ROW) {
+    const unsigned char *name = sqlite3_column_text(stmt.ref(), 1);
+    if (name && column == reinterpret_cast<const char *>(name)) return true;
+  }
+  return false;
+}
+
 size_t HnswSqliteVectorDatabase::insertMetadata(const Chunk &chunk)
 {
   const char *insertSql = R"(
-        INSERT INTO chunks (content, source_id, start_pos, end_pos, token_count, unit, type)
-        VALUES (?, ?, ?, ?, ?, ?, ?)
+        INSERT INTO chunks (content, source_id, start_pos, end_pos, token_count, unit, type, symbol, chunk_hash)
+        VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)
     )";
 
   SqliteStmt stmt;
   _checkErr = sqlite3_prepare_v2(imp->db_, insertSql, -1, &stmt.ref(), nullptr);
   int k = 1;
-  sqlite3_bind_text(stmt.ref(), k++, chunk.text.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt.ref(), k++, chunk.text().data(), static_cast<int>(chunk.text().size()), SQLITE_STATIC);
   sqlite3_bind_text(stmt.ref(), k++, chunk.docUri.c_str(), -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt.ref(), k++, chunk.metadata.start);
   sqlite3_bind_int64(stmt.ref(), k++, chunk.metadata.end);
   sqlite3_bind_int64(stmt.ref(), k++, chunk.metadata.tokenCount);
   sqlite3_bind_text(stmt.ref(), k++, chunk.metadata.unit.c_str(), -1, SQLITE_STATIC);
   sqlite3_bind_text(stmt.ref(), k++, chunk.metadata.type.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt.ref(), k++, chunk.metadata.symbol.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt.ref(), k++, chunk.hash.c_str(), -1, SQLITE_STATIC);
   int rc = sqlite3_step(stmt.ref());
   if (rc != SQLITE_DONE) {
     throw std::runtime_error("Failed to insert chunk metadata: " + std::string(sqlite3_errmsg(imp->db_)));
@@ -305,7 +480,7 @@ size_t HnswSqliteVectorDatabase::insertMetadata(const Chunk &chunk)
 std::optional<SearchResult> HnswSqliteVectorDatabase::getChunkData(size_t chunkId) const
 {
   const char *selectSql = R"(
-        SELECT content, source_id, unit, type, start_pos, end_pos
+        SELECT content, source_id, unit, type, start_pos, end_pos, symbol
         FROM chunks WHERE id = ?
     )";
   SqliteStmt stmt;
@@ -314,18 +489,37 @@ std::optional<SearchResult> HnswSqliteVectorDatabase::getChunkData(size_t chunkI
   SearchResult result;
   bool found = false;
   if (sqlite3_step(stmt.ref()) == SQLITE_ROW) {
-    int k = 0;
-    result.content = reinterpret_cast<const char *>(sqlite3_column_text(stmt.ref(), k++));
-    result.sourceId = reinterpret_cast<const char *>(sqlite3_column_text(stmt.ref(), k++));
-    result.chunkUnit = reinterpret_cast<const char *>(sqlite3_column_text(stmt.ref(), k++));
-    result.chunkType = reinterpret_cast<const char *>(sqlite3_column_text(stmt.ref(), k++));
-    result.start = sqlite3_column_int64(stmt.ref(), k++);
-    result.end = sqlite3_column_int64(stmt.ref(), k++);
+    readChunkRow(stmt.ref(), 0, result);
     found = true;
   }
   return found ? std::optional<SearchResult>(result) : std::nullopt;
 }
 
+std::unordered_map<size_t, SearchResult> HnswSqliteVectorDatabase::getChunksData(const std::vector<size_t> &chunkIds) const
+{
+  std::unordered_map<size_t, SearchResult> found;
+  // one statement per slice of ids, well below SQLite's host parameter limit
+  const size_t sliceSize = 250;
+  for (size_t first = 0; first < chunkIds.size(); first += sliceSize) {
+    const size_t n = (std::min)(sliceSize, chunkIds.size() - first);
+    std::string sql = "SELECT id, content, source_id, unit, type, start_pos, end_pos, symbol FROM chunks WHERE id IN (?";
+    for (size_t i = 1; i < n; i ++) sql += ",?";
+    sql += ")";
+    SqliteStmt stmt;
+    _checkErr = sqlite3_prepare_v2(imp->db_, sql.c_str(), -1, &stmt.ref(), nullptr);
+    for (size_t i = 0; i < n; i ++) {
+      _checkErr = sqlite3_bind_int64(stmt.ref(), static_cast<int>(i + 1), chunkIds[first + i]);
+    }
+    while (sqlite3_step(stmt.ref()) == SQLITE_ROW) {
+      size_t id = sqlite3_column_int64(stmt.ref(), 0);
+      auto &result = found[id];
+      readChunkRow(stmt.ref(), 1, result);
+      result.chunkId = id;
+    }
+  }
+  return found;
+}
+
 std::vector<size_t> HnswSqliteVectorDatabase::getChunkIdsBySource(const std::string &sourceId) const
 {
   std::vector<size_t> ids;
@@ -357,6 +551,7 @@ size_t HnswSqliteVectorDatabase::deleteDocumentsBySource(const std::string &sour
       LOG_MSG << "Label" << id << "might already be deleted or not exist." << e.what();
     }
   }
+  generation_++;
   return n;
 }
 
@@ -423,6 +618,30 @@ std::vector<float> HnswSqliteVectorDatabase::getEmbeddingVector(size_t chunkId)
   return imp->index_->getDataByLabel<float>(chunkId);
 }
 
+std::unordered_map<std::string, std::vector<float>> HnswSqliteVectorDatabase::getEmbeddingsByHash(const std::vector<std::string> &hashes) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unordered_map<std::string, std::vector<float>> found;
+  SqliteStmt stmt;
+  const char *sql = "SELECT id FROM chunks WHERE chunk_hash = ?";
+  _checkErr = sqlite3_prepare_v2(imp->db_, sql, -1, &stmt.ref(), nullptr);
+  for (const auto &hash : hashes) {
+    if (hash.empty() || found.count(hash)) continue;
+    sqlite3_reset(stmt.ref());
+    _checkErr = sqlite3_bind_text(stmt.ref(), 1, hash.c_str(), -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt.ref()) == SQLITE_ROW) {
+      size_t id = sqlite3_column_int64(stmt.ref(), 0);
+      try {
+        found.emplace(hash, imp->index_->getDataByLabel<float>(id));
+        break;
+      } catch (const std::exception &) {
+        // vector marked deleted, try another chunk with the same content
+      }
+    }
+  }
+  return found;
+}
+
 
 bool HnswSqliteVectorDatabase::fileExistsInMetadata(const std::string &path) const
 {
@@ -528,6 +747,7 @@ void HnswSqliteVectorDatabase::compactIndex()
   // Replace old index
   imp->space_ = std::move(newSpace);
   imp->index_ = std::move(newIndex);
+  generation_++;
 
   LOG_MSG << "Compaction complete. Active items: " << imp->index_->getCurrentElementCount();
 }
@@ -0,0 +1,288 @@
+#include "embcache.h"
+#include "app.h"
+#include <sqlite3.h>
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <stdexcept>
+#include <utils_log/logger.hpp>
+
+
+namespace {
+
+  struct CacheStmt {
+    sqlite3_stmt *stmt_ = nullptr;
+    sqlite3_stmt *&ref() { return stmt_; }
+    ~CacheStmt() { if (stmt_) sqlite3_finalize(stmt_); }
+    CacheStmt() = default;
+    CacheStmt(const CacheStmt &) = delete;
+    CacheStmt &operator=(const CacheStmt &) = delete;
+  };
+
+} // anonymous namespace
+
+
+struct EmbeddingCache::Impl {
+  sqlite3 *db_ = nullptr;
+  std::string path_;
+  size_t maxEntries_ = 0;
+  // LRU clock, persisted in last_used so the order survives restarts
+  int64_t clock_ = 0;
+  mutable std::mutex mutex_;
+  Stats stats_;
+
+  void check(int rc) const {
+    if (rc == SQLITE_OK || rc == SQLITE_DONE || rc == SQLITE_ROW) return;
+    throw std::runtime_error(std::string("Embedding cache error: ") + sqlite3_errmsg(db_));
+  }
+  void exec(const char *sql) const {
+    check(sqlite3_exec(db_, sql, nullptr, nullptr, nullptr));
+  }
+  int64_t scalar(const char *sql) const {
+    CacheStmt stmt;
+    check(sqlite3_prepare_v2(db_, sql, -1, &stmt.ref(), nullptr));
+    return sqlite3_step(stmt.ref()) == SQLITE_ROW ? sqlite3_column_int64(stmt.ref(), 0) : 0;
+  }
+  void evict();
+};
+
+void EmbeddingCache::Impl::evict()
+{
+  // trim in one go once the table overshoots by a few percent, so a bulk
+  // embed does not pay for a DELETE after every batch
+  size_t slack = (std::max)(maxEntries_ / 32, size_t(1));
+  if (maxEntries_ == 0 || stats_.entries <= maxEntries_ + slack) {
+    return;
+  }
+  // the running count is an upper bound (replaced rows, other instances)
+  stats_.entries = static_cast<size_t>(scalar("SELECT COUNT(*) FROM embedding_cache"));
+  if (stats_.entries <= maxEntries_) {
+    return;
+  }
+  size_t excess = stats_.entries - maxEntries_;
+  CacheStmt stmt;
+  check(sqlite3_prepare_v2(db_,
+    "DELETE FROM embedding_cache WHERE key IN "
+    "(SELECT key FROM embedding_cache ORDER BY last_used LIMIT ?)", -1, &stmt.ref(), nullptr));
+  sqlite3_bind_int64(stmt.ref(), 1, static_cast<int64_t>(excess));
+  check(sqlite3_step(stmt.ref()));
+  size_t removed = static_cast<size_t>(sqlite3_changes(db_));
+  stats_.evictions += removed;
+  stats_.entries -= (std::min)(removed, stats_.entries);
+}
+
+EmbeddingCache::EmbeddingCache(const std::string &path, size_t maxEntries) : imp(new Impl)
+{
+  imp->path_ = path;
+  imp->maxEntries_ = maxEntries;
+  imp->stats_.maxEntries = maxEntries;
+  if (sqlite3_open(path.c_str(), &imp->db_) != SQLITE_OK) {
+    std::string err = imp->db_ ? sqlite3_errmsg(imp->db_) : "out of memory";
+    sqlite3_close(imp->db_);
+    imp->db_ = nullptr;
+    throw std::runtime_error("Cannot open embedding cache: " + err);
+  }
+  try {
+    // the file may be shared by several running instances
+    sqlite3_busy_timeout(imp->db_, 2000);
+    imp->exec("PRAGMA journal_mode=WAL");
+    imp->exec("PRAGMA synchronous=NORMAL");
+    imp->exec(R"(
+        CREATE TABLE IF NOT EXISTS embedding_cache (
+            key TEXT PRIMARY KEY,
+            dim INTEGER NOT NULL,
+            vector BLOB NOT NULL,
+            last_used INTEGER NOT NULL
+        )
+    )");
+    imp->exec("CREATE INDEX IF NOT EXISTS idx_embedding_cache_lru ON embedding_cache(last_used)");
+    imp->clock_ = imp->scalar("SELECT COALESCE(MAX(last_used), 0) FROM embedding_cache");
+    imp->stats_.entries = static_cast<size_t>(imp->scalar("SELECT COUNT(*) FROM embedding_cache"));
+    imp->evict();
+  } catch (...) {
+    sqlite3_close(imp->db_);
+    imp->db_ = nullptr;
+    throw;
+  }
+  LOG_MSG << "Embedding cache" << path << "with" << imp->stats_.entries << "entries";
+}
+
+EmbeddingCache::~EmbeddingCache()
+{
+  if (imp->db_) {
+    sqlite3_close(imp->db_);
+  }
+}
+
+std::string EmbeddingCache::makeKey(std::string_view model, std::string_view text)
+{
+  std::string data;
+  data.reserve(model.size() + 1 + text.size());
+  data.append(model).push_back('\0');
+  data.append(text);
+  return utils::contentHash(data) + ":" + std::to_string(text.size());
+}
+
+size_t EmbeddingCache::lookup(const std::vector<std::string> &keys, std::vector<std::vector<float>> &embeddings)
+{
+  embeddings.assign(keys.size(), {});
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  size_t hits = 0;
+  try {
+    imp->exec("BEGIN");
+    CacheStmt sel, upd;
+    imp->check(sqlite3_prepare_v2(imp->db_, "SELECT dim, vector FROM embedding_cache WHERE key = ?", -1, &sel.ref(), nullptr));
+    imp->check(sqlite3_prepare_v2(imp->db_, "UPDATE embedding_cache SET last_used = ? WHERE key = ?", -1, &upd.ref(), nullptr));
+    for (size_t i = 0; i < keys.size(); i ++) {
+      sqlite3_reset(sel.ref());
+      sqlite3_bind_text(sel.ref(), 1, keys[i].c_str(), -1, SQLITE_STATIC);
+      if (sqlite3_step(sel.ref()) != SQLITE_ROW) {
+        continue;
+      }
+      size_t dim = static_cast<size_t>(sqlite3_column_int64(sel.ref(), 0));
+      const void *blob = sqlite3_column_blob(sel.ref(), 1);
+      size_t bytes = static_cast<size_t>(sqlite3_column_bytes(sel.ref(), 1));
+      if (!blob || dim == 0 || bytes != dim * sizeof(float)) {
+        continue;
+      }
+      const float *data = static_cast<const float *>(blob);
+      embeddings[i].assign(data, data + dim);
+      hits ++;
+
+      sqlite3_reset(upd.ref());
+      sqlite3_bind_int64(upd.ref(), 1, ++imp->clock_);
+      sqlite3_bind_text(upd.ref(), 2, keys[i].c_str(), -1, SQLITE_STATIC);
+      imp->check(sqlite3_step(upd.ref()));
+    }
+    imp->exec("COMMIT");
+  } catch (const std::exception &e) {
+    sqlite3_exec(imp->db_, "ROLLBACK", nullptr, nullptr, nullptr);
+    LOG_MSG << "Embedding cache lookup failed:" << e.what();
+  }
+  imp->stats_.hits += hits;
+  imp->stats_.misses += keys.size() - hits;
+  return hits;
+}
+
+void EmbeddingCache::store(const std::vector<std::string> &keys, const std::vector<std::vector<float>> &embeddings)
+{
+  if (keys.size() != embeddings.size()) {
+    throw std::runtime_error("Embedding cache keys and vectors count mismatch");
+  }
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  try {
+    imp->exec("BEGIN");
+    CacheStmt ins;
+    imp->check(sqlite3_prepare_v2(imp->db_,
+      "INSERT OR REPLACE INTO embedding_cache (key, dim, vector, last_used) VALUES (?, ?, ?, ?)", -1, &ins.ref(), nullptr));
+    size_t stored = 0;
+    for (size_t i = 0; i < keys.size(); i ++) {
+      const auto &v = embeddings[i];
+      if (v.empty()) continue;
+      sqlite3_reset(ins.ref());
+      sqlite3_bind_text(ins.ref(), 1, keys[i].c_str(), -1, SQLITE_STATIC);
+      sqlite3_bind_int64(ins.ref(), 2, static_cast<int64_t>(v.size()));
+      sqlite3_bind_blob(ins.ref(), 3, v.data(), static_cast<int>(v.size() * sizeof(float)), SQLITE_STATIC);
+      sqlite3_bind_int64(ins.ref(), 4, ++imp->clock_);
+      imp->check(sqlite3_step(ins.ref()));
+      stored ++;
+    }
+    imp->stats_.stores += stored;
+    imp->stats_.entries += stored;
+    imp->evict();
+    imp->exec("COMMIT");
+  } catch (const std::exception &e) {
+    sqlite3_exec(imp->db_, "ROLLBACK", nullptr, nullptr, nullptr);
+    LOG_MSG << "Embedding cache store failed:" << e.what();
+  }
+}
+
+EmbeddingCache::Stats EmbeddingCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  return imp->stats_;
+}
+
+std::string EmbeddingCache::path() const
+{
+  return imp->path_;
+}
+
+//---------------------------------------------------------------------------
+
+
+QueryEmbeddingCache::QueryEmbeddingCache(size_t maxEntries, std::chrono::seconds ttl)
+  : maxEntries_(maxEntries), ttl_(ttl)
+{
+  stats_.maxEntries = maxEntries;
+}
+
+std::string QueryEmbeddingCache::makeKey(std::string_view model, std::string_view query)
+{
+  std::string key{ model };
+  key.push_back('\0');
+  size_t start = key.size();
+  bool space = false;
+  for (char c : query) {
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      space = true;
+      continue;
+    }
+    if (space && key.size() > start) key.push_back(' ');
+    space = false;
+    key.push_back(c);
+  }
+  return key;
+}
+
+bool QueryEmbeddingCache::lookup(const std::string &key, std::vector<float> &embedding)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    stats_.misses ++;
+    return false;
+  }
+  if (Clock::now() >= it->second->expires) {
+    lru_.erase(it->second);
+    index_.erase(it);
+    stats_.expired ++;
+    stats_.misses ++;
+    stats_.entries = lru_.size();
+    return false;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  embedding = it->second->embedding;
+  stats_.hits ++;
+  return true;
+}
+
+void QueryEmbeddingCache::store(const std::string &key, const std::vector<float> &embedding)
+{
+  if (maxEntries_ == 0 || embedding.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto expires = Clock::now() + ttl_;
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    it->second->embedding = embedding;
+    it->second->expires = expires;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  lru_.push_front({ key, embedding, expires });
+  index_[key] = lru_.begin();
+  while (lru_.size() > maxEntries_) {
+    index_.erase(lru_.back().key);
+    lru_.pop_back();
+    stats_.evictions ++;
+  }
+  stats_.entries = lru_.size();
+}
+
+QueryEmbeddingCache::Stats QueryEmbeddingCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
@@ -4,6 +4,12 @@
 #include "sourceproc.h"
 #include "database.h"
 #include "inference.h"
+#include "embcache.h"
+#include "sourcecache.h"
+#include "ctxpacker.h"
+#include "chatsession.h"
+#include "sse.h"
+#include "searchcache.h"
 #include "settings.h"
 #include "tokenizer.h"
 #include "instregistry.h"
@@ -12,7 +18,6 @@
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 #include <utils_log/logger.hpp>
-#include <hnswlib/hnswlib.h>
 #include <chrono>
 #include <cassert>
 #include <exception>
@@ -21,6 +26,12 @@
 #include <string>
 #include <atomic>
 #include <functional>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <string_view>
 //#include <format>
 #include <filesystem>
@@ -137,24 +148,41 @@ namespace {
     return std::clamp(std::clamp(neighbors, size_t(minChunks), size_t(maxChunks)), size_t(1), size_t(101));
   }
 
-  bool isWithinThreshold(const App &app, const std::string &content, size_t maxTokenBudget, size_t usedTokens, float thresholdRatio, size_t *pTokens = nullptr) {
+  // Content of a context source and its token count. Local files come from the
+  // source cache while they are unchanged on disk.
+  std::string fetchContext(const App &app, const std::string &src, size_t &tokens) {
+    auto *cache = app.sourceCache();
+    SourceContentCache::Entry entry;
+    if (cache && cache->lookup(src, entry)) {
+      tokens = entry.tokens;
+      return std::move(entry.content);
+    }
+    SourceContentCache::Stamp stamp;
+    bool stamped = cache && SourceContentCache::stampOf(src, stamp);
+    auto data = app.sourceProcessor().fetchSource(src);
+    tokens = app.tokenizer().countTokensWithVocab(data.content);
+    if (stamped && !data.isUrl && !data.content.empty()) {
+      cache->store(src, stamp, { data.content, tokens });
+    }
+    return std::move(data.content);
+  }
+
+  bool isWithinThreshold(const App &app, size_t tokens, size_t maxTokenBudget, size_t usedTokens, float thresholdRatio) {
     const auto excerptBudget = maxTokenBudget - usedTokens;
     if (excerptBudget <= 0) return false;
     const auto avgChunkTokens = app.settings().chunkingMaxTokens();
-    const auto tokens = app.tokenizer().countTokensWithVocab(content);
-    if (pTokens) *pTokens = tokens;
     auto threshold = (std::max)(static_cast<size_t>(excerptBudget * thresholdRatio), avgChunkTokens);
     return tokens <= threshold;
   }
 
-  bool processContent(const App &app, std::string &content, const std::string &src, size_t chunkId, size_t maxTokenBudget, size_t &usedTokens) {
+  // contentTokens: token count of content as fetched
+  bool processContent(const App &app, std::string &content, size_t contentTokens, const std::string &src, size_t chunkId, size_t maxTokenBudget, size_t &usedTokens) {
     const auto excerptBudget = maxTokenBudget - usedTokens;
     if (excerptBudget <= 0) return false;
     // If the source file of the best chunk is too large then we fetch an excerpt of it instead.
     const auto avgChunkTokens = app.settings().chunkingMaxTokens();    
     float thresholdRatio = app.settings().generationExcerptThresholdRatio();
-    size_t contentTokens = 0;
-    if (!isWithinThreshold(app, content, maxTokenBudget, usedTokens, thresholdRatio, &contentTokens)) {
+    if (!isWithinThreshold(app, contentTokens, maxTokenBudget, usedTokens, thresholdRatio)) {
       if (!app.settings().generationExcerptEnabled()) {
         return false;
       }
@@ -165,7 +193,12 @@ namespace {
       }
       size_t minChunks = app.settings().generationExcerptMinChunks();
       size_t maxChunks = app.settings().generationExcerptMaxChunks();
-      const auto nofNb = calculateNeighborCount(static_cast<size_t>(excerptBudget * thresholdRatio), avgChunkTokens, minChunks, maxChunks);
+      auto nofNb = calculateNeighborCount(static_cast<size_t>(excerptBudget * thresholdRatio), avgChunkTokens, minChunks, maxChunks);
+      // Code chunks are cut along function/class scopes, so a scoped match is already whole
+      auto center = app.db().getChunkData(chunkId);
+      if (center.has_value() && center->chunkType == "code" && !center->symbol.empty()) {
+        nofNb = (std::min)(nofNb, std::clamp(minChunks, size_t(1), size_t(101)));
+      }
       const auto betterIds = getClosestNeighbors(ids, chunkId, nofNb);
       std::vector<std::string> chunkhood;
       for (auto i : betterIds) {
@@ -337,7 +370,9 @@ namespace {
     std::vector<std::string> sources,
     float contextSizeRatio,
     bool attachedOnly,
-    std::function<void(std::string_view)> onInfo
+    std::function<void(std::string_view)> onInfo,
+    ChatSession *session = nullptr,
+    ChatSessionStore *sessions = nullptr
   ) {
     assert(onInfo);
     // Preferred order
@@ -363,6 +398,14 @@ namespace {
 
     LOG_MSG << "Total context budget:" << maxTokenBudget;
 
+    auto stageStart = std::chrono::steady_clock::now();
+    auto stageDone = [&stageStart, &onInfo](std::string_view what) {
+      auto now = std::chrono::steady_clock::now();
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - stageStart).count();
+      onInfo(fmt::format("{} ({} ms)", what, ms));
+      stageStart = now;
+    };
+
     LOG_MSG << "Budget used for question:" << questionTokens;
 
     {
@@ -409,26 +452,86 @@ namespace {
     std::vector<std::string> allFullSources;
     std::vector<std::string> relSources;
 
+    if (session && session->generation != app.db().generation()) {
+      session->reset(app.db().generation()); // the index changed, earlier hits may be gone
+    }
+
     EmbeddingClient embeddingClient(app.settings().embeddingCurrentApi(), app.settings().embeddingTimeoutMs());
     const auto questionChunks = app.chunker().chunkText(question, "", false);
+    std::vector<std::string> questionTexts;
     for (const auto &qc : questionChunks) {
-      std::vector<float> embedding;
-      embeddingClient.generateEmbeddings(qc.text, embedding, EmbeddingClient::EncodeType::Query);
-      questionEmbeddingVectors.push_back(embedding);
+      questionTexts.push_back(qc.str());
+    }
+    // parts of the question asked before in this conversation are taken from the session
+    std::vector<std::vector<SearchResult>> questionHits(questionTexts.size());
+    std::vector<size_t> pending;
+    questionEmbeddingVectors.resize(questionTexts.size());
+    for (size_t i = 0; i < questionTexts.size(); i ++) {
+      const auto *q = (session && !attachedOnly) ? session->findQuery(questionTexts[i]) : nullptr;
+      if (q) {
+        questionEmbeddingVectors[i] = q->embedding;
+        questionHits[i] = q->hits;
+      } else {
+        pending.push_back(i);
+      }
+    }
+    std::vector<std::vector<float>> pendingVectors;
+    if (!pending.empty()) {
+      std::vector<std::string> pendingTexts;
+      for (auto i : pending) {
+        pendingTexts.push_back(questionTexts[i]);
+      }
+      // all new question chunks go out in one batched request
+      embeddingClient.generateEmbeddings(pendingTexts, pendingVectors, EmbeddingClient::EncodeType::Query);
+      for (size_t k = 0; k < pending.size(); k ++) {
+        questionEmbeddingVectors[pending[k]] = pendingVectors[k];
+      }
+    }
+    const size_t reusedParts = questionTexts.size() - pending.size();
+    if (reusedParts) {
+      stageDone(fmt::format("Question embedded in {} part(s), {} reused from the conversation", questionTexts.size(), reusedParts));
+    } else {
+      stageDone(fmt::format("Question embedded in {} part(s)", questionTexts.size()));
     }
 
     if (!attachedOnly) {
+      if (!pendingVectors.empty()) {
+        auto found = app.db().searchBatch(pendingVectors, app.settings().embeddingTopK());
+        for (size_t k = 0; k < pending.size(); k ++) {
+          questionHits[pending[k]] = std::move(found[k]);
+          if (session) {
+            session->addQuery({ questionTexts[pending[k]], pendingVectors[k], questionHits[pending[k]] });
+          }
+        }
+      }
       std::unordered_map<std::string, float> sourcesRank;
-      for (const auto &embedding : questionEmbeddingVectors) {
-        auto res = app.db().search(embedding, app.settings().embeddingTopK());
+      for (const auto &res : questionHits) {
         filteredChunkResults.insert(filteredChunkResults.end(), res.begin(), res.end());
         for (const auto &r : res) {
           sourcesRank[r.sourceId] += r.similarityScore;
         }
       }
-      std::sort(filteredChunkResults.begin(), filteredChunkResults.end(), [&sourcesRank](const SearchResult &a, const SearchResult &b) {
-        return sourcesRank[a.sourceId] > sourcesRank[b.sourceId];
+      if (session) {
+        // the previous turn's chunks stay candidates for a follow-up, at half weight
+        auto carried = std::move(session->previousHits);
+        session->previousHits = filteredChunkResults;
+        for (auto &r : carried) {
+          bool known = std::any_of(filteredChunkResults.begin(), filteredChunkResults.end(), [&r](const SearchResult &x) {
+            return x.sourceId == r.sourceId && x.chunkId == r.chunkId;
+            });
+          if (known) continue;
+          r.similarityScore *= 0.5f;
+          sourcesRank[r.sourceId] += r.similarityScore;
+          filteredChunkResults.push_back(std::move(r));
+        }
+        if (sessions) sessions->countReuse(reusedParts, false);
+      }
+      // best ranked sources first, their chunks by score
+      std::stable_sort(filteredChunkResults.begin(), filteredChunkResults.end(), [&sourcesRank](const SearchResult &a, const SearchResult &b) {
+        float ra = sourcesRank[a.sourceId], rb = sourcesRank[b.sourceId];
+        return ra != rb ? ra > rb : a.similarityScore > b.similarityScore;
         });
+      stageDone(fmt::format("Found {} relevant chunks in {} files", filteredChunkResults.size(), sourcesRank.size()));
 
       const auto maxFullSources = app.settings().generationMaxFullSources();
       for (const auto &r : filteredChunkResults) {
@@ -437,15 +540,10 @@ namespace {
         sourceToChunk[r.sourceId] = r;
       }
 
-      const auto trackedFiles = app.db().getTrackedFiles();
-      std::vector<std::string> trackedSources;
-      for (const auto &tf : trackedFiles) {
-        trackedSources.push_back(tf.path);
-      }
-
       allFullSources = sources;
+      const auto maxRelated = app.settings().generationMaxRelatedPerSource();
       for (const auto &src : sources) {
-        auto relations = app.sourceProcessor().filterRelatedSources(trackedSources, src);
+        auto relations = app.relatedSources().find(src, maxRelated);
         vecAddIfUnique(relSources, relations);
         vecAddIfUnique(allFullSources, relations);
       }
@@ -460,58 +558,97 @@ namespace {
       assert(relSources.empty());
     }
 
+    // The sources and related files of the previous turn are reused when the selection,
+    // the budget and the files themselves are unchanged; an unchanged context also keeps
+    // the prompt prefix cacheable. Files that cannot be stamped (URLs) are always read.
+    std::string contextKey;
+    bool contextReused = false;
+    if (session) {
+      contextKey = fmt::format("{}:{}:{}\n", maxTokenBudget, attachedOnly, usedTokens - questionTokens);
+      auto addStamped = [&contextKey](const std::string &src, size_t chunkId) {
+        SourceContentCache::Stamp stamp;
+        if (!SourceContentCache::stampOf(src, stamp)) return false;
+        contextKey += fmt::format("{}#{}:{}:{}\n", src, chunkId, stamp.mtime.time_since_epoch().count(), stamp.size);
+        return true;
+      };
+      bool stamped = true;
+      for (const auto &src : sources) {
+        auto it = sourceToChunk.find(src);
+        stamped = stamped && addStamped(src, it != sourceToChunk.end() ? it->second.chunkId : std::string::npos);
+      }
+      for (const auto &rel : relSources) {
+        stamped = stamped && addStamped(rel, std::string::npos);
+      }
+      contextKey = stamped ? utils::contentHash(contextKey) : std::string();
+      contextReused = !contextKey.empty() && contextKey == session->contextKey;
+    }
+    // Offsets of kept files are counted from here, so the question's length does not
+    // matter. A whole file is taken over when it is still within the threshold; an
+    // excerpt only at the same offset, where it would have been cut the same way.
+    const size_t contextStart = usedTokens;
+    const float excerptRatio = app.settings().generationExcerptThresholdRatio();
+    std::vector<ChatSession::Source> keptSources, keptRelated;
+    size_t nofReused = 0;
+    auto takeKept = [&](const std::string &src, bool related, float thresholdRatio, std::vector<SearchResult> &results) {
+      if (!contextReused) return false;
+      const auto *kept = ChatSession::findSource(related ? session->related : session->sources, src, usedTokens - contextStart,
+        [&](const ChatSession::Source &s) {
+          return s.whole ? isWithinThreshold(app, s.tokens, maxTokenBudget, usedTokens, thresholdRatio) : usedTokens + s.tokens <= maxTokenBudget;
+        });
+      if (!kept) return false;
+      results.push_back(kept->result);
+      auto &again = (related ? keptRelated : keptSources).emplace_back(*kept);
+      again.offset = usedTokens - contextStart;
+      usedTokens += kept->tokens;
+      nofReused ++;
+      return true;
+    };
+
     size_t srcTokens = 0;
     for (size_t j = 0; j < sources.size(); j ++) {
+      // budget filled: stop reading, generation can start
+      if (maxTokenBudget <= usedTokens) break;
       const auto &src = sources[j];
+      const auto offset = usedTokens;
+      float thresholdRatio = excerptRatio;
+      if (!sourceToChunk.count(src) && attachedOnly && j == sources.size() - 1) thresholdRatio = 1.0f;
+      if (takeKept(src, false, thresholdRatio, fullSourceResults)) {
+        srcTokens += usedTokens - offset;
+        continue;
+      }
       // src is either a user-set context file, or a chunk's base file (sourceToChunk).
-      auto content = app.sourceProcessor().fetchSource(src).content;
-      if (maxTokenBudget <= usedTokens) break;
+      bool searched = false; // excerpt picked by this question
       size_t contentTokens = 0;
+      auto content = fetchContext(app, src, contentTokens);
+      bool whole = isWithinThreshold(app, contentTokens, maxTokenBudget, usedTokens, thresholdRatio);
       if (sourceToChunk.count(src)) {
         auto nUsed = usedTokens;
-        if (!processContent(app, content, src, sourceToChunk[src].chunkId, maxTokenBudget, usedTokens)) {
+        if (!processContent(app, content, contentTokens, src, sourceToChunk[src].chunkId, maxTokenBudget, usedTokens)) {
           break;
         }
+        contentTokens = 0; // counted by processContent
         srcTokens += usedTokens - nUsed;
       } else {
-        float thresholdRatio = app.settings().generationExcerptThresholdRatio();
-        if (attachedOnly && j == sources.size() - 1) thresholdRatio = 1.0f;
-        if (!isWithinThreshold(app, content, maxTokenBudget, usedTokens, thresholdRatio, &contentTokens)) {
+        if (!whole) {
           auto info = fmt::format("Processing large file {}", std::filesystem::path(src).filename().string());
           onInfo(info);
           auto ids = app.db().getChunkIdsBySource(src);
+          searched = true;
           if (!ids.empty()) {
             const auto remaining = maxTokenBudget - usedTokens;
             const auto avgChunkTokens = app.settings().chunkingMaxTokens();
             const auto nofMaxChunks = remaining / avgChunkTokens;
-            hnswlib::InnerProductSpace space{ app.settings().databaseVectorDim() };
-            hnswlib::HierarchicalNSW<float> hnswDB(&space, 1000, 16, 200, 42, true);
-            ids.resize(999);
-            std::unordered_map<size_t, std::string> idToContent;
-            for (auto id : ids) {
-              if (auto opt = app.db().getChunkData(id)) {
-                auto vec = app.db().getEmbeddingVector(id);
-                hnswDB.addPoint(vec.data(), id);
-                idToContent[id] = std::move(opt->content);
-              }
-            }
             content.clear();
             contentTokens = 0;
             const auto topK = static_cast<size_t>(nofMaxChunks * thresholdRatio);
             if (0 < topK) {
               assert(!questionEmbeddingVectors.empty());
               content.reserve(questionEmbeddingVectors.size() * topK);
-              int nofFetched = 0;
-              for (const auto &v : questionEmbeddingVectors) {
-                auto result = hnswDB.searchKnn(v.data(), topK);
-                nofFetched = result.size();
-                std::vector<SearchResult> searchResults;
-                while (!result.empty()) {
-                  const auto [distance, label] = result.top();
-                  result.pop();
-                  float similarity = 1.0f - distance; // Higher = more similar
-                  auto chunk = idToContent[label];
-                  content += chunk;
+              size_t nofFetched = 0;
+              for (const auto &hits : app.db().searchSource(questionEmbeddingVectors, src, topK)) {
+                nofFetched = hits.size();
+                for (const auto &hit : hits) {
+                  content += hit.content;
                 }
               }
               onInfo(fmt::format("Adding {} relevant chunks from {}", nofFetched, std::filesystem::path(src).filename().string()));
@@ -525,21 +662,40 @@ namespace {
       if (!content.empty()) {
         addToSearchResult(fullSourceResults, src, std::move(content));
         usedTokens += contentTokens;
+        if (!searched) {
+          keptSources.push_back({ fullSourceResults.back(), usedTokens - offset, offset - contextStart, whole });
+        }
       }
     }
     LOG_MSG << "Budget used for full sources:" << srcTokens;
+    if (fullSourceResults.size() > nofReused) {
+      stageDone(fmt::format("Read {} source files", fullSourceResults.size() - nofReused));
+    }
 
     if (!attachedOnly) {
       size_t relTokens = 0;
+      const size_t srcReused = nofReused;
       for (const auto &rel : relSources) {
-        auto content = app.sourceProcessor().fetchSource(rel).content;
+        if (maxTokenBudget <= usedTokens) break;
         auto nUsed = usedTokens;
-        if (processContent(app, content, rel, -1, maxTokenBudget, usedTokens)) {
+        if (takeKept(rel, true, excerptRatio, relatedSrcResults)) {
+          relTokens += usedTokens - nUsed;
+          continue;
+        }
+        size_t contentTokens = 0;
+        auto content = fetchContext(app, rel, contentTokens);
+        bool whole = isWithinThreshold(app, contentTokens, maxTokenBudget, usedTokens, excerptRatio);
+        if (processContent(app, content, contentTokens, rel, -1, maxTokenBudget, usedTokens)) {
           relTokens += usedTokens - nUsed;
           addToSearchResult(relatedSrcResults, rel, std::move(content));
+          keptRelated.push_back({ relatedSrcResults.back(), usedTokens - nUsed, nUsed - contextStart, whole });
         }
       }
       LOG_MSG << "Budget used for related sources:" << relTokens;
+      const auto nofRead = relatedSrcResults.size() - (nofReused - srcReused);
+      if (nofRead) {
+        stageDone(fmt::format("Read {} related files", nofRead));
+      }
 
       filteredChunkResults.erase(std::remove_if(filteredChunkResults.begin(), filteredChunkResults.end(),
         [&allFullSources](const SearchResult &r) {
@@ -547,14 +703,31 @@ namespace {
         }), filteredChunkResults.end());
     }
 
-    // Assemble final ordered results
-    orderedResults.insert(orderedResults.end(), attachmentResults.begin(), attachmentResults.end());
-    orderedResults.insert(orderedResults.end(), fullSourceResults.begin(), fullSourceResults.end());
-    orderedResults.insert(orderedResults.end(), relatedSrcResults.begin(), relatedSrcResults.end());
-    orderedResults.insert(orderedResults.end(), filteredChunkResults.begin(), filteredChunkResults.end());
-    if (app.settings().generationMaxChunks() < orderedResults.size()) {
-      orderedResults.resize(app.settings().generationMaxChunks());
+    if (nofReused) {
+      if (sessions) sessions->countReuse(0, true);
+      stageDone(fmt::format("Reused {} source files from the conversation", nofReused));
     }
+    if (session) {
+      session->contextKey = contextKey;
+      session->sources = std::move(keptSources);
+      session->related = std::move(keptRelated);
+    }
+
+    // Assemble final ordered results. What was budgeted above is pinned in the
+    // preferred order; the chunks compete for the remaining budget.
+    std::vector<ContextPacker::Candidate> candidates;
+    for (const auto *group : { &attachmentResults, &fullSourceResults, &relatedSrcResults }) {
+      for (const auto &r : *group) {
+        candidates.push_back({ r, 0, true }); // already counted in usedTokens
+      }
+    }
+    for (const auto &r : filteredChunkResults) {
+      candidates.push_back({ r, app.tokenizer().countTokensWithVocab(r.content), false });
+    }
+    ContextPacker packer(maxTokenBudget - (std::min)(usedTokens, maxTokenBudget), app.settings().generationMaxChunks());
+    auto packed = packer.pack(candidates);
+    orderedResults = std::move(packed.results);
+    usedTokens += packed.tokens;
     onInfo(fmt::format("Context token budget used {}/{}", usedTokens, maxTokenBudget));
 
 //#ifdef _DEBUG
@@ -568,6 +741,326 @@ namespace {
     return { orderedResults, usedTokens };
   }
 
+  enum class RouteClass { Critical, Interactive, Chat, Bulk };
+
+  // Admission of requests by route class. Health, metrics and shutdown (Critical) always pass.
+  // The other classes share the workers left after reservedWorkers. A request holds
+  // its share while it runs or waits for a slot of its class. Lower priority classes
+  // are refused at a lower share (shedAt), and a full class queue or a wait past
+  // maxQueueWaitMs is answered with 429. The admission belongs to the worker thread
+  // and ends when the response has been written.
+  class AdmissionControl {
+  public:
+    struct ClassStats {
+      std::string name;
+      size_t running = 0;
+      size_t waiting = 0;
+      size_t maxConcurrent = 0;
+      size_t maxQueue = 0;
+      size_t admitted = 0;
+      size_t queued = 0;
+      size_t shed = 0;
+      size_t timedOut = 0;
+      double avgWaitMs = 0; // of the requests that had to queue
+      double maxWaitMs = 0;
+      double avgServiceMs = 0;
+    };
+
+    AdmissionControl(const Settings &s, size_t workers)
+      : capacity_((std::max)(workers, s.serverReservedWorkers() + 1) - s.serverReservedWorkers())
+      , maxWait_(s.serverMaxQueueWaitMs())
+    {
+      const char *names[] = { "interactive", "chat", "bulk" };
+      for (size_t i = 0; i < classes_.size(); i ++) {
+        classes_[i].name = names[i];
+        classes_[i].cfg = s.serverAdmission(names[i]);
+      }
+    }
+
+    static RouteClass classify(const httplib::Request &req) {
+      const auto &p = req.path;
+      if (p == "/api/health" || p == "/api/metrics" || p == "/metrics" || p == "/api/instances" || p == "/api" || p == "/") {
+        return RouteClass::Critical;
+      }
+      if (req.method == "POST") {
+        if (p == "/api/shutdown") return RouteClass::Critical; // key-checked, must get through an overload
+        if (p == "/api/chat") return RouteClass::Chat;
+        if (p == "/api/update" || p == "/api/setup" || p == "/api/documents") return RouteClass::Bulk;
+      }
+      return RouteClass::Interactive;
+    }
+
+    // Admits the calling thread's request, queueing it while its class is at the limit.
+    // Returns false when the request is refused, with a hint when to retry.
+    bool admit(RouteClass rc, size_t &retryAfterS);
+    // Ends the calling thread's admission, if there is one.
+    static void finish();
+    // The calling thread's request stops counting against the worker share, e.g. a
+    // chat that got a stream thread of its own; its class slot is kept until finish.
+    static void detach();
+
+    std::vector<ClassStats> stats() const;
+    size_t capacity() const { return capacity_; }
+    size_t occupied() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return occupied_;
+    }
+
+  private:
+    struct Class {
+      std::string name;
+      AdmissionConfig cfg;
+      size_t running = 0;
+      std::deque<uint64_t> waiters;
+      size_t admitted = 0;
+      size_t queued = 0;
+      size_t shed = 0;
+      size_t timedOut = 0;
+      double avgWaitMs = 0;
+      double maxWaitMs = 0;
+      double avgServiceMs = 0;
+    };
+    struct Ticket {
+      AdmissionControl *owner = nullptr;
+      size_t cls = 0;
+      bool detached = false;
+      std::chrono::steady_clock::time_point start;
+    };
+    static thread_local Ticket ticket_;
+
+    // mutex_ held
+    size_t retryAfter(const Class &c) const {
+      size_t slots = c.cfg.maxConcurrent ? c.cfg.maxConcurrent : capacity_;
+      double s = (c.waiters.size() + 1) * (std::max)(c.avgServiceMs, 100.0) / 1000.0 / (std::max)(slots, size_t(1));
+      return std::clamp(static_cast<size_t>(std::ceil(s)), size_t(1), size_t(60));
+    }
+
+    const size_t capacity_;
+    const std::chrono::milliseconds maxWait_;
+    std::array<Class, 3> classes_;
+    size_t occupied_ = 0; // running and waiting requests, detached ones excepted
+    uint64_t sequence_ = 0;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+  };
+
+  thread_local AdmissionControl::Ticket AdmissionControl::ticket_;
+
+  bool AdmissionControl::admit(RouteClass rc, size_t &retryAfterS)
+  {
+    finish(); // left over from a request that ended without being logged
+    std::unique_lock<std::mutex> lock(mutex_);
+    const size_t idx = static_cast<size_t>(rc) - 1;
+    auto &c = classes_[idx];
+    const size_t limit = c.cfg.maxConcurrent ? c.cfg.maxConcurrent : capacity_;
+    const size_t threshold = (std::max)(static_cast<size_t>(capacity_ * c.cfg.shedAt), size_t(1));
+    if (occupied_ >= threshold || (limit <= c.running && c.cfg.maxQueue <= c.waiters.size())) {
+      c.shed ++;
+      retryAfterS = retryAfter(c);
+      return false;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    occupied_ ++;
+    if (c.waiters.empty() && c.running < limit) {
+      c.running ++;
+    } else {
+      // in line behind the earlier requests of the class
+      const uint64_t number = ++ sequence_;
+      c.waiters.push_back(number);
+      c.queued ++;
+      bool ready = cv_.wait_for(lock, maxWait_, [&c, number, limit] {
+        return c.waiters.front() == number && c.running < limit;
+        });
+      c.waiters.erase(std::find(c.waiters.begin(), c.waiters.end(), number));
+      double waitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - now).count();
+      c.avgWaitMs = c.avgWaitMs == 0 ? waitMs : c.avgWaitMs * 0.9 + waitMs * 0.1;
+      c.maxWaitMs = (std::max)(c.maxWaitMs, waitMs);
+      cv_.notify_all(); // the next in line may go as well
+      if (!ready) {
+        occupied_ --;
+        c.shed ++;
+        c.timedOut ++;
+        retryAfterS = retryAfter(c);
+        return false;
+      }
+      c.running ++;
+    }
+    c.admitted ++;
+    ticket_ = { this, idx, false, std::chrono::steady_clock::now() };
+    return true;
+  }
+
+  void AdmissionControl::finish()
+  {
+    auto *self = ticket_.owner;
+    if (!self) return;
+    {
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      auto &c = self->classes_[ticket_.cls];
+      c.running --;
+      if (!ticket_.detached) self->occupied_ --;
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ticket_.start).count();
+      c.avgServiceMs = c.avgServiceMs == 0 ? ms : c.avgServiceMs * 0.9 + ms * 0.1;
+    }
+    ticket_ = {};
+    self->cv_.notify_all();
+  }
+
+  void AdmissionControl::detach()
+  {
+    auto *self = ticket_.owner;
+    if (!self || ticket_.detached) return;
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    ticket_.detached = true;
+    self->occupied_ --;
+  }
+
+  std::vector<AdmissionControl::ClassStats> AdmissionControl::stats() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<ClassStats> v;
+    for (const auto &c : classes_) {
+      v.push_back({ c.name, c.running, c.waiters.size(), c.cfg.maxConcurrent, c.cfg.maxQueue,
+        c.admitted, c.queued, c.shed, c.timedOut, c.avgWaitMs, c.maxWaitMs, c.avgServiceMs });
+    }
+    return v;
+  }
+
+  // Connection workers of the server. A worker serving a chat stream is busy for the
+  // whole generation, so streams are counted against a budget of their own: when a
+  // worker starts one, another thread joins the pool and `workers` threads stay
+  // available for short requests. Threads are kept once started, at most
+  // workers + maxStreams of them.
+  class ServerTaskQueue : public httplib::TaskQueue {
+  public:
+    struct Stats {
+      size_t workers = 0;
+      size_t threads = 0;
+      size_t streams = 0;
+      size_t maxStreams = 0;
+      size_t peakStreams = 0;
+      size_t rejectedStreams = 0;
+      size_t queued = 0;
+    };
+
+    // Held while a response streams; releases the stream budget when destroyed.
+    class StreamSlot {
+    public:
+      explicit StreamSlot(ServerTaskQueue &q) : q_(q) {}
+      ~StreamSlot() { q_.endStream(); }
+    private:
+      ServerTaskQueue &q_;
+    };
+
+    ServerTaskQueue(size_t workers, size_t maxStreams)
+      : workers_((std::max)(workers, size_t(1)))
+      , maxStreams_(maxStreams)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t i = 0; i < workers_; i ++) {
+        spawn();
+      }
+    }
+    ~ServerTaskQueue() override {
+      shutdown();
+    }
+
+    bool enqueue(std::function<void()> fn) override {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) return false;
+        jobs_.push_back(std::move(fn));
+      }
+      cv_.notify_one();
+      return true;
+    }
+
+    void shutdown() override {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      cv_.notify_all();
+      // workers still finishing a request may not add threads any more, see spawn
+      while (true) {
+        std::thread t;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (threads_.empty()) break;
+          t = std::move(threads_.back());
+          threads_.pop_back();
+        }
+        if (t.joinable()) t.join();
+      }
+    }
+
+    // Called by the worker about to stream a response; null when maxStreams are running.
+    std::shared_ptr<StreamSlot> beginStream() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (streams_ >= maxStreams_) {
+        stats_.rejectedStreams ++;
+        return nullptr;
+      }
+      streams_ ++;
+      stats_.peakStreams = (std::max)(stats_.peakStreams, streams_);
+      if (threadCount_ - streams_ < workers_) {
+        spawn();
+      }
+      return std::make_shared<StreamSlot>(*this);
+    }
+
+    Stats stats() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto s = stats_;
+      s.workers = workers_;
+      s.threads = threadCount_;
+      s.streams = streams_;
+      s.maxStreams = maxStreams_;
+      s.queued = jobs_.size();
+      return s;
+    }
+
+  private:
+    void endStream() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      streams_ --;
+    }
+
+    // mutex_ held
+    void spawn() {
+      if (stopping_) return;
+      threadCount_ ++;
+      threads_.emplace_back([this] { run(); });
+    }
+
+    void run() {
+      while (true) {
+        std::function<void()> fn;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+          // accepted connections are still served on shutdown
+          if (jobs_.empty()) return;
+          fn = std::move(jobs_.front());
+          jobs_.pop_front();
+        }
+        fn();
+        AdmissionControl::finish(); // in case the connection broke off mid-response
+      }
+    }
+
+    const size_t workers_;
+    const size_t maxStreams_;
+    size_t threadCount_ = 0;
+    size_t streams_ = 0;
+    bool stopping_ = false;
+    Stats stats_;
+    std::deque<std::function<void()>> jobs_;
+    std::vector<std::thread> threads_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+  };
+
 } // anonymous namespace
 
 
@@ -581,6 +1074,15 @@ struct HttpServer::Impl {
 
   App &app_;
 
+  // opt-in, see database.result_cache_size
+  std::unique_ptr<SearchResultCache> resultCache_;
+  // conversations of /api/chat requests carrying a sessionid, see generation.session_cache_size
+  std::unique_ptr<ChatSessionStore> sessions_;
+  // created and owned by server_ while it listens
+  std::atomic<ServerTaskQueue *> taskQueue_{ nullptr };
+  // see server.admission
+  std::unique_ptr<AdmissionControl> admission_;
+
   static std::atomic<size_t> requestCounter_;
   static std::atomic<size_t> searchCounter_;
   static std::atomic<size_t> chatCounter_;
@@ -609,7 +1111,21 @@ std::atomic<double> HttpServer::Impl::avgEmbedTimeMs_{ 0.0 };
 HttpServer::HttpServer(App &a)
   : imp(new Impl(a))
 {
-  imp->server_.new_task_queue = [] { return new httplib::ThreadPool(4); };
+  const auto &ss = a.settings();
+  imp->server_.new_task_queue = [impl = imp.get(), workers = ss.serverWorkerThreads(), maxStreams = ss.serverMaxStreams()] {
+    auto *queue = new ServerTaskQueue(workers, maxStreams);
+    impl->taskQueue_ = queue;
+    return queue;
+  };
+  if (ss.databaseResultCacheSize() > 0) {
+    imp->resultCache_ = std::make_unique<SearchResultCache>(ss.databaseResultCacheSize(), ss.databaseResultCacheLshBits());
+  }
+  if (ss.serverAdmissionEnabled()) {
+    imp->admission_ = std::make_unique<AdmissionControl>(ss, ss.serverWorkerThreads());
+  }
+  if (ss.generationSessionCacheSize() > 0) {
+    imp->sessions_ = std::make_unique<ChatSessionStore>(ss.generationSessionCacheSize(), std::chrono::seconds(ss.generationSessionTtlS()));
+  }
 
   imp->server_.set_error_logger([](const httplib::Error &err, const httplib::Request *req) {
     std::cerr << httplib::to_string(err) << " while processing request";
@@ -651,6 +1167,28 @@ bool HttpServer::startServer()
 
   server.set_mount_point("/setup", "./public/setup/");
 
+  server.set_pre_routing_handler([this](const httplib::Request &req, httplib::Response &res) {
+    auto rc = AdmissionControl::classify(req);
+    if (!imp->admission_ || rc == RouteClass::Critical) {
+      return httplib::Server::HandlerResponse::Unhandled;
+    }
+    size_t retryAfterS = 0;
+    if (imp->admission_->admit(rc, retryAfterS)) {
+      return httplib::Server::HandlerResponse::Unhandled;
+    }
+    json error = { {"error", "Server busy, try again later"} };
+    res.status = 429;
+    res.set_header("Retry-After", std::to_string(retryAfterS));
+    res.set_content(error.dump(), "application/json");
+    Impl::errorCounter_++;
+    Impl::requestCounter_++;
+    return httplib::Server::HandlerResponse::Handled;
+    });
+  // called once the response is written
+  server.set_logger([](const httplib::Request &, const httplib::Response &) {
+    AdmissionControl::finish();
+    });
+
   server.Get("/", [this](const httplib::Request &, httplib::Response &res) {
     LOG_MSG << "GET /";
     if (!std::filesystem::exists(imp->app_.settings().configPath())) {
@@ -704,6 +1242,7 @@ bool HttpServer::startServer()
       auto &settings = imp->app_.refSettings();
       settings.updateFromConfig(config);
       settings.save();
+      EmbeddingClient::configureEndpoints(settings.embeddingApis(), settings.databaseVectorDim());
       json response = {
           {"status", "success"},
           {"message", "Configuration generated successfully"}
@@ -745,10 +1284,24 @@ bool HttpServer::startServer()
       json request = json::parse(req.body);
       std::string query = request["query"].get<std::string>();
       size_t top_k = request.value("top_k", 5);
+      std::string sourceFilter = request.value("source_filter", "");
+      std::string typeFilter = request.value("type_filter", "");
       std::vector<float> queryEmbedding;
       EmbeddingClient embeddingClient(imp->app_.settings().embeddingCurrentApi(), imp->app_.settings().embeddingTimeoutMs());
       embeddingClient.generateEmbeddings(query, queryEmbedding, EmbeddingClient::EncodeType::Query);
-      auto results = imp->app_.db().search(queryEmbedding, top_k);
+
+      const auto &db = imp->app_.db();
+      // read before searching, a concurrent update then makes the stored entry stale rather than wrong
+      uint64_t generation = db.generation();
+      std::string filter = sourceFilter + '\n' + typeFilter;
+      auto *cache = imp->resultCache_.get();
+      std::vector<SearchResult> results;
+      if (!cache || !cache->lookup(queryEmbedding, top_k, filter, generation, results)) {
+        results = sourceFilter.empty() && typeFilter.empty()
+          ? db.search(queryEmbedding, top_k)
+          : db.searchWithFilter(queryEmbedding, sourceFilter, typeFilter, top_k);
+        if (cache) cache->store(queryEmbedding, top_k, filter, generation, results);
+      }
       json response = json::array();
       for (const auto &result : results) {
         response.push_back({
@@ -756,6 +1309,7 @@ bool HttpServer::startServer()
             {"source_id", result.sourceId},
             {"chunk_type", result.chunkType},
             {"chunk_unit", result.chunkUnit},
+            {"symbol", result.symbol},
             {"similarity_score", result.similarityScore},
             {"start_pos", result.start},
             {"end_pos", result.end}
@@ -783,22 +1337,15 @@ bool HttpServer::startServer()
       auto chunks = imp->app_.chunker().chunkText(text, "api-request");
       std::vector<std::string> texts;
       for (const auto &c : chunks) {
-        texts.push_back(c.text);
+        texts.push_back(c.str());
       }
       json response = json::array();
       const auto &ss = imp->app_.settings();
-      const auto batchSize = ss.embeddingBatchSize();
       EmbeddingClient embeddingClient(ss.embeddingCurrentApi(), ss.embeddingTimeoutMs());
-      for (size_t i = 0; i < chunks.size(); i += batchSize) {
-        size_t end = (std::min)(i + batchSize, chunks.size());
-        std::vector<std::string> batchTexts(texts.begin() + i, texts.begin() + end);
-
-        std::vector<std::vector<float>> embeddings;
-        embeddingClient.generateEmbeddings(batchTexts, embeddings, EmbeddingClient::EncodeType::Query);
-
-        for (const auto &emb : embeddings) {
-          response.push_back({ {"embedding", emb}, {"dimension", emb.size()} });
-        }
+      std::vector<std::vector<float>> embeddings;
+      embeddingClient.generateEmbeddings(texts, embeddings, EmbeddingClient::EncodeType::Query);
+      for (const auto &emb : embeddings) {
+        response.push_back({ {"embedding", emb}, {"dimension", emb.size()} });
       }
       res.set_content(response.dump(), "application/json");
     } catch (const std::exception &e) {
@@ -826,12 +1373,13 @@ bool HttpServer::startServer()
       size_t inserted = 0;
       for (const auto &chunk : chunks) {
         std::vector<float> embedding;
-        embeddingClient.generateEmbeddings(chunk.text, embedding, EmbeddingClient::EncodeType::Document);
+        embeddingClient.generateEmbeddings(chunk.str(), embedding, EmbeddingClient::EncodeType::Document);
         imp->app_.db().addDocument(chunk, embedding);
         inserted++;
       }
 
       imp->app_.db().persist();
+      if (inserted) imp->app_.documentAdded(source_id);
 
       json response = {
           {"status", "success"},
@@ -926,7 +1474,9 @@ bool HttpServer::startServer()
         "max_tokens": 800,
         "targetapi": "xai",
         "ctxratio": 0.5,
-        "attachedonly": false
+        "attachedonly": false,
+        "sessionid": "3f2a...", // optional, follow-ups reuse the retrieval of earlier turns
+        "passthrough": false // relay the provider's stream events unchanged
       }
       */
       json request = json::parse(req.body);
@@ -976,6 +1526,35 @@ bool HttpServer::startServer()
       const size_t maxTokens = request.value("max_tokens", imp->app_.settings().generationDefaultMaxTokens());
       const float contextSizeRatio = request.value("ctxratio", 0.9f);
       const bool attachedOnly = request.value("attachedonly", false);
+      const bool passthrough = request.value("passthrough", false) && apiConfig.stream;
+
+      std::shared_ptr<ChatSession> session;
+      const std::string sessionId = request.value("sessionid", "");
+      if (!sessionId.empty() && imp->sessions_) {
+        // a conversation without earlier answers starts over
+        bool firstTurn = std::none_of(messagesJson.begin(), messagesJson.end(), [](const json &m) {
+          return m.value("role", "") == "assistant";
+          });
+        if (firstTurn) imp->sessions_->remove(sessionId);
+        session = imp->sessions_->acquire(sessionId);
+      }
+
+      // the stream keeps this worker busy until the answer is complete
+      std::shared_ptr<ServerTaskQueue::StreamSlot> streamSlot;
+      if (auto *queue = imp->taskQueue_.load()) {
+        streamSlot = queue->beginStream();
+        if (streamSlot) {
+          AdmissionControl::detach();
+        } else {
+          json error = { {"error", "Too many chat streams in progress, try again later"} };
+          res.status = 503;
+          res.set_header("Retry-After", "5");
+          res.set_content(error.dump(), "application/json");
+          Impl::errorCounter_++;
+          Impl::requestCounter_++;
+          return;
+        }
+      }
 
       res.set_header("Content-Type", "text/event-stream");
       res.set_header("Cache-Control", "no-cache");
@@ -983,13 +1562,25 @@ bool HttpServer::startServer()
 
       res.set_chunked_content_provider(
         "text/event-stream",
-        [this, messagesJson, question, temperature, contextSizeRatio, attachedOnly, attachments, sources, maxTokens, apiConfig]
+        [this, messagesJson, question, temperature, contextSizeRatio, attachedOnly, attachments, sources, maxTokens, apiConfig, session, passthrough, streamSlot]
         (size_t offset, httplib::DataSink &sink) {
 
-          auto packPayload = [](std::string data) {
+          auto packPayload = [passthrough](std::string_view data) {
+            std::string s;
+            if (passthrough) {
+              // the provider's events go out unchanged, ours as comments that clients skip
+              s.reserve(data.size() + 4);
+              s += ": ";
+              for (char c : data) s += (c == '\n' || c == '\r') ? ' ' : c;
+              s += "\n\n";
+              return s;
+            }
             // SSE format requires "data: <payload>\n\n"
-            nlohmann::json payload = { {"content", std::move(data)} };
-            return "data: " + payload.dump() + "\n\n";
+            s.reserve(data.size() + 24);
+            s += "data: {\"content\":";
+            sse::appendJsonString(s, data);
+            s += "}\n\n";
+            return s;
             };
 
           auto initialInfo = packPayload("[meta]Searching for relevant content");
@@ -1001,12 +1592,23 @@ bool HttpServer::startServer()
               sink.write(s.data(), s.size());
             };
 
+          // the connection to the LLM is set up while the context is assembled
+          CompletionClient completionClient(apiConfig, imp->app_.settings().generationTimeoutMs(), imp->app_);
+          completionClient.prewarm();
+
+          std::unique_lock<std::mutex> sessionLock;
+          if (session) {
+            sessionLock = std::unique_lock<std::mutex>(session->mutex);
+          }
           const auto [orderedResults, usedTokens] = processInputResults(imp->app_, apiConfig, question, attachments, sources, 
-            contextSizeRatio, attachedOnly, onInfo
+            contextSizeRatio, attachedOnly, onInfo, session.get(), imp->sessions_.get()
           );
+          if (sessionLock.owns_lock()) {
+            sessionLock.unlock();
+          }
 
-          CompletionClient completionClient(apiConfig, imp->app_.settings().generationTimeoutMs(), imp->app_);
           try {
+            CompletionClient::Usage usage;
             const std::string fullResponse = completionClient.generateCompletion(
               messagesJson, orderedResults, temperature, maxTokens,
               [&sink, packPayload](const std::string &chunk) {
@@ -1018,7 +1620,11 @@ bool HttpServer::startServer()
                 if (!success) {
                   return; // Client disconnected
                 }
-              });
+              }, &usage,
+              passthrough ? CompletionClient::RawEventFn([&sink](std::string_view event) {
+                sink.write(event.data(), event.size());
+                sink.write("\n\n", 2);
+              }) : CompletionClient::RawEventFn{});
 
 #ifdef _DEBUG2
             testStreaming([&sink](const std::string &chunk) {
@@ -1030,7 +1636,14 @@ bool HttpServer::startServer()
             size_t resTokens = imp->app_.tokenizer().countTokensWithVocab(fullResponse);
             onInfo(fmt::format("Response token count {}", resTokens));
 
+            // real counts when the server reports them, the local estimate otherwise
             auto costReq = apiConfig.inputTokensPrice(usedTokens);
+            if (usage.reported && usage.promptTokens) {
+              resTokens = usage.completionTokens ? usage.completionTokens : resTokens;
+              double hitRatio = static_cast<double>((std::min)(usage.cachedTokens, usage.promptTokens)) / usage.promptTokens;
+              costReq = apiConfig.inputTokensPrice(usage.promptTokens, hitRatio);
+              onInfo(fmt::format("Prompt tokens {} ({} cached)", usage.promptTokens, usage.cachedTokens));
+            }
             auto costRes = apiConfig.outputTokensPrice(resTokens);
             auto costTotal = costReq + costRes;
             if (costTotal == 0)
@@ -1052,12 +1665,14 @@ bool HttpServer::startServer()
               {"sources", sourcesJson},
               {"type", "context_sources"}
             };
-            std::string sourcesSse = "data: " + sourcesPayload.dump() + "\n\n";
+            std::string sourcesSse = (passthrough ? ": " : "data: ") + sourcesPayload.dump() + "\n\n";
             sink.write(sourcesSse.data(), sourcesSse.size());
 
-
-            std::string done = "data: [DONE]\n\n";
-            sink.write(done.data(), done.size());
+            // a relayed stream already carries the provider's end marker
+            if (!passthrough) {
+              std::string done = "data: [DONE]\n\n";
+              sink.write(done.data(), done.size());
+            }
             sink.done();
           } catch (const std::exception &e) {
             std::string error = "data: {\"error\": \"" + std::string(e.what()) + "\"}\n\n";
@@ -1190,6 +1805,131 @@ bool HttpServer::startServer()
             {"sources_indexed", stats.sources.size()}
         }}
     };
+    {
+      auto ps = InferenceClient::poolStats();
+      metrics["connections"] = {
+          {"created", ps.created},
+          {"reused", ps.reused},
+          {"expired", ps.expired},
+          {"discarded", ps.discarded},
+          {"idle", ps.idle}
+      };
+    }
+    metrics["embedding_endpoints"] = json::array();
+    for (const auto &es : EmbeddingClient::endpointStats()) {
+      metrics["embedding_endpoints"].push_back({
+          {"api_url", es.apiUrl},
+          {"requests", es.requests},
+          {"errors", es.errors},
+          {"in_flight", es.inFlight},
+          {"concurrency_limit", es.limit},
+          {"ms_per_token", es.msPerToken},
+          {"ejected", es.ejected},
+          {"query_latency_p50_ms", es.p50Ms},
+          {"query_latency_p95_ms", es.p95Ms},
+          {"hedges", es.hedges},
+          {"hedge_wins", es.hedgeWins}
+      });
+    }
+    if (auto *admission = imp->admission_.get()) {
+      json classes = json::object();
+      for (const auto &c : admission->stats()) {
+        classes[c.name] = {
+          {"running", c.running},
+          {"waiting", c.waiting},
+          {"max_concurrent", c.maxConcurrent},
+          {"max_queue", c.maxQueue},
+          {"admitted", c.admitted},
+          {"queued", c.queued},
+          {"shed", c.shed},
+          {"timed_out", c.timedOut},
+          {"avg_queue_wait_ms", c.avgWaitMs},
+          {"max_queue_wait_ms", c.maxWaitMs},
+          {"avg_service_ms", c.avgServiceMs}
+        };
+      }
+      metrics["admission"] = {
+          {"capacity", admission->capacity()},
+          {"occupied", admission->occupied()},
+          {"classes", classes}
+      };
+    }
+    if (auto *queue = imp->taskQueue_.load()) {
+      auto qs = queue->stats();
+      metrics["server_workers"] = {
+          {"workers", qs.workers},
+          {"threads", qs.threads},
+          {"queued_connections", qs.queued},
+          {"streams", qs.streams},
+          {"max_streams", qs.maxStreams},
+          {"peak_streams", qs.peakStreams},
+          {"rejected_streams", qs.rejectedStreams}
+      };
+    }
+    if (auto *sessions = imp->sessions_.get()) {
+      auto ss = sessions->stats();
+      metrics["chat_sessions"] = {
+          {"hits", ss.hits},
+          {"created", ss.created},
+          {"expired", ss.expired},
+          {"evictions", ss.evictions},
+          {"entries", ss.entries},
+          {"max_entries", ss.maxEntries},
+          {"reused_query_parts", ss.reusedQueries},
+          {"reused_contexts", ss.reusedContexts}
+      };
+    }
+    if (auto *cache = imp->app_.sourceCache()) {
+      auto cs = cache->stats();
+      metrics["source_cache"] = {
+          {"hits", cs.hits},
+          {"misses", cs.misses},
+          {"invalidations", cs.invalidations},
+          {"evictions", cs.evictions},
+          {"entries", cs.entries},
+          {"bytes", cs.bytes},
+          {"max_bytes", cs.maxBytes}
+      };
+    }
+    if (auto *cache = EmbeddingClient::cache()) {
+      auto cs = cache->stats();
+      size_t lookups = cs.hits + cs.misses;
+      metrics["embedding_cache"] = {
+          {"hits", cs.hits},
+          {"misses", cs.misses},
+          {"hit_rate", lookups ? double(cs.hits) / lookups : 0.0},
+          {"stores", cs.stores},
+          {"evictions", cs.evictions},
+          {"entries", cs.entries},
+          {"max_entries", cs.maxEntries}
+      };
+    }
+    if (auto *cache = imp->resultCache_.get()) {
+      auto rs = cache->stats();
+      size_t lookups = rs.hits + rs.misses;
+      metrics["result_cache"] = {
+          {"hits", rs.hits},
+          {"misses", rs.misses},
+          {"hit_rate", lookups ? double(rs.hits) / lookups : 0.0},
+          {"invalidations", rs.invalidations},
+          {"evictions", rs.evictions},
+          {"entries", rs.entries},
+          {"max_entries", rs.maxEntries}
+      };
+    }
+    if (auto *cache = EmbeddingClient::queryCache()) {
+      auto qs = cache->stats();
+      size_t lookups = qs.hits + qs.misses;
+      metrics["query_cache"] = {
+          {"hits", qs.hits},
+          {"misses", qs.misses},
+          {"hit_rate", lookups ? double(qs.hits) / lookups : 0.0},
+          {"expired", qs.expired},
+          {"evictions", qs.evictions},
+          {"entries", qs.entries},
+          {"max_entries", qs.maxEntries}
+      };
+    }
     res.set_content(metrics.dump(2), "application/json");
     Impl::requestCounter_++;
     });
@@ -1251,6 +1991,119 @@ bool HttpServer::startServer()
       prometheus << "# Database metrics unavailable: " << e.what() << "\n\n";
     }
 
+    // Connection pool metrics
+    {
+      auto ps = InferenceClient::poolStats();
+      prometheus << "# HELP embedder_connections_created_total Connections opened to inference servers\n";
+      prometheus << "# TYPE embedder_connections_created_total counter\n";
+      prometheus << "embedder_connections_created_total " << ps.created << "\n\n";
+
+      prometheus << "# HELP embedder_connections_reused_total Requests served on a pooled connection\n";
+      prometheus << "# TYPE embedder_connections_reused_total counter\n";
+      prometheus << "embedder_connections_reused_total " << ps.reused << "\n\n";
+
+      prometheus << "# HELP embedder_connections_idle Idle pooled connections\n";
+      prometheus << "# TYPE embedder_connections_idle gauge\n";
+      prometheus << "embedder_connections_idle " << ps.idle << "\n\n";
+    }
+
+    // Embedding endpoint metrics
+    {
+      auto endpoints = EmbeddingClient::endpointStats();
+      prometheus << "# HELP embedder_embedding_query_latency_p95_ms Query embedding p95 latency per endpoint\n";
+      prometheus << "# TYPE embedder_embedding_query_latency_p95_ms gauge\n";
+      for (const auto &es : endpoints) {
+        prometheus << "embedder_embedding_query_latency_p95_ms{endpoint=\"" << es.apiUrl << "\"} " << es.p95Ms << "\n";
+      }
+      prometheus << "\n";
+
+      prometheus << "# HELP embedder_embedding_hedges_total Hedged query embedding requests per endpoint\n";
+      prometheus << "# TYPE embedder_embedding_hedges_total counter\n";
+      for (const auto &es : endpoints) {
+        prometheus << "embedder_embedding_hedges_total{endpoint=\"" << es.apiUrl << "\"} " << es.hedges << "\n";
+      }
+      prometheus << "\n";
+
+      prometheus << "# HELP embedder_embedding_hedge_wins_total Hedged requests that answered first\n";
+      prometheus << "# TYPE embedder_embedding_hedge_wins_total counter\n";
+      for (const auto &es : endpoints) {
+        prometheus << "embedder_embedding_hedge_wins_total{endpoint=\"" << es.apiUrl << "\"} " << es.hedgeWins << "\n";
+      }
+      prometheus << "\n";
+    }
+
+    if (auto *admission = imp->admission_.get()) {
+      auto classes = admission->stats();
+      prometheus << "# HELP embedder_admission_shed_total Requests refused with 429 per route class\n";
+      prometheus << "# TYPE embedder_admission_shed_total counter\n";
+      for (const auto &c : classes) {
+        prometheus << "embedder_admission_shed_total{class=\"" << c.name << "\"} " << c.shed << "\n";
+      }
+      prometheus << "\n";
+
+      prometheus << "# HELP embedder_admission_queue_wait_ms Average queue wait of requests that had to wait\n";
+      prometheus << "# TYPE embedder_admission_queue_wait_ms gauge\n";
+      for (const auto &c : classes) {
+        prometheus << "embedder_admission_queue_wait_ms{class=\"" << c.name << "\"} " << c.avgWaitMs << "\n";
+      }
+      prometheus << "\n";
+
+      prometheus << "# HELP embedder_admission_queue_depth Requests waiting for a slot\n";
+      prometheus << "# TYPE embedder_admission_queue_depth gauge\n";
+      for (const auto &c : classes) {
+        prometheus << "embedder_admission_queue_depth{class=\"" << c.name << "\"} " << c.waiting << "\n";
+      }
+      prometheus << "\n";
+    }
+
+    // Embedding cache metrics
+    if (auto *cache = EmbeddingClient::cache()) {
+      auto cs = cache->stats();
+      prometheus << "# HELP embedder_embedding_cache_hits_total Embeddings served from the cache\n";
+      prometheus << "# TYPE embedder_embedding_cache_hits_total counter\n";
+      prometheus << "embedder_embedding_cache_hits_total " << cs.hits << "\n\n";
+
+      prometheus << "# HELP embedder_embedding_cache_misses_total Embeddings requested from the server\n";
+      prometheus << "# TYPE embedder_embedding_cache_misses_total counter\n";
+      prometheus << "embedder_embedding_cache_misses_total " << cs.misses << "\n\n";
+
+      prometheus << "# HELP embedder_embedding_cache_evictions_total Cache entries evicted by the size cap\n";
+      prometheus << "# TYPE embedder_embedding_cache_evictions_total counter\n";
+      prometheus << "embedder_embedding_cache_evictions_total " << cs.evictions << "\n\n";
+
+      prometheus << "# HELP embedder_embedding_cache_entries Entries in the embedding cache\n";
+      prometheus << "# TYPE embedder_embedding_cache_entries gauge\n";
+      prometheus << "embedder_embedding_cache_entries " << cs.entries << "\n\n";
+    }
+    if (auto *cache = EmbeddingClient::queryCache()) {
+      auto qs = cache->stats();
+      prometheus << "# HELP embedder_query_cache_hits_total Query embeddings served from memory\n";
+      prometheus << "# TYPE embedder_query_cache_hits_total counter\n";
+      prometheus << "embedder_query_cache_hits_total " << qs.hits << "\n\n";
+
+      prometheus << "# HELP embedder_query_cache_misses_total Query embeddings not found in memory\n";
+      prometheus << "# TYPE embedder_query_cache_misses_total counter\n";
+      prometheus << "embedder_query_cache_misses_total " << qs.misses << "\n\n";
+
+      prometheus << "# HELP embedder_query_cache_entries Entries in the query embedding cache\n";
+      prometheus << "# TYPE embedder_query_cache_entries gauge\n";
+      prometheus << "embedder_query_cache_entries " << qs.entries << "\n\n";
+    }
+    if (auto *cache = imp->resultCache_.get()) {
+      auto rs = cache->stats();
+      prometheus << "# HELP embedder_result_cache_hits_total Searches answered from the result cache\n";
+      prometheus << "# TYPE embedder_result_cache_hits_total counter\n";
+      prometheus << "embedder_result_cache_hits_total " << rs.hits << "\n\n";
+
+      prometheus << "# HELP embedder_result_cache_misses_total Searches that ran against the index\n";
+      prometheus << "# TYPE embedder_result_cache_misses_total counter\n";
+      prometheus << "embedder_result_cache_misses_total " << rs.misses << "\n\n";
+
+      prometheus << "# HELP embedder_result_cache_invalidations_total Result cache flushes caused by database updates\n";
+      prometheus << "# TYPE embedder_result_cache_invalidations_total counter\n";
+      prometheus << "embedder_result_cache_invalidations_total " << rs.invalidations << "\n\n";
+    }
+
     res.set_content(prometheus.str(), "text/plain");
     Impl::requestCounter_++;
     });
@@ -1294,14 +2147,16 @@ bool HttpServer::startServer()
   LOG_MSG << "  GET  /api/settings";
   LOG_MSG << "  GET  /api/documents";
   LOG_MSG << "  POST /api/setup     - {\"...\"}";
-  LOG_MSG << "  POST /api/search    - {\"query\": \"...\", \"top_k\": 5}";
+  LOG_MSG << "  POST /api/search    - {\"query\": \"...\", \"top_k\": 5, \"source_filter\": \"\", \"type_filter\": \"\"}";
   LOG_MSG << "  POST /api/embed     - {\"text\": \"...\"}";
   LOG_MSG << "  POST /api/documents - {\"content\": \"...\", \"source_id\": \"...\"}";
   LOG_MSG << "  POST /api/chat      - {\"messages\":[\"role\":\"...\", \"content\":\"...\"], \"temperature\": \"...\"}";
   LOG_MSG << "  POST /api/update    - Trigger manual update of sources";
   LOG_MSG << "  POST /api/shutdown  - Initiate server shutdown (expects X-App-Key header for the key)";
   LOG_MSG << "\nPress Ctrl+C to stop";
-  return server.listen_after_bind();
+  bool ok = server.listen_after_bind();
+  imp->taskQueue_ = nullptr;
+  return ok;
 }
 
 void HttpServer::stop()
@@ -3,14 +3,673 @@
 #include "database.h"
 #include "settings.h"
 #include "tokenizer.h"
+#include "embcache.h"
+#include "ctxpacker.h"
+#include "sse.h"
 #include <stdexcept>
 #include <cassert>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <charconv>
+#include <string_view>
 //#include <format>
 #include <filesystem>
 #include <cmath>  // for std::sqrt
 #include <httplib.h>
 #include <utils_log/logger.hpp>
 #include "3rdparty/fmt/core.h"
+#include "3rdparty/base64.h"
+
+
+namespace {
+
+  // Keeps idle keep-alive clients per scheme://host:port so that the short-lived
+  // Embedding/CompletionClient objects do not pay connection (and TLS) setup on
+  // every request. A client is handed out exclusively and comes back only if its
+  // last request completed at transport level.
+  class ConnectionPool {
+  public:
+    static ConnectionPool &instance() {
+      static ConnectionPool pool;
+      return pool;
+    }
+
+    void configure(size_t maxIdlePerHost, std::chrono::milliseconds idleTimeout) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      maxIdlePerHost_ = maxIdlePerHost;
+      idleTimeout_ = idleTimeout;
+      for (auto &[host, idle] : idle_) {
+        trim(idle);
+      }
+    }
+
+    std::unique_ptr<httplib::Client> acquire(const std::string &host) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &idle = idle_[host];
+        auto now = std::chrono::steady_clock::now();
+        while (!idle.empty()) {
+          // most recently used first, it is the most likely to still be open
+          Idle entry = std::move(idle.back());
+          idle.pop_back();
+          if (now - entry.since <= idleTimeout_) {
+            stats_.reused ++;
+            return std::move(entry.client);
+          }
+          stats_.expired ++;
+        }
+        stats_.created ++;
+      }
+      auto client = std::make_unique<httplib::Client>(host);
+      client->set_keep_alive(true);
+      return client;
+    }
+
+    void release(const std::string &host, std::unique_ptr<httplib::Client> client, bool healthy) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!healthy || !client->is_valid()) {
+        stats_.discarded ++;
+        return;
+      }
+      auto &idle = idle_[host];
+      idle.push_back({ std::move(client), std::chrono::steady_clock::now() });
+      trim(idle);
+    }
+
+    bool hasIdle(const std::string &host) const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = idle_.find(host);
+      if (it == idle_.end()) return false;
+      auto now = std::chrono::steady_clock::now();
+      return std::any_of(it->second.begin(), it->second.end(), [&](const Idle &e) { return now - e.since <= idleTimeout_; });
+    }
+
+    InferenceClient::PoolStats stats() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto s = stats_;
+      s.idle = 0;
+      for (const auto &[host, idle] : idle_) s.idle += idle.size();
+      return s;
+    }
+
+  private:
+    struct Idle {
+      std::unique_ptr<httplib::Client> client;
+      std::chrono::steady_clock::time_point since;
+    };
+
+    void trim(std::vector<Idle> &idle) {
+      if (idle.size() > maxIdlePerHost_) {
+        size_t excess = idle.size() - maxIdlePerHost_;
+        idle.erase(idle.begin(), idle.begin() + excess);
+        stats_.discarded += excess;
+      }
+    }
+
+    size_t maxIdlePerHost_ = 8;
+    std::chrono::milliseconds idleTimeout_{ 5000 };
+    std::unordered_map<std::string, std::vector<Idle>> idle_;
+    InferenceClient::PoolStats stats_;
+    mutable std::mutex mutex_;
+  };
+
+  // Exclusive use of a pooled client for the duration of one request
+  class PooledClient {
+  public:
+    PooledClient(const std::string &host, size_t timeoutMs)
+      : host_(host)
+      , client_(ConnectionPool::instance().acquire(host))
+    {
+      client_->set_connection_timeout(0, timeoutMs * 1000);
+      client_->set_read_timeout(timeoutMs / 1000, (timeoutMs % 1000) * 1000);
+    }
+    ~PooledClient() {
+      ConnectionPool::instance().release(host_, std::move(client_), healthy_);
+    }
+    PooledClient(const PooledClient &) = delete;
+    PooledClient &operator=(const PooledClient &) = delete;
+
+    httplib::Client *operator->() { return client_.get(); }
+    // a failed or cancelled request leaves the connection in an unknown state
+    httplib::Result track(httplib::Result res) {
+      healthy_ = static_cast<bool>(res);
+      return res;
+    }
+
+  private:
+    std::string host_;
+    std::unique_ptr<httplib::Client> client_;
+    bool healthy_ = false;
+  };
+
+  // 429, 5xx or no response at all: retry later with less load
+  struct ServerBusy : std::runtime_error {
+    size_t retryAfterMs;
+    bool unreachable;
+    ServerBusy(const std::string &msg, size_t retryAfter, bool noResponse = false)
+      : std::runtime_error(msg), retryAfterMs(retryAfter), unreachable(noResponse) {}
+  };
+
+  // the vectors do not match the database, another endpoint may still serve the batch
+  struct WrongDimension : std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  struct BatchingConfig {
+    size_t maxConcurrency = 4;
+    size_t batchTokens = 2048;
+    size_t maxBatchItems = 16;
+    size_t retryAttempts = 3;
+    size_t maxRetryAfterMs = 30'000;
+    bool hedge = false;
+    size_t hedgeDelayMs = 200;
+  };
+
+  std::mutex _batchingMutex;
+  BatchingConfig _batching;
+
+  // Embedding endpoints that may share the work of the current one, see configureEndpoints()
+  std::vector<ApiConfig> _endpointApis;
+  size_t _endpointDim = 0;
+
+  void splitUrl(const std::string &url, std::string &schemaHostPort, std::string &path) {
+    size_t protocolEnd = url.find("://");
+    if (protocolEnd == std::string::npos) {
+      throw std::runtime_error("Invalid server URL format");
+    }
+    size_t pathStart = url.find("/", protocolEnd + 3);
+    schemaHostPort = url.substr(0, pathStart);
+    path = pathStart == std::string::npos ? "/" : url.substr(pathStart);
+  }
+
+  // Log-scale latency histogram with four buckets per doubling, from 1 ms to a
+  // bit over a minute. Counts are halved every 1024 samples so the quantiles
+  // follow what the endpoint does now rather than since startup.
+  class LatencyHistogram {
+  public:
+    void add(double ms) {
+      size_t i = ms <= 1 ? 0 : static_cast<size_t>(std::ceil(4 * std::log2(ms))) - 1;
+      counts_[(std::min)(i, counts_.size() - 1)] ++;
+      if (++total_ < 1024) return;
+      total_ = 0;
+      for (auto &c : counts_) {
+        c /= 2;
+        total_ += c;
+      }
+    }
+    size_t samples() const { return total_; }
+    // upper bound of the bucket holding quantile q
+    double quantile(double q) const {
+      if (total_ == 0) return 0;
+      double target = q * total_;
+      size_t sum = 0;
+      for (size_t i = 0; i < counts_.size(); i ++) {
+        sum += counts_[i];
+        if (sum >= target) return std::pow(2.0, (i + 1) / 4.0);
+      }
+      return std::pow(2.0, counts_.size() / 4.0);
+    }
+  private:
+    std::array<size_t, 64> counts_{};
+    size_t total_ = 0;
+  };
+
+  // Load and health of every embedding endpoint, shared by all clients so that
+  // what was learnt outlives the short-lived EmbeddingClient objects.
+  //
+  // Each endpoint has an AIMD limit on the requests in flight: it grows by one
+  // per window of successful requests and halves on overload or a latency spike,
+  // so it settles around the number of parallel slots the server really has.
+  // A request goes to the endpoint with a free slot and the lowest expected
+  // latency. Unreachable endpoints, and those failing three times in a row, are
+  // ejected for a cooldown that doubles with every ejection; the first request
+  // after the cooldown probes them again.
+  class EndpointBalancer {
+  public:
+    enum class Outcome { Success, Overloaded, Unreachable, Failed, Incompatible };
+
+    static EndpointBalancer &instance() {
+      static EndpointBalancer balancer;
+      return balancer;
+    }
+
+    // Blocks until one of the endpoints can take a request, returns its position
+    size_t acquire(const std::vector<ApiConfig> &endpoints, size_t maxConcurrency) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+        size_t best = pick(endpoints, maxConcurrency, endpoints.size());
+        if (best < endpoints.size()) return best;
+        cv_.wait_for(lock, std::chrono::milliseconds(100));
+      }
+    }
+
+    // Like acquire() but skips endpoint `exclude` and never waits, returns endpoints.size() when all are busy
+    size_t tryAcquire(const std::vector<ApiConfig> &endpoints, size_t maxConcurrency, size_t exclude) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return pick(endpoints, maxConcurrency, exclude);
+    }
+
+    void release(const ApiConfig &ep, Outcome outcome, double msPerToken, size_t maxConcurrency) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &st = states_[ep.apiUrl];
+      st.inFlight --;
+      auto now = std::chrono::steady_clock::now();
+      switch (outcome) {
+      case Outcome::Success: {
+        bool spike = st.samples >= 4 && msPerToken > 3.0 * st.msPerToken;
+        st.limit = spike ? (std::max)(1.0, st.limit / 2) : (std::min)(double(maxConcurrency), st.limit + 1.0 / st.limit);
+        st.msPerToken = st.samples == 0 ? msPerToken : 0.8 * st.msPerToken + 0.2 * msPerToken;
+        st.samples ++;
+        st.failures = 0;
+        st.ejections = 0;
+        break;
+      }
+      case Outcome::Overloaded:
+        st.limit = (std::max)(1.0, st.limit / 2);
+        if (++st.failures >= 3) eject(ep, st, now);
+        break;
+      case Outcome::Unreachable:
+        st.limit = 1.0;
+        st.failures ++;
+        eject(ep, st, now);
+        break;
+      case Outcome::Failed:
+        if (++st.failures >= 3) eject(ep, st, now);
+        break;
+      case Outcome::Incompatible:
+        st.failures ++;
+        st.ejectedUntil = now + std::chrono::minutes(10);
+        LOG_MSG << "Embedding endpoint" << ep.apiUrl << "returns vectors of the wrong dimension, ejected";
+        break;
+      }
+      if (outcome != Outcome::Success) st.errors ++;
+      cv_.notify_all();
+    }
+
+    void recordLatency(const ApiConfig &ep, double ms) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      states_[ep.apiUrl].latency.add(ms);
+    }
+
+    // p95 of the endpoint once enough requests were timed
+    std::chrono::milliseconds hedgeDelay(const ApiConfig &ep, size_t fallbackMs) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const auto &latency = states_[ep.apiUrl].latency;
+      double ms = latency.samples() >= 20 ? latency.quantile(0.95) : double(fallbackMs);
+      return std::chrono::milliseconds(static_cast<int64_t>(std::ceil(ms)));
+    }
+
+    void countHedge(const ApiConfig &ep, bool won) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &st = states_[ep.apiUrl];
+      st.hedges ++;
+      if (won) st.hedgeWins ++;
+    }
+
+    std::vector<EmbeddingClient::EndpointStats> stats() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::vector<EmbeddingClient::EndpointStats> res;
+      auto now = std::chrono::steady_clock::now();
+      for (const auto &[url, st] : states_) {
+        res.push_back({ url, st.requests, st.errors, st.inFlight, st.limit, st.msPerToken, now < st.ejectedUntil,
+          st.latency.quantile(0.5), st.latency.quantile(0.95), st.hedges, st.hedgeWins });
+      }
+      return res;
+    }
+
+  private:
+    struct State {
+      double limit = 1.0; // start low, probe upwards
+      size_t inFlight = 0;
+      double msPerToken = 0;
+      size_t samples = 0;
+      size_t failures = 0;
+      size_t ejections = 0;
+      size_t requests = 0;
+      size_t errors = 0;
+      size_t hedges = 0;
+      size_t hedgeWins = 0;
+      LatencyHistogram latency;
+      std::chrono::steady_clock::time_point ejectedUntil;
+    };
+
+    size_t pick(const std::vector<ApiConfig> &endpoints, size_t maxConcurrency, size_t exclude) {
+      auto now = std::chrono::steady_clock::now();
+      bool allEjected = std::all_of(endpoints.begin(), endpoints.end(), [&](const auto &ep) {
+        return now < states_[ep.apiUrl].ejectedUntil;
+      });
+      size_t best = endpoints.size();
+      double bestScore = 0;
+      for (size_t i = 0; i < endpoints.size(); i ++) {
+        if (i == exclude) continue;
+        auto &st = states_[endpoints[i].apiUrl];
+        // with every endpoint ejected, keep trying rather than fail outright
+        if (now < st.ejectedUntil && !allEjected) continue;
+        st.limit = (std::min)(st.limit, double(maxConcurrency));
+        if (st.inFlight >= static_cast<size_t>(st.limit)) continue;
+        // unmeasured endpoints score zero and get probed first
+        double score = (st.inFlight + 1) * st.msPerToken;
+        if (best == endpoints.size() || score < bestScore) {
+          best = i;
+          bestScore = score;
+        }
+      }
+      if (best < endpoints.size()) {
+        auto &st = states_[endpoints[best].apiUrl];
+        st.inFlight ++;
+        st.requests ++;
+      }
+      return best;
+    }
+
+    void eject(const ApiConfig &ep, State &st, std::chrono::steady_clock::time_point now) {
+      auto cooldown = std::chrono::seconds(5) * (size_t(1) << (std::min)(st.ejections, size_t(6)));
+      st.ejectedUntil = now + cooldown;
+      st.ejections ++;
+      st.failures = 0;
+      LOG_MSG << "Embedding endpoint" << ep.apiUrl << "ejected for" << std::chrono::duration_cast<std::chrono::seconds>(cooldown).count() << "s";
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<std::string, State> states_;
+  };
+
+  // Collects the vectors of an embedding response without building a DOM. Both the
+  // native llama.cpp shape [{"embedding": [[f, ...]]}, ...] and the OpenAI shape
+  // {"data": [{"index": i, "embedding": [f, ...] | "<base64>"}]} are accepted; any
+  // value under an "embedding" key starts a row, and for nested arrays only the
+  // first one (the pooled vector) is kept, as before.
+  class EmbeddingSax : public nlohmann::json_sax<nlohmann::json> {
+  public:
+    struct Row {
+      std::vector<float> values;
+      int64_t index = -1;
+    };
+
+    EmbeddingSax(std::vector<Row> &rows, size_t dimHint) : rows_(rows), dimHint_(dimHint) {}
+
+    bool null() override { return scalar(); }
+    bool boolean(bool) override { return scalar(); }
+    bool number_integer(number_integer_t v) override { return number(static_cast<double>(v), v); }
+    bool number_unsigned(number_unsigned_t v) override { return number(static_cast<double>(v), static_cast<int64_t>(v)); }
+    bool number_float(number_float_t v, const string_t &) override { return number(v, -1); }
+    bool binary(binary_t &) override { return scalar(); }
+
+    bool string(string_t &s) override {
+      if (key_ == "embedding" && !inEmbedding_) {
+        // base64 of little-endian float32, as sent for encoding_format=base64
+        std::string bytes = base64_decode(s);
+        if (bytes.size() % sizeof(float) != 0) {
+          throw std::runtime_error("Invalid base64 embedding");
+        }
+        auto &row = newRow();
+        row.values.resize(bytes.size() / sizeof(float));
+        std::memcpy(row.values.data(), bytes.data(), bytes.size());
+        key_.clear();
+        return true;
+      }
+      return scalar();
+    }
+
+    bool start_object(std::size_t) override {
+      depth_ ++;
+      if (inEmbedding_) throw std::runtime_error("Invalid embedding structure");
+      key_.clear();
+      objectIndex_ = -1;
+      return true;
+    }
+    bool end_object() override {
+      depth_ --;
+      if (objectIndex_ >= 0 && rowInObject_) rows_.back().index = objectIndex_;
+      rowInObject_ = false;
+      return true;
+    }
+    bool key(string_t &k) override {
+      key_ = k;
+      return true;
+    }
+
+    bool start_array(std::size_t) override {
+      depth_ ++;
+      if (!inEmbedding_ && key_ == "embedding") {
+        inEmbedding_ = true;
+        embeddingDepth_ = depth_;
+        nested_ = 0;
+        newRow();
+      } else if (inEmbedding_ && depth_ == embeddingDepth_ + 1) {
+        nested_ ++;
+      } else if (inEmbedding_) {
+        throw std::runtime_error("Invalid embedding structure");
+      }
+      key_.clear();
+      return true;
+    }
+    bool end_array() override {
+      if (inEmbedding_ && depth_ == embeddingDepth_) {
+        inEmbedding_ = false;
+        if (rows_.back().values.empty()) throw std::runtime_error("Invalid embedding structure");
+      }
+      depth_ --;
+      return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex) override {
+      throw std::runtime_error(std::string("Failed to parse server response: ") + ex.what());
+    }
+
+  private:
+    Row &newRow() {
+      rows_.emplace_back();
+      rows_.back().values.reserve(dimHint_);
+      rowInObject_ = true;
+      return rows_.back();
+    }
+    bool scalar() {
+      if (inEmbedding_) throw std::runtime_error("Non-numeric value in embedding data");
+      key_.clear();
+      return true;
+    }
+    bool number(double v, int64_t asIndex) {
+      if (inEmbedding_) {
+        if ((nested_ == 0 && depth_ == embeddingDepth_) || (nested_ == 1 && depth_ == embeddingDepth_ + 1)) {
+          rows_.back().values.push_back(static_cast<float>(v));
+        }
+      } else if (key_ == "index") {
+        objectIndex_ = asIndex;
+      }
+      key_.clear();
+      return true;
+    }
+
+    std::vector<Row> &rows_;
+    size_t dimHint_;
+    std::string key_;
+    size_t depth_ = 0;
+    bool inEmbedding_ = false;
+    size_t embeddingDepth_ = 0;
+    size_t nested_ = 0;
+    int64_t objectIndex_ = -1;
+    bool rowInObject_ = false;
+  };
+
+  // from_chars where the library has the floating point overloads, locale-free either way in the "C" locale
+  bool parseNumber(const char *&p, const char *end, float &v) {
+#if defined(__cpp_lib_to_chars)
+    auto [next, ec] = std::from_chars(p, end, v);
+    if (ec != std::errc()) return false;
+    p = next;
+#else
+    char *next = nullptr;
+    v = std::strtof(p, &next);
+    if (next == p || next > end) return false;
+    p = next;
+#endif
+    return true;
+  }
+
+  // Hand-rolled fast path for the usual response shapes: looks for "embedding" keys and
+  // converts the numbers straight into the rows. Returns false on anything unexpected so
+  // the caller can fall back to the validating SAX parser.
+  bool scanEmbeddingResponse(std::string_view body, size_t expected, size_t dimHint, std::vector<std::vector<float>> &embeddingsList) {
+    static constexpr std::string_view key = "\"embedding\"";
+    const char *begin = body.data();
+    const char *end = begin + body.size();
+    auto skipWs = [&](const char *p) {
+      while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p ++;
+      return p;
+    };
+    std::vector<std::vector<float>> rows(expected);
+    std::vector<bool> filled(expected);
+    size_t nofRows = 0;
+    size_t pos = 0;
+    while ((pos = body.find(key, pos)) != std::string_view::npos) {
+      const char *p = skipWs(begin + pos + key.size());
+      if (p == end || *p != ':') {
+        // a value such as "object": "embedding", not the key
+        pos += key.size();
+        continue;
+      }
+      p = skipWs(p + 1);
+      // the enclosing item object; item members are scalars, so no braces in between
+      size_t open = body.rfind('{', pos);
+      if (open == std::string_view::npos || nofRows == expected) return false;
+      std::vector<float> row;
+      row.reserve(dimHint);
+      if (p < end && *p == '"') {
+        const char *q = static_cast<const char *>(std::memchr(p + 1, '"', end - p - 1));
+        if (!q) return false;
+        std::string_view encoded(p + 1, q - p - 1);
+        // an escape such as \/ needs the JSON reader
+        if (encoded.find('\\') != std::string_view::npos) return false;
+        std::string bytes;
+        try {
+          bytes = base64_decode(encoded);
+        } catch (...) {
+          return false; // not base64 after all
+        }
+        if (bytes.empty() || bytes.size() % sizeof(float) != 0) return false;
+        row.resize(bytes.size() / sizeof(float));
+        std::memcpy(row.data(), bytes.data(), bytes.size());
+        p = q + 1;
+      } else if (p < end && *p == '[') {
+        p = skipWs(p + 1);
+        bool nested = p < end && *p == '[';
+        if (nested) p = skipWs(p + 1);
+        for (;;) {
+          float v;
+          if (!parseNumber(p, end, v)) return false;
+          row.push_back(v);
+          p = skipWs(p);
+          if (p < end && *p == ',') { p = skipWs(p + 1); continue; }
+          if (p < end && *p == ']') { p ++; break; }
+          return false;
+        }
+        if (nested) {
+          // only the pooled vector is used, skip per-token rows if any
+          int depth = 1;
+          while (p < end && depth > 0) {
+            if (*p == '[') depth ++;
+            else if (*p == ']') depth --;
+            else if (*p == '{' || *p == '}' || *p == '"') return false;
+            p ++;
+          }
+          if (depth != 0) return false;
+        }
+      } else {
+        return false;
+      }
+      const char *close = static_cast<const char *>(std::memchr(p, '}', end - p));
+      if (!close) return false;
+      // "index" may come before or after the vector
+      size_t index = nofRows;
+      for (std::string_view part : { body.substr(open, pos - open), std::string_view(p, close - p) }) {
+        size_t k = part.find("\"index\"");
+        if (k == std::string_view::npos) continue;
+        const char *q = skipWs(part.data() + k + 7);
+        if (q == end || *q != ':') return false;
+        q = skipWs(q + 1);
+        auto [next, ec] = std::from_chars(q, end, index);
+        if (ec != std::errc()) return false;
+      }
+      if (index >= expected || filled[index]) return false;
+      rows[index] = std::move(row);
+      filled[index] = true;
+      nofRows ++;
+      pos = p - begin;
+    }
+    if (nofRows != expected) return false;
+    embeddingsList.reserve(embeddingsList.size() + expected);
+    std::move(rows.begin(), rows.end(), std::back_inserter(embeddingsList));
+    return true;
+  }
+
+  // dimension of the last response, rows are allocated once at the right size
+  std::atomic<size_t> _lastEmbeddingDim{ 1024 };
+
+  void parseEmbeddingResponse(const std::string &body, size_t expected, std::vector<std::vector<float>> &embeddingsList) {
+    if (scanEmbeddingResponse(body, expected, _lastEmbeddingDim, embeddingsList)) {
+      if (expected) _lastEmbeddingDim = embeddingsList.back().size();
+      return;
+    }
+    std::vector<EmbeddingSax::Row> rows;
+    rows.reserve(expected);
+    EmbeddingSax sax(rows, _lastEmbeddingDim.load());
+    nlohmann::json::sax_parse(body, &sax);
+    if (rows.size() != expected) {
+      throw std::runtime_error("Unexpected embedding response format");
+    }
+    // OpenAI-style responses carry an index, honour it when it is a permutation
+    std::vector<size_t> order(rows.size());
+    for (size_t i = 0; i < rows.size(); i ++) order[i] = i;
+    bool indexed = std::all_of(rows.begin(), rows.end(), [&](const auto &r) { return r.index >= 0 && size_t(r.index) < rows.size(); });
+    if (indexed) {
+      std::vector<bool> seen(rows.size());
+      for (size_t i = 0; i < rows.size() && indexed; i ++) {
+        if (seen[rows[i].index]) indexed = false;
+        seen[rows[i].index] = true;
+        order[rows[i].index] = i;
+      }
+      if (!indexed) {
+        for (size_t i = 0; i < rows.size(); i ++) order[i] = i;
+      }
+    }
+    embeddingsList.reserve(embeddingsList.size() + rows.size());
+    for (size_t i : order) {
+      embeddingsList.push_back(std::move(rows[i].values));
+    }
+    if (!rows.empty()) _lastEmbeddingDim = embeddingsList.back().size();
+  }
+
+  std::mutex _base64Mutex;
+  std::unordered_set<std::string> _base64Unsupported;
+
+  bool base64Unsupported(const std::string &endpoint) {
+    std::lock_guard<std::mutex> lock(_base64Mutex);
+    return _base64Unsupported.count(endpoint) != 0;
+  }
+
+  void setBase64Unsupported(const std::string &endpoint) {
+    std::lock_guard<std::mutex> lock(_base64Mutex);
+    _base64Unsupported.insert(endpoint);
+  }
+
+  // rough, the client has no tokenizer; ~4 bytes per token for code and prose
+  size_t estimateTokens(const std::string &text) {
+    return text.size() / 4 + 1;
+  }
+
+} // anonymous namespace
 
 
 struct InferenceClient::Impl {
@@ -19,23 +678,12 @@ struct InferenceClient::Impl {
   std::string path_;
   size_t timeoutMs_;
 
-  std::unique_ptr<httplib::Client> httpClient_;
-
   void parseUrl();
 };
 
 void InferenceClient::Impl::parseUrl()
 {
-  const auto &url = apiCfg_.apiUrl;
-  size_t protocolEnd = url.find("://");
-  if (protocolEnd == std::string::npos) {
-    throw std::runtime_error("Invalid server URL format");
-  }
-  size_t hostStart = protocolEnd + 3;
-  size_t portStart = url.find(":", hostStart);
-  size_t pathStart = url.find("/", hostStart);
-  schemaHostPort_ = url.substr(0, pathStart);
-  path_ = url.substr(pathStart);
+  splitUrl(apiCfg_.apiUrl, schemaHostPort_, path_);
 }
 
 InferenceClient::InferenceClient(const ApiConfig &cfg, size_t timeout) : imp(new Impl)
@@ -43,20 +691,34 @@ InferenceClient::InferenceClient(const ApiConfig &cfg, size_t timeout) : imp(new
   imp->apiCfg_ = cfg;
   imp->timeoutMs_ = timeout;
   imp->parseUrl();
-  try {
-    imp->httpClient_ = std::make_unique<httplib::Client>(schemaHostPort());
-    imp->httpClient_->set_connection_timeout(0, timeoutMs() * 1000);
-    imp->httpClient_->set_read_timeout(timeoutMs() / 1000, (timeoutMs() % 1000) * 1000);
-  } catch (const std::exception &e) {
-    LOG_MSG << "Error initializing http client " << e.what();
-    imp->httpClient_.reset();
-  }
 }
 
 InferenceClient::~InferenceClient()
 {
 }
 
+void InferenceClient::configurePool(size_t maxIdlePerHost, size_t idleTimeoutMs)
+{
+  ConnectionPool::instance().configure(maxIdlePerHost, std::chrono::milliseconds(idleTimeoutMs));
+}
+
+InferenceClient::PoolStats InferenceClient::poolStats()
+{
+  return ConnectionPool::instance().stats();
+}
+
+void InferenceClient::prewarm() const
+{
+  if (ConnectionPool::instance().hasIdle(schemaHostPort())) {
+    return;
+  }
+  std::thread([host = schemaHostPort(), path = path(), timeout = timeoutMs()]() {
+    PooledClient client(host, timeout);
+    // whatever the answer, the TCP and TLS handshakes are done and the connection is pooled
+    client.track(client->Head(path.c_str()));
+  }).detach();
+}
+
 const ApiConfig &InferenceClient::cfg() const
 {
   return imp->apiCfg_;
@@ -80,65 +742,453 @@ size_t InferenceClient::timeoutMs() const
 //---------------------------------------------------------------------------
 
 
+namespace {
+  std::atomic<EmbeddingCache *> _embeddingCache{ nullptr };
+  std::atomic<QueryEmbeddingCache *> _queryCache{ nullptr };
+
+  using EmbedFn = std::function<void(const std::vector<std::string> &, std::vector<std::vector<float>> &)>;
+
+  // Fills the empty entries of `found` through `embed` and returns their indices.
+  std::vector<size_t> embedMissing(std::vector<std::string> &content, std::vector<std::vector<float>> &found, const EmbedFn &embed)
+  {
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < found.size(); i ++) {
+      if (found[i].empty()) missing.push_back(i);
+    }
+    if (missing.empty()) {
+      return missing;
+    }
+    std::vector<std::string> missingContent;
+    missingContent.reserve(missing.size());
+    for (size_t i : missing) {
+      missingContent.push_back(std::move(content[i]));
+    }
+    std::vector<std::vector<float>> fresh;
+    embed(missingContent, fresh);
+    if (fresh.size() != missing.size()) {
+      throw std::runtime_error("Unexpected number of embeddings");
+    }
+    for (size_t k = 0; k < missing.size(); k ++) {
+      found[missing[k]] = std::move(fresh[k]);
+    }
+    return missing;
+  }
+}
+
 EmbeddingClient::EmbeddingClient(const ApiConfig &cfg, size_t timeout)
   : InferenceClient(cfg, timeout)
 {
 }
 
-void EmbeddingClient::generateEmbeddings(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddingsList, EmbeddingClient::EncodeType et) const
+void EmbeddingClient::setCache(EmbeddingCache *cache)
 {
-  embeddingsList.reserve(texts.size());
-  try {
-    if (!imp->httpClient_) {
-      throw std::runtime_error("Failed to initialize http client");
+  _embeddingCache = cache;
+}
+
+EmbeddingCache *EmbeddingClient::cache()
+{
+  return _embeddingCache;
+}
+
+void EmbeddingClient::setQueryCache(QueryEmbeddingCache *cache)
+{
+  _queryCache = cache;
+}
+
+QueryEmbeddingCache *EmbeddingClient::queryCache()
+{
+  return _queryCache;
+}
+
+std::string EmbeddingClient::cacheModelKey() const
+{
+  // local servers often leave the model empty, the endpoint tells them apart
+  return cfg().model.empty() ? cfg().apiUrl : cfg().model;
+}
+
+void EmbeddingClient::generateEmbeddings(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddingsList, EmbeddingClient::EncodeType et,
+  const ProgressFn &onProgress) const
+{
+  auto content = prepareContent(texts, et);
+  QueryEmbeddingCache *cache = (bypassCache_ || et != EncodeType::Query) ? nullptr : _queryCache.load();
+  if (!cache) {
+    embedContent(content, embeddingsList, et, onProgress);
+    return;
+  }
+
+  // repeated queries are answered from memory without touching the disk cache
+  std::string model = cacheModelKey();
+  std::vector<std::string> keys;
+  std::vector<std::vector<float>> found(content.size());
+  keys.reserve(content.size());
+  for (size_t i = 0; i < content.size(); i ++) {
+    keys.push_back(QueryEmbeddingCache::makeKey(model, content[i]));
+    cache->lookup(keys.back(), found[i]);
+  }
+  auto missing = embedMissing(content, found, [&](const auto &c, auto &e) { embedContent(c, e, et, onProgress); });
+  for (size_t i : missing) {
+    cache->store(keys[i], found[i]);
+  }
+  embeddingsList.reserve(embeddingsList.size() + found.size());
+  std::move(found.begin(), found.end(), std::back_inserter(embeddingsList));
+}
+
+void EmbeddingClient::embedContent(const std::vector<std::string> &content, std::vector<std::vector<float>> &embeddingsList, EncodeType et,
+  const ProgressFn &onProgress) const
+{
+  EmbeddingCache *cache = bypassCache_ ? nullptr : _embeddingCache.load();
+  if (!cache) {
+    requestEmbeddings(content, embeddingsList, et, onProgress);
+    return;
+  }
+
+  // the key covers the formatted text, so document and query encodings never mix
+  std::string model = cacheModelKey();
+  std::vector<std::string> keys;
+  keys.reserve(content.size());
+  for (const auto &c : content) {
+    keys.push_back(EmbeddingCache::makeKey(model, c));
+  }
+  std::vector<std::vector<float>> found;
+  cache->lookup(keys, found);
+
+  std::vector<std::string> pending{ content };
+  auto missing = embedMissing(pending, found, [&](const auto &c, auto &e) { requestEmbeddings(c, e, et, onProgress); });
+  if (!missing.empty()) {
+    std::vector<std::string> missingKeys;
+    std::vector<std::vector<float>> fresh;
+    for (size_t i : missing) {
+      missingKeys.push_back(keys[i]);
+      fresh.push_back(found[i]);
     }
+    cache->store(missingKeys, fresh);
+  }
+  embeddingsList.reserve(embeddingsList.size() + found.size());
+  std::move(found.begin(), found.end(), std::back_inserter(embeddingsList));
+}
+
+void EmbeddingClient::configureBatching(size_t maxConcurrency, size_t batchTokens, size_t maxBatchItems, size_t retryAttempts, size_t maxRetryAfterMs)
+{
+  std::lock_guard<std::mutex> lock(_batchingMutex);
+  _batching.maxConcurrency = (std::max)(maxConcurrency, size_t(1));
+  _batching.batchTokens = batchTokens;
+  _batching.maxBatchItems = (std::max)(maxBatchItems, size_t(1));
+  _batching.retryAttempts = retryAttempts;
+  _batching.maxRetryAfterMs = maxRetryAfterMs;
+}
 
+void EmbeddingClient::configureHedging(bool enabled, size_t initialDelayMs)
+{
+  std::lock_guard<std::mutex> lock(_batchingMutex);
+  _batching.hedge = enabled;
+  _batching.hedgeDelayMs = initialDelayMs;
+}
+
+void EmbeddingClient::configureEndpoints(const std::vector<ApiConfig> &apis, size_t vectorDim)
+{
+  std::lock_guard<std::mutex> lock(_batchingMutex);
+  _endpointApis = apis;
+  _endpointDim = vectorDim;
+}
+
+std::vector<EmbeddingClient::EndpointStats> EmbeddingClient::endpointStats()
+{
+  return EndpointBalancer::instance().stats();
+}
+
+std::vector<ApiConfig> EmbeddingClient::endpoints() const
+{
+  std::vector<ApiConfig> res{ cfg() };
+  if (bypassCache_ || cfg().model.empty()) {
+    return res;
+  }
+  // only peers producing interchangeable vectors may take over a batch
+  std::lock_guard<std::mutex> lock(_batchingMutex);
+  for (const auto &api : _endpointApis) {
+    if (api.enabled && api.model == cfg().model && api.apiUrl != cfg().apiUrl
+      && api.documentFormat == cfg().documentFormat && api.queryFormat == cfg().queryFormat) {
+      res.push_back(api);
+    }
+  }
+  return res;
+}
+
+void EmbeddingClient::requestEmbeddings(const std::vector<std::string> &content, std::vector<std::vector<float>> &embeddingsList, EncodeType et,
+  const ProgressFn &onProgress) const
+{
+  BatchingConfig bc;
+  size_t vectorDim;
+  {
+    std::lock_guard<std::mutex> lock(_batchingMutex);
+    bc = _batching;
+    vectorDim = _endpointDim;
+  }
+  const auto apis = endpoints();
+
+  // batches close at the token budget or the item cap, whichever comes first
+  struct Batch {
+    size_t begin = 0;
+    size_t end = 0;
+    size_t tokens = 0;
+  };
+  std::vector<Batch> batches;
+  for (size_t i = 0; i < content.size(); i ++) {
+    size_t tokens = estimateTokens(content[i]);
+    if (batches.empty()
+      || batches.back().end - batches.back().begin >= bc.maxBatchItems
+      || (bc.batchTokens && batches.back().tokens + tokens > bc.batchTokens)) {
+      batches.push_back({ i, i, 0 });
+    }
+    batches.back().end = i + 1;
+    batches.back().tokens += tokens;
+  }
+
+  const bool interactive = et == EncodeType::Query;
+  if (interactive && bc.hedge && apis.size() > 1 && batches.size() == 1) {
+    // a failed race falls through to the regular retries below
+    std::vector<std::vector<float>> res;
+    if (postHedged(apis, content, batches.front().tokens, res)) {
+      std::move(res.begin(), res.end(), std::back_inserter(embeddingsList));
+      if (onProgress) onProgress(content.size(), content.size());
+      return;
+    }
+  }
+
+  std::vector<std::vector<std::vector<float>>> results(batches.size());
+  auto &balancer = EndpointBalancer::instance();
+  std::mutex mutex;
+  size_t next = 0;
+  size_t done = 0;
+  std::exception_ptr error;
+
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) error = std::current_exception();
+  };
+
+  auto worker = [&]() {
+    for (;;) {
+      size_t b;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error || next == batches.size()) return;
+        b = next++;
+      }
+      const auto &batch = batches[b];
+      std::vector<std::string> texts(content.begin() + batch.begin, content.begin() + batch.end);
+      for (size_t attempt = 0;; attempt ++) {
+        size_t e = balancer.acquire(apis, bc.maxConcurrency);
+        const auto &api = apis[e];
+        const auto start = std::chrono::steady_clock::now();
+        try {
+          results[b].clear();
+          postBatch(api, timeoutMs(), texts, results[b]);
+          if (e > 0 && vectorDim && !results[b].empty() && results[b].front().size() != vectorDim) {
+            size_t dim = results[b].front().size();
+            results[b].clear();
+            throw WrongDimension("Embedding endpoint " + api.apiUrl + " returned " + std::to_string(dim) + " dimensions");
+          }
+          double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+          balancer.release(api, EndpointBalancer::Outcome::Success, ms / batch.tokens, bc.maxConcurrency);
+          if (interactive) balancer.recordLatency(api, ms);
+          break;
+        } catch (const ServerBusy &ex) {
+          balancer.release(api, ex.unreachable ? EndpointBalancer::Outcome::Unreachable : EndpointBalancer::Outcome::Overloaded, 0, bc.maxConcurrency);
+          if (attempt >= bc.retryAttempts) {
+            fail();
+            return;
+          }
+          // another endpoint can take the batch right away, a lone one needs time to recover
+          if (apis.size() == 1) {
+            if (bc.maxRetryAfterMs < ex.retryAfterMs) {
+              LOG_MSG << "Embedding server busy for" << ex.retryAfterMs << "ms, more than the" << bc.maxRetryAfterMs << "ms allowed |" << ex.what();
+              fail();
+              return;
+            }
+            size_t delayMs = ex.retryAfterMs ? ex.retryAfterMs : (std::min)(size_t(250) << attempt, bc.maxRetryAfterMs);
+            LOG_MSG << "Embedding server busy, retrying in" << delayMs << "ms |" << ex.what();
+            std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+          } else {
+            LOG_MSG << "Embedding endpoint" << api.apiUrl << "busy, retrying |" << ex.what();
+          }
+        } catch (const WrongDimension &ex) {
+          balancer.release(api, EndpointBalancer::Outcome::Incompatible, 0, bc.maxConcurrency);
+          if (attempt >= bc.retryAttempts) {
+            fail();
+            return;
+          }
+        } catch (const std::exception &ex) {
+          balancer.release(api, EndpointBalancer::Outcome::Failed, 0, bc.maxConcurrency);
+          // with a single endpoint a bad request fails the same way every time
+          if (apis.size() == 1 || attempt >= bc.retryAttempts) {
+            fail();
+            return;
+          }
+          LOG_MSG << "Embedding endpoint" << api.apiUrl << "failed, retrying |" << ex.what();
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      done += batch.end - batch.begin;
+      if (onProgress) onProgress(done, content.size());
+    }
+  };
+
+  size_t nofWorkers = (std::min)(bc.maxConcurrency * apis.size(), batches.size());
+  if (nofWorkers <= 1) {
+    worker();
+  } else {
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nofWorkers; i ++) {
+      workers.emplace_back(worker);
+    }
+    for (auto &t : workers) t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  embeddingsList.reserve(embeddingsList.size() + content.size());
+  for (auto &r : results) {
+    std::move(r.begin(), r.end(), std::back_inserter(embeddingsList));
+  }
+}
+
+bool EmbeddingClient::postHedged(const std::vector<ApiConfig> &apis, const std::vector<std::string> &content, size_t tokens,
+  std::vector<std::vector<float>> &embeddingsList) const
+{
+  BatchingConfig bc;
+  size_t vectorDim;
+  {
+    std::lock_guard<std::mutex> lock(_batchingMutex);
+    bc = _batching;
+    vectorDim = _endpointDim;
+  }
+
+  // the losing request keeps running after we return, so everything it
+  // touches is owned by the race rather than by this client
+  struct Race {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::vector<float>> result;
+    size_t winner = 0; // 1 = first request, 2 = hedge
+    size_t finished = 0;
+  };
+  auto race = std::make_shared<Race>();
+  const size_t timeout = timeoutMs();
+  const std::string ownUrl = cfg().apiUrl;
+  auto launch = [=](const ApiConfig &api, size_t slot) {
+    std::thread([=]() {
+      auto &balancer = EndpointBalancer::instance();
+      std::vector<std::vector<float>> res;
+      auto outcome = EndpointBalancer::Outcome::Success;
+      const auto start = std::chrono::steady_clock::now();
+      try {
+        postBatch(api, timeout, content, res);
+        if (api.apiUrl != ownUrl && vectorDim && !res.empty() && res.front().size() != vectorDim) {
+          outcome = EndpointBalancer::Outcome::Incompatible;
+        }
+      } catch (const ServerBusy &e) {
+        outcome = e.unreachable ? EndpointBalancer::Outcome::Unreachable : EndpointBalancer::Outcome::Overloaded;
+        LOG_MSG << "Embedding endpoint" << api.apiUrl << "busy |" << e.what();
+      } catch (const std::exception &e) {
+        outcome = EndpointBalancer::Outcome::Failed;
+        LOG_MSG << "Embedding endpoint" << api.apiUrl << "failed |" << e.what();
+      }
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      balancer.release(api, outcome, ms / tokens, bc.maxConcurrency);
+      if (outcome == EndpointBalancer::Outcome::Success) balancer.recordLatency(api, ms);
+
+      std::lock_guard<std::mutex> lock(race->mutex);
+      race->finished ++;
+      if (outcome == EndpointBalancer::Outcome::Success && !race->winner) {
+        race->winner = slot;
+        race->result = std::move(res);
+      }
+      race->cv.notify_all();
+    }).detach();
+  };
+
+  auto &balancer = EndpointBalancer::instance();
+  size_t first = balancer.acquire(apis, bc.maxConcurrency);
+  auto delay = balancer.hedgeDelay(apis[first], bc.hedgeDelayMs);
+  launch(apis[first], 1);
+
+  std::unique_lock<std::mutex> lock(race->mutex);
+  size_t launched = 1;
+  size_t second = apis.size();
+  if (!race->cv.wait_for(lock, delay, [&]() { return race->finished > 0; })) {
+    // only when another endpoint has a free slot: hedging must not add to an overload
+    second = balancer.tryAcquire(apis, bc.maxConcurrency, first);
+    if (second < apis.size()) {
+      launch(apis[second], 2);
+      launched = 2;
+    }
+  }
+  race->cv.wait(lock, [&]() { return race->winner || race->finished == launched; });
+  if (second < apis.size()) {
+    balancer.countHedge(apis[second], race->winner == 2);
+  }
+  if (!race->winner) {
+    return false;
+  }
+  embeddingsList = std::move(race->result);
+  return true;
+}
+
+void EmbeddingClient::postBatch(const ApiConfig &api, size_t timeoutMs, const std::vector<std::string> &content,
+  std::vector<std::vector<float>> &embeddingsList)
+{
+  std::string host, path;
+  splitUrl(api.apiUrl, host, path);
+  // OpenAI-compatible endpoints take "input" and can send the floats base64 encoded,
+  // which is a fraction of the decimal text to transfer and parse
+  const bool openAi = path.ends_with("/embeddings");
+  const bool base64 = openAi && !base64Unsupported(host + path);
+  try {
     nlohmann::json requestBody;
-    requestBody["content"] = prepareContent(texts, et);
+    if (openAi) {
+      requestBody["input"] = content;
+      if (!api.model.empty()) requestBody["model"] = api.model;
+      if (base64) requestBody["encoding_format"] = "base64";
+    } else {
+      requestBody["content"] = content;
+    }
     std::string bodyStr = requestBody.dump();
 
     httplib::Headers headers = {
       {"Content-Type", "application/json"},
-      {"Authorization", "Bearer " + cfg().apiKey},
+      {"Authorization", "Bearer " + api.apiKey},
       {"Connection", "keep-alive"}
     };
-    auto res = imp->httpClient_->Post(path().c_str(), headers, bodyStr, "application/json");
+    httplib::Result res;
+    {
+      PooledClient client(host, timeoutMs);
+      res = client.track(client->Post(path.c_str(), headers, bodyStr, "application/json"));
+    }
     if (!res) {
-      throw std::runtime_error("Failed to connect to embedding server");
+      // timeouts and refused connections are worth another try after backing off
+      throw ServerBusy("Failed to connect to embedding server: " + httplib::to_string(res.error()), 0, true);
     }
-    if (res->status != 200) {
-      throw std::runtime_error("Server returned error: " + std::to_string(res->status) + " - " + res->body);
+    if (res->status == 429 || res->status >= 500) {
+      size_t retryAfterMs = 0;
+      if (res->has_header("Retry-After")) {
+        try {
+          // seconds; capped at a day so that the product cannot wrap around
+          retryAfterMs = (std::min)(std::stoul(res->get_header_value("Retry-After")), 86'400ul) * 1000;
+        } catch (...) {}
+      }
+      throw ServerBusy("Server returned error: " + std::to_string(res->status) + " - " + res->body, retryAfterMs);
     }
-    nlohmann::json response = nlohmann::json::parse(res->body);
-    if (!response.is_array() || response.size() != texts.size()) {
-      throw std::runtime_error("Unexpected embedding response format");
+    if (base64 && (res->status == 400 || res->status == 422)) {
+      LOG_MSG << "Embedding server rejected base64 encoding, falling back to plain arrays";
+      setBase64Unsupported(host + path);
+      postBatch(api, timeoutMs, content, embeddingsList);
+      return;
     }
-    for (size_t j = 0; j < texts.size(); j ++) {
-      assert(j < response.size());
-      if (response.size() <= j) {
-        LOG_MSG << "Not enough entries in the embedding response (asked for" << texts.size() << " but got" << response.size() << "). Skipped";
-        break;
-      }
-      const auto &item = response[j];
-      if (!item.contains("embedding") || !item["embedding"].is_array()) {
-        throw std::runtime_error("Missing or invalid 'embedding' field in response");
-      }
-      const auto &embeddingArray = item["embedding"];
-      if (embeddingArray.empty() || !embeddingArray[0].is_array()) {
-        throw std::runtime_error("Invalid embedding structure");
-      }
-      const auto &embeddingData = embeddingArray[0];
-      std::vector<float> embedding;
-      embedding.reserve(1024);
-      for (const auto &value : embeddingData) {
-        if (value.is_number()) {
-          embedding.push_back(value.get<float>());
-        } else {
-          throw std::runtime_error("Non-numeric value in embedding data");
-        }
-      }
-      embeddingsList.push_back(embedding);
+    if (res->status != 200) {
+      throw std::runtime_error("Server returned error: " + std::to_string(res->status) + " - " + res->body);
     }
+    parseEmbeddingResponse(res->body, content.size(), embeddingsList);
     //float l2Norm = calculateL2Norm(embedding);
     //std::cout << "[l2norm] " << l2Norm << std::endl;
   } catch (const nlohmann::json::exception &e) {
@@ -195,17 +1245,46 @@ std::vector<std::string> EmbeddingClient::prepareContent(const std::vector<std::
 
 
 namespace {
-  const std::string &_queryTemplate{ R"(
+  // Sent as the system message ahead of the conversation: it only changes when the
+  // context does, which keeps the request prefix cacheable across questions.
+  const std::string &_contextTemplate{ R"(
   You're a helpful software developer assistant, please use the provided context to base your answers on
   for user questions. Answer to the best of your knowledge. Keep your responses short and on point.
   Context:
   __CONTEXT__
+  )" };
 
-  Question:
-  __QUESTION__
+  size_t usageValue(const nlohmann::json &obj, const char *key) {
+    auto it = obj.find(key);
+    return it != obj.end() && it->is_number_unsigned() ? it->get<size_t>() : 0;
+  }
 
-  Answer:
-  )" };
+  // OpenAI style usage (cached tokens under prompt_tokens_details), DeepSeek's
+  // prompt_cache_hit_tokens, Anthropic's cache_read_input_tokens and llama-server timings.
+  void readUsage(const nlohmann::json &res, CompletionClient::Usage &usage) {
+    auto u = res.find("usage");
+    if (u != res.end() && u->is_object()) {
+      usage.promptTokens = usageValue(*u, "prompt_tokens");
+      usage.completionTokens = usageValue(*u, "completion_tokens");
+      auto details = u->find("prompt_tokens_details");
+      if (details != u->end() && details->is_object()) {
+        usage.cachedTokens = usageValue(*details, "cached_tokens");
+      }
+      usage.cachedTokens = (std::max)({ usage.cachedTokens, usageValue(*u, "prompt_cache_hit_tokens"),
+        usageValue(*u, "cache_read_input_tokens") });
+      usage.reported = true;
+    }
+    auto t = res.find("timings");
+    if (t != res.end() && t->is_object()) {
+      size_t cacheN = usageValue(*t, "cache_n");
+      if (!usage.reported) {
+        usage.promptTokens = cacheN + usageValue(*t, "prompt_n");
+        usage.completionTokens = usageValue(*t, "predicted_n");
+        usage.reported = true;
+      }
+      usage.cachedTokens = (std::max)(usage.cachedTokens, cacheN);
+    }
+  }
 } // anonymous namespace
 
 CompletionClient::CompletionClient(const ApiConfig &cfg, size_t timeout, const App &a)
@@ -219,16 +1298,15 @@ std::string CompletionClient::generateCompletion(
   const std::vector<SearchResult> &searchRes,
   float temperature,
   size_t maxTokens,
-  std::function<void(const std::string &)> onStream) const
+  std::function<void(const std::string &)> onStream,
+  Usage *usage,
+  const RawEventFn &onRawEvent) const
 {
 #ifndef CPPHTTPLIB_OPENSSL_SUPPORT
   if (schemaHostPort().starts_with("https://")) {
     throw std::runtime_error("HTTPS not supported in this build");
   }
 #endif
-  if (!imp->httpClient_) {
-    throw std::runtime_error("Failed to initialize http client");
-  }
 
   /*
   * Json Request body format.
@@ -249,8 +1327,14 @@ std::string CompletionClient::generateCompletion(
 
   const auto labelFmt = app_.settings().generationPrependLabelFormat();
   const auto maxContextTokens = cfg().contextLength;
-  size_t nofTokens = app_.tokenizer().countTokensWithVocab(_queryTemplate);
-  std::string context;
+  size_t nofTokens = app_.tokenizer().countTokensWithVocab(_contextTemplate);
+  // sources are selected in order of relevance, then laid out by path and position
+  // so the same set of sources always renders to the same prompt
+  struct Piece {
+    const SearchResult *result;
+    std::string text;
+  };
+  std::vector<Piece> pieces;
   for (const auto &r : searchRes) {
     std::string filename = std::filesystem::path(r.sourceId).filename().string();
     if (filename.empty()) filename = r.sourceId.empty() ? "source" : r.sourceId;
@@ -270,41 +1354,52 @@ std::string CompletionClient::generateCompletion(
       }
       size_t remainingContentTokens = remaining - labelTokens;
       if (remainingContentTokens == 0) break;
-      
-      // approximate characters for remainingContentTokens
-      size_t approxCharCount = r.content.length();
-      if (0 < contentTokens) {
-        approxCharCount = r.content.length() * remainingContentTokens / contentTokens;
-      }
 
-      std::string excerpt = r.content.substr(0, approxCharCount);
+      std::string excerpt = ContextPacker::truncate(app_.tokenizer(), r.content, remainingContentTokens);
 
       std::string labeledExcerpt = alreadyLabeled ? excerpt : (label + excerpt);
-      context += labeledExcerpt + "\n\n";
+      pieces.push_back({ &r, labeledExcerpt });
       nofTokens += app_.tokenizer().countTokensWithVocab(labeledExcerpt);
       break;
     }
     // full add
     std::string labeledFull = alreadyLabeled ? r.content : (label + r.content);
     nofTokens += labelTokens + contentTokens;
-    context += labeledFull + "\n\n";
+    pieces.push_back({ &r, labeledFull });
+  }
+  std::stable_sort(pieces.begin(), pieces.end(), [](const Piece &a, const Piece &b) {
+    if (a.result->sourceId != b.result->sourceId) return a.result->sourceId < b.result->sourceId;
+    return a.result->start < b.result->start;
+  });
+  std::string context;
+  for (const auto &p : pieces) {
+    context += p.text + "\n\n";
   }
 
   //std::cout << "Generating completions with context length of " << nofTokens << " tokens \n";
 
-  std::string prompt = _queryTemplate;
-  size_t pos = prompt.find("__CONTEXT__");
+  std::string systemPrompt = _contextTemplate;
+  size_t pos = systemPrompt.find("__CONTEXT__");
   assert(pos != std::string::npos);
-  prompt.replace(pos, std::string("__CONTEXT__").length(), context);
+  systemPrompt.replace(pos, std::string("__CONTEXT__").length(), context);
 
-  pos = prompt.find("__QUESTION__");
-  assert(pos != std::string::npos);
-  std::string question = messagesJson.back()["content"].get<std::string>();
-  prompt.replace(pos, std::string("__QUESTION__").length(), question);
-
-  // Assign propmt to the last messagesJson's content field
-  nlohmann::json modifiedMessages = messagesJson;
-  modifiedMessages.back()["content"] = prompt;
+  // system message first, then the conversation with the question left as asked;
+  // a system message from the client goes in front of the instructions
+  nlohmann::json modifiedMessages = nlohmann::json::array();
+  size_t first = 0;
+  if (!messagesJson.empty() && messagesJson[0].value("role", "") == "system" && messagesJson[0]["content"].is_string()) {
+    systemPrompt = messagesJson[0]["content"].get<std::string>() + "\n" + systemPrompt;
+    first = 1;
+  }
+  if (cfg().promptCache == "cache_control") {
+    nlohmann::json block = { {"type", "text"}, {"text", systemPrompt}, {"cache_control", {{"type", "ephemeral"}}} };
+    modifiedMessages.push_back({ {"role", "system"}, {"content", nlohmann::json::array({ block })} });
+  } else {
+    modifiedMessages.push_back({ {"role", "system"}, {"content", systemPrompt} });
+  }
+  for (size_t i = first; i < messagesJson.size(); i++) {
+    modifiedMessages.push_back(messagesJson[i]);
+  }
 
   //std::cout << "Full context: " << modifiedMessages.dump() << "\n";
 
@@ -315,6 +1410,14 @@ std::string CompletionClient::generateCompletion(
     requestBody["temperature"] = temperature;
   requestBody[cfg().maxTokensName] = maxTokens;
   requestBody["stream"] = cfg().stream;
+  if (cfg().promptCache == "cache_prompt") {
+    requestBody["cache_prompt"] = true;
+  }
+  if (cfg().stream && cfg().streamUsage) {
+    requestBody["stream_options"] = { {"include_usage", true} };
+  }
+
+  Usage reported;
 
   httplib::Headers headers = {
     {"Authorization", "Bearer " + cfg().apiKey},
@@ -323,71 +1426,74 @@ std::string CompletionClient::generateCompletion(
 
   std::string fullResponse;
   httplib::Result res;
+  PooledClient client(schemaHostPort(), timeoutMs());
 
   if (cfg().stream) {
     headers.insert({ "Accept", "text/event-stream" });
 
-    std::string buffer; // holds leftover partial data
+    SseParser parser;
+    std::string scratch;
+    std::string content;
+
+    // llama-server sends SSE format: "data: {...}\n\n"
+    auto onEvent = [&](std::string_view event) {
+      if (onRawEvent) {
+        onRawEvent(event);
+      }
+      auto payload = SseParser::data(event, scratch);
+      if (payload.empty() || payload == "[DONE]") {
+        return true;
+      }
+      // deltas are picked out in place, a complete parse only for usage reports
+      bool needsFull = false;
+      if (!sse::extractDelta(payload, content, needsFull)) {
+        LOG_MSG << "Error parsing chunk: " << payload;
+        return true;
+      }
+      if (needsFull) {
+        try {
+          readUsage(nlohmann::json::parse(payload), reported);
+        } catch (const std::exception &e) {
+          LOG_MSG << "Error parsing usage: " << e.what();
+        }
+      }
+      if (!content.empty()) {
+        fullResponse += content;
+        if (onStream && !onRawEvent) {
+          onStream(content);
+        }
+      }
+      return true;
+    };
 
-    res = imp->httpClient_->Post(
+    res = client.track(client->Post(
       path().c_str(),
       headers,
       requestBody.dump(),
       "application/json",
-      [&fullResponse, &onStream, &buffer](const char *data, size_t len) {
-        // llama-server sends SSE format: "data: {...}\n\n"
-        buffer.append(data, len);
-        size_t pos;
-        while ((pos = buffer.find("\n\n")) != std::string::npos) {
-          std::string event = buffer.substr(0, pos); // one SSE event
-          buffer.erase(0, pos + 2);
-          if (event.find("data: ", 0) == 0) {
-            std::string jsonStr = event.substr(6);
-            if (jsonStr == "[DONE]") {
-              break;
-            }
-            try {
-              nlohmann::json chunkJson = nlohmann::json::parse(jsonStr);
-              if (chunkJson.contains("choices") && !chunkJson["choices"].empty()) {
-                const auto &choice = chunkJson["choices"][0];
-                if (choice.contains("delta") && choice["delta"].contains("content")) {
-                  // Either choice["delta"]["content"] or choice["delta"]["reasoning_content"]
-                  std::string content;
-                  if (!choice["delta"]["content"].is_null())
-                    content = choice["delta"]["content"];
-                  else if (choice["delta"].contains("reasoning_content") && !choice["delta"]["reasoning_content"].is_null())
-                    content = choice["delta"]["reasoning_content"];
-                  fullResponse += content;
-                  if (onStream) {
-                    onStream(content);
-                  }
-                }
-              }
-            } catch (const std::exception &e) {
-              LOG_MSG << "Error parsing chunk: " << e.what() << " in: " << jsonStr;
-            }
-          }
-        }
-        if (buffer.find("Unauthorized") != std::string::npos) {
-          if (onStream) onStream(buffer);
+      [&parser, &onEvent, &onStream](const char *data, size_t len) {
+        parser.feed(data, len, onEvent);
+        if (parser.pending().find("Unauthorized") != std::string_view::npos) {
+          if (onStream) onStream(std::string(parser.pending()));
         }
         return true; // Continue receiving
       }
-    );
+    ));
 
   } else {
     headers.insert({ "Accept", "application/json" });
 
-    res = imp->httpClient_->Post(
+    res = client.track(client->Post(
       path().c_str(),
       headers,
       requestBody.dump(),
       "application/json"
-    );
+    ));
 
     if (res && res->status == 200) {
       try {
         nlohmann::json jsonRes = nlohmann::json::parse(res->body);
+        readUsage(jsonRes, reported);
         if (!jsonRes["choices"].empty()) {
           const auto &choice = jsonRes["choices"][0];
           if (choice.contains("message") && choice["message"].contains("content")) {
@@ -409,5 +1515,8 @@ std::string CompletionClient::generateCompletion(
     throw std::runtime_error(msg);
   }
 
+  if (usage) {
+    *usage = reported;
+  }
   return fullResponse;
 }
@@ -5,8 +5,15 @@
 
 #ifdef TEST_CHUNKING
 #include <iostream>
+#include <chrono>
 #include "chunker.h"
+#include "settings.h"
+#include "tokenizer.h"
 #include "sourceproc.h"
+#include "ctxpacker.h"
+#include "sse.h"
+#include "chatsession.h"
+#include <random>
 #endif
 
 int main(int argc, char *argv[]) {
@@ -16,9 +23,10 @@ int main(int argc, char *argv[]) {
   if (argc > 1 && std::string(argv[1]) == "test_chunking") {
     LOG_START;
     LOG_MSG << "test_chunking";
-    App app("settings.json");
+    Settings settings("settings.json");
+    SimpleTokenizer tokenizer(settings.tokenizerConfigPath());
+    Chunker chunker(tokenizer, settings.chunkingMinTokens(), settings.chunkingMaxTokens(), settings.chunkingOverlap());
 
-    const auto &chunker = app.chunker();
     std::string testCode = R"(#include <iostream>
     class MyClass {
     public:
@@ -36,8 +44,8 @@ int main(int argc, char *argv[]) {
     std::string testText = R"(# Project Title
 )";
 
-    const auto &srcProc = app.sourceProcessor();
-    auto src = const_cast<SourceProcessor &>(srcProc).collectSources();
+    SourceProcessor srcProc(settings);
+    auto src = srcProc.collectSources(true);
     if (4 < src.size()) {
       testCode = src[2].content;
     }
@@ -47,17 +55,376 @@ int main(int argc, char *argv[]) {
   
     LOG_MSG << "Code Chunks:";
     for (const auto &chunk : codeChunks) {
-      LOG_MSG << "\n\n----- chunk=" << chunk.chunkId << ", tokens = "<< chunk.metadata.tokenCount << "\n" << chunk.text << "\n";
+      LOG_MSG << "\n\n----- chunk=" << chunk.chunkId << ", tokens = "<< chunk.metadata.tokenCount << "\n" << chunk.text() << "\n";
     }
   
     LOG_MSG << "\n\nText Chunks:";
     for (const auto &chunk : textChunks) {
-      LOG_MSG << "\n\n----- size="<< chunk.metadata.tokenCount << "\n" << chunk.text << "\n";
+      LOG_MSG << "\n\n----- size="<< chunk.metadata.tokenCount << "\n" << chunk.text() << "\n";
     }
   
     return 0;
   }
 
+  // Chunking throughput over the sources configured in settings.json (real project files).
+  if (argc > 1 && std::string(argv[1]) == "bench_chunking") {
+    LOG_START;
+    Settings settings(2 < argc ? argv[2] : "settings.json");
+    SimpleTokenizer tokenizer(settings.tokenizerConfigPath());
+    Chunker chunker(tokenizer, settings.chunkingMinTokens(), settings.chunkingMaxTokens(), settings.chunkingOverlap());
+    SourceProcessor srcProc(settings);
+    auto sources = srcProc.collectSources(true);
+
+    using clock = std::chrono::steady_clock;
+    auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    size_t totalBytes = 0;
+    size_t totalChunks = 0;
+    for (const auto &s : sources) totalBytes += s.content.size();
+    const double mb = totalBytes / (1024.0 * 1024.0);
+
+    auto t0 = clock::now();
+    for (const auto &s : sources) Chunker::detectContentType(s.content, "");
+    auto t1 = clock::now();
+    for (const auto &s : sources) Chunker::normalizeWhitespaces(s.content);
+    auto t2 = clock::now();
+    for (const auto &s : sources) totalChunks += chunker.chunkText(s.content, s.source).size();
+    auto t3 = clock::now();
+
+    LOG_MSG << "Sources:" << sources.size() << "|" << mb << "MB |" << totalChunks << "chunks";
+    LOG_MSG << "  detectContentType:   " << ms(t1 - t0) << "ms (" << mb * 1000 / ms(t1 - t0) << "MB/s)";
+    LOG_MSG << "  normalizeWhitespaces:" << ms(t2 - t1) << "ms (" << mb * 1000 / ms(t2 - t1) << "MB/s)";
+    LOG_MSG << "  chunkText:           " << ms(t3 - t2) << "ms (" << mb * 1000 / ms(t3 - t2) << "MB/s)";
+
+    Chunker parallel(tokenizer, settings.chunkingMinTokens(), settings.chunkingMaxTokens(), settings.chunkingOverlap());
+    parallel.setParallel(1, settings.chunkingThreads());
+    auto t4 = clock::now();
+    for (const auto &s : sources) parallel.chunkText(s.content, s.source);
+    auto t5 = clock::now();
+    LOG_MSG << "  chunkText parallel:  " << ms(t5 - t4) << "ms (" << mb * 1000 / ms(t5 - t4) << "MB/s)";
+    return 0;
+  }
+
+  // Parallel chunking must produce exactly the sequential chunks.
+  if (argc > 1 && std::string(argv[1]) == "test_parallel_chunking") {
+    LOG_START;
+    Settings settings(2 < argc ? argv[2] : "settings.json");
+    SimpleTokenizer tokenizer(settings.tokenizerConfigPath());
+    Chunker sequential(tokenizer, settings.chunkingMinTokens(), settings.chunkingMaxTokens(), settings.chunkingOverlap());
+    SourceProcessor srcProc(settings);
+    auto sources = srcProc.collectSources(true);
+
+    size_t failures = 0;
+    for (size_t threads : { 2, 3, 8 }) {
+      Chunker parallel(tokenizer, settings.chunkingMinTokens(), settings.chunkingMaxTokens(), settings.chunkingOverlap());
+      parallel.setParallel(1, threads); // force splitting of every document
+      for (const auto &s : sources) {
+        for (bool semantic : { true, false }) {
+          auto expected = sequential.chunkText(s.content, s.source, semantic);
+          auto actual = parallel.chunkText(s.content, s.source, semantic);
+          bool same = expected.size() == actual.size();
+          for (size_t i = 0; same && i < expected.size(); ++i) {
+            const auto &a = expected[i];
+            const auto &b = actual[i];
+            same = a.chunkId == b.chunkId && a.text() == b.text() &&
+              a.metadata.tokenCount == b.metadata.tokenCount && a.metadata.start == b.metadata.start &&
+              a.metadata.end == b.metadata.end && a.metadata.unit == b.metadata.unit &&
+              a.metadata.type == b.metadata.type && a.metadata.symbol == b.metadata.symbol;
+          }
+          if (!same) {
+            failures++;
+            LOG_MSG << "MISMATCH" << s.source << "threads =" << threads << "semantic =" << semantic;
+          }
+        }
+      }
+    }
+    LOG_MSG << "Sources:" << sources.size() << "| mismatches:" << failures;
+    return failures ? 1 : 0;
+  }
+
+  // Context packer regression: budget and item limits, pinned order, duplicates,
+  // relevance against the exact optimum on small instances, exact truncation.
+  if (argc > 1 && std::string(argv[1]) == "test_packer") {
+    LOG_START;
+    size_t failures = 0;
+    auto check = [&failures](bool ok, const char *what) {
+      if (!ok) {
+        failures++;
+        LOG_MSG << "FAILED" << what;
+      }
+    };
+    auto chunk = [](const std::string &src, size_t id, size_t start, size_t end, float score) {
+      SearchResult r;
+      r.sourceId = src;
+      r.chunkUnit = "char";
+      r.chunkId = id;
+      r.start = start;
+      r.end = end;
+      r.similarityScore = score;
+      r.content = src + ":" + std::to_string(id);
+      return r;
+    };
+
+    {
+      std::vector<ContextPacker::Candidate> c = {
+        { chunk("att", std::string::npos, 0, 100, 1.0f), 300, true },
+        { chunk("a.cpp", 1, 0, 1000, 0.9f), 250, false },
+        { chunk("a.cpp", 1, 0, 1000, 0.9f), 250, false },  // same chunk found twice
+        { chunk("a.cpp", 2, 100, 1000, 0.8f), 250, false }, // mostly the same range
+        { chunk("a.cpp", 3, 950, 2000, 0.7f), 250, false }, // regular chunk overlap
+        { chunk("b.cpp", 4, 0, 1000, 0.6f), 400, false },
+      };
+      auto p = ContextPacker(1000, 10).pack(c);
+      check(p.results.size() == 3 && p.results[0].sourceId == "att", "pinned first");
+      check(p.duplicates == 2, "duplicates dropped");
+      check(p.results[1].chunkId == 1 && p.results[2].chunkId == 3, "picks in input order");
+      check(p.tokens == 800, "token total");
+    }
+
+    {
+      // dense tiny chunks against relevant large ones, with the item cap as the binding limit
+      const size_t k = 8;
+      std::vector<ContextPacker::Candidate> c;
+      for (size_t i = 0; i < k; i++) {
+        c.push_back({ chunk("tiny" + std::to_string(i), i, 0, 10, 0.1f), 1, false });
+        c.push_back({ chunk("large" + std::to_string(i), k + i, 0, 10, 0.9f), 100, false });
+      }
+      auto p = ContextPacker(100 * k, k).pack(c);
+      check(p.results.size() == k && p.relevance > 0.9f * k - 0.01f, "item cap packs the large chunks");
+    }
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> score(0.1f, 1.0f);
+    std::uniform_int_distribution<size_t> cost(20, 400);
+    double ratioSum = 0;
+    double worst = 1;
+    const int rounds = 500;
+    for (int round = 0; round < rounds; round++) {
+      std::vector<ContextPacker::Candidate> c;
+      for (size_t i = 0; i < 12; i++) {
+        c.push_back({ chunk("s" + std::to_string(i), i, 0, 10, score(gen)), cost(gen), false });
+      }
+      const size_t budget = 800;
+      const size_t maxItems = 5;
+      auto p = ContextPacker(budget, maxItems).pack(c);
+      check(p.tokens <= budget && p.results.size() <= maxItems, "budget and item limits");
+      float best = 0;
+      for (unsigned mask = 0; mask < (1u << c.size()); mask++) {
+        size_t tokens = 0, items = 0;
+        float rel = 0;
+        for (size_t i = 0; i < c.size(); i++) {
+          if (mask & (1u << i)) {
+            tokens += c[i].tokens;
+            rel += c[i].result.similarityScore;
+            items++;
+          }
+        }
+        if (tokens <= budget && items <= maxItems) best = (std::max)(best, rel);
+      }
+      double ratio = best > 0 ? p.relevance / best : 1.0;
+      ratioSum += ratio;
+      worst = (std::min)(worst, ratio);
+    }
+    check(worst >= 0.999, "optimal when the budget is within the token slices");
+    LOG_MSG << "Packed relevance vs optimum: mean" << ratioSum / rounds << "| worst" << worst;
+
+    Settings settings(2 < argc ? argv[2] : "settings.json");
+    SimpleTokenizer tokenizer(settings.tokenizerConfigPath());
+    std::string text;
+    for (int i = 0; i < 200; i++) text += "int value" + std::to_string(i) + " = compute(" + std::to_string(i * 7) + "); // \xc3\xa9t\xc3\xa9\n";
+    for (size_t limit : { 0, 1, 17, 250, 100000 }) {
+      auto cut = ContextPacker::truncate(tokenizer, text, limit);
+      bool ok = text.compare(0, cut.size(), cut) == 0 && tokenizer.countTokensWithVocab(cut) <= limit;
+      if (cut.size() < text.size()) {
+        ok = ok && limit < tokenizer.countTokensWithVocab(text.substr(0, cut.size() + 2));
+      }
+      check(ok, "exact truncation");
+    }
+
+    LOG_MSG << "Packer checks failed:" << failures;
+    return failures ? 1 : 0;
+  }
+
+  // Chat session reuse: a follow-up with a question of another length takes over the
+  // previous turn's files; excerpts only at the offset they were cut at.
+  if (argc > 1 && std::string(argv[1]) == "test_sessions") {
+    LOG_START;
+    size_t failures = 0;
+    auto check = [&failures](bool ok, const char *what) {
+      if (!ok) {
+        failures++;
+        LOG_MSG << "FAILED" << what;
+      }
+    };
+    auto source = [](const std::string &src, size_t tokens, size_t offset, bool whole) {
+      ChatSession::Source s;
+      s.result.sourceId = src;
+      s.tokens = tokens;
+      s.offset = offset;
+      s.whole = whole;
+      return s;
+    };
+    const size_t budget = 4000;
+    ChatSessionStore store(4, std::chrono::seconds(60));
+    {
+      // first turn, 12 question tokens
+      auto session = store.acquire("conversation");
+      session->contextKey = "key";
+      session->sources = { source("a.cpp", 800, 0, true), source("b.cpp", 1200, 800, false) };
+      session->related = { source("a.h", 300, 2000, true) };
+    }
+    // follow-up, 57 question tokens: offsets count from after the question
+    auto session = store.acquire("conversation");
+    size_t usedTokens = 57;
+    const size_t contextStart = usedTokens;
+    size_t nofReused = 0;
+    auto take = [&](const std::vector<ChatSession::Source> &kept, const std::string &src) {
+      auto *s = ChatSession::findSource(kept, src, usedTokens - contextStart,
+        [&](const ChatSession::Source &k) { return usedTokens + k.tokens <= budget; });
+      if (s) {
+        usedTokens += s->tokens;
+        nofReused++;
+      }
+      return s != nullptr;
+    };
+    check(take(session->sources, "a.cpp") && take(session->sources, "b.cpp") && take(session->related, "a.h"),
+      "follow-up takes over whole files and excerpts");
+    store.countReuse(0, nofReused > 0);
+    check(store.stats().reusedContexts > 0, "reused context counted");
+
+    usedTokens = contextStart + 100; // a file before it changed
+    check(!take(session->sources, "b.cpp"), "excerpt at another offset is cut again");
+    check(take(session->related, "a.h"), "whole file at another offset");
+    usedTokens = budget - 100;
+    check(!take(session->sources, "a.cpp"), "whole file that no longer fits");
+    check(!take(session->sources, "c.cpp"), "unknown file");
+
+    LOG_MSG << "Session checks failed:" << failures;
+    return failures ? 1 : 0;
+  }
+
+  // SSE stream regression: events split at every byte, CRLF endings, comments,
+  // multi-line data, delta extraction and the JSON string escapes.
+  if (argc > 1 && std::string(argv[1]) == "test_sse") {
+    LOG_START;
+    size_t failures = 0;
+    auto check = [&failures](bool ok, const char *what) {
+      if (!ok) {
+        failures++;
+        LOG_MSG << "FAILED" << what;
+      }
+    };
+    const std::string json1 = R"({"choices":[{"delta":{"content":"Hel"}}]})";
+    const std::string json2 = R"({"choices":[{"delta":{"content":"lo"}}]})";
+    const std::string json3 = R"({"choices":[{"delta":{"content":null,"reasoning_content":"hm"}}],"usage":null})";
+    const std::string json4a = R"({"choices":[],)";
+    const std::string json4b = R"("usage":{"prompt_tokens":3}})";
+    const std::string stream =
+      ": keep-alive\n\n"
+      "data: " + json1 + "\n\n"
+      "event: message\r\ndata: " + json2 + "\r\n\r\n"
+      "data:" + json3 + "\n\n"
+      "data: " + json4a + "\r\ndata: " + json4b + "\n\n"
+      "data: [DONE]\n\n"
+      "data: {\"cho";
+    const std::vector<std::string> expected = { "", json1, json2, json3, json4a + "\n" + json4b, "[DONE]" };
+    auto collect = [&stream](const std::vector<size_t> &cuts, std::string &pending) {
+      SseParser parser;
+      std::vector<std::string> events;
+      std::string scratch;
+      size_t from = 0;
+      for (size_t to : cuts) {
+        parser.feed(stream.data() + from, to - from, [&](std::string_view event) {
+          events.emplace_back(SseParser::data(event, scratch));
+          return true;
+          });
+        from = to;
+      }
+      pending = parser.pending();
+      return events;
+    };
+    std::string pending;
+    bool splitOk = true;
+    for (size_t i = 0; i <= stream.size(); i++) {
+      splitOk = splitOk && collect({ i, stream.size() }, pending) == expected && pending == "data: {\"cho";
+    }
+    check(splitOk, "events split at every byte offset");
+    std::vector<size_t> bytes;
+    for (size_t i = 1; i <= stream.size(); i++) bytes.push_back(i);
+    check(collect(bytes, pending) == expected, "events fed byte by byte");
+    {
+      SseParser parser;
+      size_t seen = 0;
+      bool more = parser.feed(stream.data(), stream.size(), [&seen](std::string_view) { return ++seen < 2; });
+      check(!more && seen == 2, "feed stops when the handler does");
+    }
+
+    std::string content;
+    bool needsFull = true;
+    check(sse::extractDelta(json1, content, needsFull) && content == "Hel" && !needsFull, "delta content");
+    check(sse::extractDelta(json3, content, needsFull) && content == "hm" && !needsFull, "null content falls back to reasoning, null usage");
+    check(sse::extractDelta(json4a + "\n" + json4b, content, needsFull) && content.empty() && needsFull, "usage object needs the full chunk");
+    check(!sse::extractDelta(R"({"choices":[{"delta":{"content":"cut)", content, needsFull), "malformed chunk");
+    const std::string surrogates = R"({"choices":[{"delta":{"content":"a\ud83d\ude00b\u00e9\n"}}]})";
+    check(sse::extractDelta(surrogates, content, needsFull) && content == "a\xf0\x9f\x98\x80" "b\xc3\xa9\n", "surrogate pairs");
+
+    std::string original = "quote \" backslash \\ slash / utf-8 \xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+    for (int c = 1; c < 0x20; c++) original += char(c);
+    original += '\0';
+    original += "end";
+    std::string quoted;
+    sse::appendJsonString(quoted, original);
+    check(nlohmann::json::parse(quoted).get<std::string>() == original, "escapes read back by nlohmann");
+    check(sse::extractDelta(R"({"choices":[{"delta":{"content":)" + quoted + "}}]}", content, needsFull) && content == original, "escape round-trip");
+
+    LOG_MSG << "SSE checks failed:" << failures;
+    return failures ? 1 : 0;
+  }
+
+  // Relevance packed into a fixed budget: the previous in-order fill with a cut-off
+  // last item against the packer, on synthetic candidates in source-rank order.
+  if (argc > 1 && std::string(argv[1]) == "bench_packer") {
+    LOG_START;
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> score(0.2f, 0.9f);
+    std::lognormal_distribution<double> cost(5.5, 0.8); // median ~250 tokens, long tail
+    const size_t budget = 8000;
+    const size_t maxItems = 20;
+    const int rounds = 200;
+    double inOrderSum = 0;
+    double packedSum = 0;
+    double packMs = 0;
+    for (int round = 0; round < rounds; round++) {
+      std::vector<ContextPacker::Candidate> c;
+      for (size_t i = 0; i < 100; i++) {
+        SearchResult r;
+        r.sourceId = "src" + std::to_string(i / 5);
+        r.chunkUnit = "char";
+        r.chunkId = i;
+        r.start = (i % 5) * 1000;
+        r.end = r.start + 1000;
+        r.similarityScore = score(gen);
+        c.push_back({ r, (std::max)(size_t(10), static_cast<size_t>(cost(gen))), false });
+      }
+      size_t used = 0;
+      double inOrder = 0;
+      for (size_t i = 0; i < c.size() && i < maxItems && used < budget; i++) {
+        size_t take = (std::min)(c[i].tokens, budget - used);
+        inOrder += c[i].result.similarityScore * take / c[i].tokens;
+        used += take;
+      }
+      auto t0 = std::chrono::steady_clock::now();
+      auto p = ContextPacker(budget, maxItems).pack(c);
+      packMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+      inOrderSum += inOrder;
+      packedSum += p.relevance;
+    }
+    LOG_MSG << "Budget" << budget << "tokens," << maxItems << "items, 100 candidates";
+    LOG_MSG << "  in-order fill relevance:" << inOrderSum / rounds;
+    LOG_MSG << "  packed relevance:       " << packedSum / rounds;
+    LOG_MSG << "  pack time:              " << packMs / rounds << "ms";
+    return 0;
+  }
+
 #endif
 
   return App::run(argc, argv);
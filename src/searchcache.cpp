@@ -0,0 +1,126 @@
+#include "searchcache.h"
+#include "database.h"
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include "3rdparty/fmt/core.h"
+
+
+struct SearchResultCache::Impl {
+  struct Entry {
+    std::string key;
+    std::vector<SearchResult> results;
+  };
+
+  size_t maxEntries_ = 0;
+  size_t bits_ = 64;
+  size_t dim_ = 0;
+  std::vector<float> planes_; // bits_ x dim_, row major
+  uint64_t generation_ = 0;
+
+  std::list<Entry> lru_; // most recent first
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+
+  void reset() {
+    lru_.clear();
+    index_.clear();
+    stats_.entries = 0;
+  }
+
+  // returns false when the entries belong to an older generation than the caller's
+  bool sync(uint64_t generation) {
+    if (generation == generation_) return true;
+    if (generation < generation_) return false;
+    if (!lru_.empty()) stats_.invalidations ++;
+    reset();
+    generation_ = generation;
+    return true;
+  }
+
+  void preparePlanes(size_t dim) {
+    if (dim == dim_) return;
+    // fixed seed: signatures stay comparable for the lifetime of the cache
+    std::mt19937 gen(0x5eed);
+    std::normal_distribution<float> dist;
+    planes_.resize(bits_ * dim);
+    for (auto &p : planes_) p = dist(gen);
+    dim_ = dim;
+    reset();
+  }
+
+  std::string makeKey(const std::vector<float> &query, size_t topK, const std::string &filter) {
+    preparePlanes(query.size());
+    uint64_t sig = 0;
+    for (size_t b = 0; b < bits_; b ++) {
+      const float *plane = planes_.data() + b * dim_;
+      float dot = 0;
+      for (size_t i = 0; i < dim_; i ++) dot += plane[i] * query[i];
+      if (dot >= 0) sig |= uint64_t(1) << b;
+    }
+    return fmt::format("{:016x}:{}:{}", sig, topK, filter);
+  }
+};
+
+SearchResultCache::SearchResultCache(size_t maxEntries, size_t lshBits) : imp(new Impl)
+{
+  imp->maxEntries_ = maxEntries;
+  imp->bits_ = std::clamp(lshBits, size_t(8), size_t(64));
+  imp->stats_.maxEntries = maxEntries;
+}
+
+SearchResultCache::~SearchResultCache()
+{
+}
+
+bool SearchResultCache::lookup(const std::vector<float> &query, size_t topK, const std::string &filter,
+  uint64_t generation, std::vector<SearchResult> &results)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  if (query.empty() || !imp->sync(generation)) {
+    imp->stats_.misses ++;
+    return false;
+  }
+  auto it = imp->index_.find(imp->makeKey(query, topK, filter));
+  if (it == imp->index_.end()) {
+    imp->stats_.misses ++;
+    return false;
+  }
+  imp->lru_.splice(imp->lru_.begin(), imp->lru_, it->second);
+  results = it->second->results;
+  imp->stats_.hits ++;
+  return true;
+}
+
+void SearchResultCache::store(const std::vector<float> &query, size_t topK, const std::string &filter,
+  uint64_t generation, const std::vector<SearchResult> &results)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  if (imp->maxEntries_ == 0 || query.empty() || !imp->sync(generation)) {
+    return;
+  }
+  auto key = imp->makeKey(query, topK, filter);
+  auto it = imp->index_.find(key);
+  if (it != imp->index_.end()) {
+    it->second->results = results;
+    imp->lru_.splice(imp->lru_.begin(), imp->lru_, it->second);
+    return;
+  }
+  imp->lru_.push_front({ key, results });
+  imp->index_[key] = imp->lru_.begin();
+  while (imp->lru_.size() > imp->maxEntries_) {
+    imp->index_.erase(imp->lru_.back().key);
+    imp->lru_.pop_back();
+    imp->stats_.evictions ++;
+  }
+  imp->stats_.entries = imp->lru_.size();
+}
+
+SearchResultCache::Stats SearchResultCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  return imp->stats_;
+}
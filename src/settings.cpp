@@ -30,6 +30,8 @@ namespace {
     cfg.enabled = item.value("enabled", true);
     cfg.stream = item.value("stream", true);
     cfg.contextLength = item.value("context_length", section.value("max_context_tokens", 32000));
+    cfg.promptCache = item.value("prompt_cache", "");
+    cfg.streamUsage = item.value("stream_usage", false);
     if (item.contains("pricing_tpm")) {
       auto pricing = item["pricing_tpm"];
       if (pricing.is_object()) {
@@ -132,6 +134,51 @@ std::vector<ApiConfig> Settings::generationApis() const
   return getApiConfigList(config_["generation"]);
 }
 
+namespace {
+  nlohmann::json admissionSection(const nlohmann::json &config) {
+    if (config.contains("server") && config["server"].contains("admission") && config["server"]["admission"].is_object()) {
+      return config["server"]["admission"];
+    }
+    return nlohmann::json::object();
+  }
+} // anonymous namespace
+
+bool Settings::serverAdmissionEnabled() const
+{
+  return admissionSection(config_).value("enabled", true);
+}
+
+size_t Settings::serverReservedWorkers() const
+{
+  return admissionSection(config_).value("reserved_workers", size_t(2));
+}
+
+size_t Settings::serverMaxQueueWaitMs() const
+{
+  return admissionSection(config_).value("max_queue_wait_ms", size_t(5000));
+}
+
+AdmissionConfig Settings::serverAdmission(const std::string &cls) const
+{
+  // lower priority classes are limited harder and refused earlier
+  AdmissionConfig cfg;
+  if (cls == "chat") {
+    cfg = { 8, 8, 0.9f };
+  } else if (cls == "bulk") {
+    cfg = { 1, 2, 0.5f };
+  } else {
+    cfg = { 0, 16, 1.0f };
+  }
+  auto section = admissionSection(config_);
+  if (section.contains(cls) && section[cls].is_object()) {
+    const auto &item = section[cls];
+    cfg.maxConcurrent = item.value("max_concurrent", cfg.maxConcurrent);
+    cfg.maxQueue = item.value("max_queue", cfg.maxQueue);
+    cfg.shedAt = item.value("shed_at", cfg.shedAt);
+  }
+  return cfg;
+}
+
 void Settings::initProjectIdIfMissing(bool hydrateFile)
 {
   std::string s;
@@ -0,0 +1,116 @@
+#include "sourcecache.h"
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+
+
+struct SourceContentCache::Impl {
+  struct Item {
+    std::string path;
+    Stamp stamp;
+    Entry entry;
+  };
+
+  size_t maxBytes_ = 0;
+  std::list<Item> lru_; // most recent first
+  std::unordered_map<std::string, std::list<Item>::iterator> index_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+
+  void erase(std::unordered_map<std::string, std::list<Item>::iterator>::iterator it) {
+    stats_.bytes -= it->second->entry.content.size();
+    lru_.erase(it->second);
+    index_.erase(it);
+    stats_.entries = lru_.size();
+  }
+};
+
+SourceContentCache::SourceContentCache(size_t maxBytes) : imp(new Impl)
+{
+  imp->maxBytes_ = maxBytes;
+  imp->stats_.maxBytes = maxBytes;
+}
+
+SourceContentCache::~SourceContentCache()
+{
+}
+
+bool SourceContentCache::stampOf(const std::string &path, Stamp &stamp)
+{
+  std::error_code ec;
+  stamp.mtime = std::filesystem::last_write_time(path, ec);
+  if (ec) return false;
+  stamp.size = std::filesystem::file_size(path, ec);
+  return !ec;
+}
+
+bool SourceContentCache::lookup(const std::string &path, Entry &entry)
+{
+  Stamp stamp;
+  bool exists = stampOf(path, stamp);
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto it = imp->index_.find(path);
+  if (it == imp->index_.end()) {
+    imp->stats_.misses ++;
+    return false;
+  }
+  if (!exists || !(it->second->stamp == stamp)) {
+    imp->erase(it);
+    imp->stats_.invalidations ++;
+    imp->stats_.misses ++;
+    return false;
+  }
+  imp->lru_.splice(imp->lru_.begin(), imp->lru_, it->second);
+  entry = it->second->entry;
+  imp->stats_.hits ++;
+  return true;
+}
+
+void SourceContentCache::store(const std::string &path, const Stamp &stamp, const Entry &entry)
+{
+  // written while it was being read: the content may be older than the file
+  Stamp now;
+  if (entry.content.size() > imp->maxBytes_ || !stampOf(path, now) || !(now == stamp)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto it = imp->index_.find(path);
+  if (it != imp->index_.end()) {
+    imp->erase(it);
+  }
+  imp->lru_.push_front({ path, stamp, entry });
+  imp->index_[path] = imp->lru_.begin();
+  imp->stats_.bytes += entry.content.size();
+  while (imp->stats_.bytes > imp->maxBytes_) {
+    imp->erase(imp->index_.find(imp->lru_.back().path));
+    imp->stats_.evictions ++;
+  }
+  imp->stats_.entries = imp->lru_.size();
+}
+
+void SourceContentCache::invalidate(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto it = imp->index_.find(path);
+  if (it != imp->index_.end()) {
+    imp->erase(it);
+    imp->stats_.invalidations ++;
+  }
+}
+
+void SourceContentCache::clear()
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  imp->lru_.clear();
+  imp->index_.clear();
+  imp->stats_.entries = 0;
+  imp->stats_.bytes = 0;
+}
+
+SourceContentCache::Stats SourceContentCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  return imp->stats_;
+}
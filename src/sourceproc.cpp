@@ -5,6 +5,8 @@
 #include <exception>
 #include <filesystem>
 #include <iterator>
+#include <algorithm>
+#include <cstring>
 #include <httplib.h>
 #include <utils_log/logger.hpp>
 #include <3rdparty/utf8.h>
@@ -57,22 +59,6 @@ SourceProcessor::Data SourceProcessor::fetchSource(const std::string &uri) const
   return res.empty() ? Data{} : res[0];
 }
 
-std::vector<std::string> SourceProcessor::filterRelatedSources(const std::vector<std::string> &sources, const std::string &uri) const
-{
-  std::vector<std::string> res;
-  std::string base = std::filesystem::path(uri).stem().string();
-  const auto maxPerSource = settings_.generationMaxRelatedPerSource();
-  for (const auto &s : sources) {
-    if (res.size() == maxPerSource) break;
-    if (std::filesystem::path(uri) == std::filesystem::path(s)) continue;
-    auto t = std::filesystem::path(s).stem().string();
-    if (t == base || t.find(base) != std::string::npos) {
-      res.push_back(s);
-    }
-  }
-  return res;
-}
-
 bool SourceProcessor::readFile(const std::string &uri, std::string &data)
 {
   std::ifstream file(uri);
@@ -209,3 +195,105 @@ bool SourceProcessor::hasValidExtension(const std::string &filepath, const std::
   }
   return false;
 }
+
+//---------------------------------------------------------------------------
+
+
+void RelatedSourceIndex::rebuild(const std::vector<std::string> &paths)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.clear();
+  byPath_.clear();
+  for (const auto &p : paths) {
+    if (byPath_.emplace(p, files_.size()).second) {
+      files_.push_back({ p, std::filesystem::path(p).stem().string() });
+    }
+  }
+  dirty_ = true;
+}
+
+void RelatedSourceIndex::add(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (byPath_.emplace(path, files_.size()).second) {
+    files_.push_back({ path, std::filesystem::path(path).stem().string() });
+    dirty_ = true;
+  }
+}
+
+void RelatedSourceIndex::remove(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = byPath_.find(path);
+  if (it != byPath_.end()) {
+    files_[it->second].removed = true;
+    byPath_.erase(it);
+    dirty_ = true;
+  }
+}
+
+size_t RelatedSourceIndex::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return byPath_.size();
+}
+
+void RelatedSourceIndex::sortSuffixes() const
+{
+  // drop removed files, the survivors keep their relative order
+  files_.erase(std::remove_if(files_.begin(), files_.end(), [](const File &f) { return f.removed; }), files_.end());
+  byPath_.clear();
+  text_.clear();
+  owner_.clear();
+  for (size_t i = 0; i < files_.size(); i ++) {
+    byPath_[files_[i].path] = i;
+    text_ += files_[i].stem;
+    text_.push_back('\0');
+    owner_.resize(text_.size(), static_cast<uint32_t>(i));
+  }
+  suffixes_.clear();
+  for (uint32_t pos = 0; pos < text_.size(); pos ++) {
+    if (text_[pos] != '\0') suffixes_.push_back(pos);
+  }
+  // the terminators end every comparison at the stem boundary
+  const char *text = text_.c_str();
+  std::sort(suffixes_.begin(), suffixes_.end(), [text](uint32_t a, uint32_t b) {
+    return std::strcmp(text + a, text + b) < 0;
+  });
+  dirty_ = false;
+}
+
+std::vector<std::string> RelatedSourceIndex::find(const std::string &path, size_t maxResults) const
+{
+  const std::string base = std::filesystem::path(path).stem().string();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (base.empty() || maxResults == 0) {
+    return {};
+  }
+  if (dirty_) {
+    sortSuffixes();
+  }
+  // suffixes starting with base form one contiguous range
+  const char *text = text_.c_str();
+  auto first = std::lower_bound(suffixes_.begin(), suffixes_.end(), base, [text](uint32_t pos, const std::string &key) {
+    return std::strncmp(text + pos, key.c_str(), key.size()) < 0;
+  });
+  auto last = std::upper_bound(first, suffixes_.end(), base, [text](const std::string &key, uint32_t pos) {
+    return std::strncmp(key.c_str(), text + pos, key.size()) < 0;
+  });
+  std::vector<uint32_t> ids;
+  for (auto it = first; it != last; ++it) {
+    ids.push_back(owner_[*it]);
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+  std::vector<std::string> res;
+  const std::filesystem::path self(path);
+  for (auto id : ids) {
+    if (res.size() == maxResults) break;
+    if (std::filesystem::path(files_[id].path) == self) continue;
+    res.push_back(files_[id].path);
+  }
+  return res;
+}
@@ -0,0 +1,287 @@
+#include "sse.h"
+#include <cstring>
+
+
+namespace {
+
+  // Just enough of a JSON reader to walk down to a few keys and skip everything else.
+  struct JsonReader {
+    const char *p;
+    const char *end;
+    std::string key; // last member name read by object()
+
+    void ws() {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p ++;
+    }
+    bool consume(char c) {
+      ws();
+      if (p < end && *p == c) {
+        p ++;
+        return true;
+      }
+      return false;
+    }
+    bool peek(char c) {
+      ws();
+      return p < end && *p == c;
+    }
+    bool literal(const char *w) {
+      size_t n = std::strlen(w);
+      if (size_t(end - p) < n || std::memcmp(p, w, n) != 0) return false;
+      p += n;
+      return true;
+    }
+
+    static void appendUtf8(std::string &out, unsigned cp) {
+      if (cp < 0x80) {
+        out += char(cp);
+      } else if (cp < 0x800) {
+        out += char(0xC0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3F));
+      } else if (cp < 0x10000) {
+        out += char(0xE0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+      } else {
+        out += char(0xF0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3F));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+      }
+    }
+    bool hex4(unsigned &v) {
+      if (end - p < 4) return false;
+      v = 0;
+      for (int i = 0; i < 4; i ++) {
+        char c = *p ++;
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= unsigned(c - '0');
+        else if (c >= 'a' && c <= 'f') v |= unsigned(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= unsigned(c - 'A' + 10);
+        else return false;
+      }
+      return true;
+    }
+
+    // Decodes into out, or only skips the string when out is null.
+    bool string(std::string *out) {
+      if (!consume('"')) return false;
+      while (p < end) {
+        const char *run = p;
+        while (p < end && *p != '"' && *p != '\\') p ++;
+        if (out) out->append(run, p - run);
+        if (p == end) return false;
+        if (*p ++ == '"') return true;
+        if (p == end) return false;
+        char e = *p ++;
+        char c = 0;
+        switch (e) {
+          case '"': case '\\': case '/': c = e; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case 'u': {
+            unsigned cp;
+            if (!hex4(cp)) return false;
+            if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+              p += 2;
+              unsigned lo;
+              if (!hex4(lo)) return false;
+              cp = (lo >= 0xDC00 && lo < 0xE000) ? 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00) : 0xFFFD;
+            }
+            if (out) appendUtf8(*out, cp);
+            continue;
+          }
+          default:
+            return false;
+        }
+        if (out) *out += c;
+      }
+      return false;
+    }
+
+    // Calls onMember for every member with key set; onMember has to read the value.
+    template <class F>
+    bool object(F &&onMember) {
+      if (!consume('{')) return false;
+      if (consume('}')) return true;
+      do {
+        key.clear();
+        if (!string(&key) || !consume(':') || !onMember()) return false;
+      } while (consume(','));
+      return consume('}');
+    }
+
+    bool skip() {
+      ws();
+      if (p == end) return false;
+      switch (*p) {
+        case '"':
+          return string(nullptr);
+        case '{':
+          return object([this] { return skip(); });
+        case '[':
+          p ++;
+          if (consume(']')) return true;
+          do {
+            if (!skip()) return false;
+          } while (consume(','));
+          return consume(']');
+        case 't':
+          return literal("true");
+        case 'f':
+          return literal("false");
+        case 'n':
+          return literal("null");
+        default: {
+          const char *start = p;
+          while (p < end && std::strchr("+-0123456789.eE", *p)) p ++;
+          return p != start;
+        }
+      }
+    }
+  };
+
+} // anonymous namespace
+
+
+bool SseParser::feed(const char *data, size_t len, const EventFn &onEvent)
+{
+  // drop the consumed front once it is larger than what is left
+  if (head_ > 0 && head_ >= buf_.size() - head_) {
+    buf_.erase(0, head_);
+    scan_ -= head_;
+    head_ = 0;
+  }
+  buf_.append(data, len);
+  // an event ends with an empty line, LF or CRLF
+  while (true) {
+    size_t nl = buf_.find('\n', scan_);
+    if (nl == std::string::npos) {
+      scan_ = buf_.size();
+      return true;
+    }
+    size_t next = nl + 1;
+    if (next < buf_.size() && buf_[next] == '\r') next ++;
+    if (next >= buf_.size()) {
+      scan_ = nl; // the blank line may still arrive
+      return true;
+    }
+    if (buf_[next] != '\n') {
+      scan_ = nl + 1;
+      continue;
+    }
+    size_t eventEnd = (nl > head_ && buf_[nl - 1] == '\r') ? nl - 1 : nl;
+    std::string_view event(buf_.data() + head_, eventEnd - head_);
+    head_ = scan_ = next + 1;
+    if (!onEvent(event)) return false;
+  }
+}
+
+std::string_view SseParser::pending() const
+{
+  return std::string_view(buf_).substr(head_);
+}
+
+std::string_view SseParser::data(std::string_view event, std::string &scratch)
+{
+  std::string_view result;
+  size_t lines = 0;
+  while (!event.empty()) {
+    size_t nl = event.find('\n');
+    auto line = event.substr(0, nl);
+    event = nl == std::string_view::npos ? std::string_view{} : event.substr(nl + 1);
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (!line.starts_with("data:")) continue; // comments, event names, ids
+    line.remove_prefix(5);
+    if (line.starts_with(' ')) line.remove_prefix(1);
+    if (lines ++ == 0) {
+      result = line;
+      continue;
+    }
+    if (lines == 2) scratch.assign(result);
+    scratch += '\n';
+    scratch.append(line);
+    result = scratch;
+  }
+  return result;
+}
+
+//---------------------------------------------------------------------------
+
+
+bool sse::extractDelta(std::string_view json, std::string &content, bool &needsFull)
+{
+  JsonReader r{ json.data(), json.data() + json.size() };
+  content.clear();
+  needsFull = false;
+  std::string reasoning;
+  bool hasContent = false;
+
+  auto onDelta = [&r, &content, &reasoning, &hasContent] {
+    if (r.key == "content" && r.peek('"')) {
+      hasContent = true;
+      return r.string(&content);
+    }
+    if (r.key == "reasoning_content" && r.peek('"')) {
+      return r.string(&reasoning);
+    }
+    return r.skip();
+  };
+  auto onChoice = [&r, &onDelta] {
+    if (r.key == "delta" && r.peek('{')) {
+      return r.object(onDelta);
+    }
+    return r.skip();
+  };
+  bool ok = r.object([&r, &onChoice, &needsFull] {
+    if (r.key == "choices" && r.consume('[')) {
+      if (r.consume(']')) return true;
+      // only the first choice is read
+      if (!(r.peek('{') ? r.object(onChoice) : r.skip())) return false;
+      while (r.consume(',')) {
+        if (!r.skip()) return false;
+      }
+      return r.consume(']');
+    }
+    if (r.key == "usage" || r.key == "timings") {
+      r.ws();
+      needsFull = needsFull || !r.peek('n');
+    }
+    return r.skip();
+  });
+  if (ok && !hasContent) {
+    content = std::move(reasoning);
+  }
+  return ok;
+}
+
+void sse::appendJsonString(std::string &out, std::string_view s)
+{
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  size_t run = 0;
+  for (size_t i = 0; i < s.size(); i ++) {
+    unsigned char c = static_cast<unsigned char>(s[i]);
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+    out.append(s.data() + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      case '\b': out += "\\b"; break;
+      case '\f': out += "\\f"; break;
+      default:
+        out += "\\u00";
+        out += hex[c >> 4];
+        out += hex[c & 0xF];
+    }
+  }
+  out.append(s.data() + run, s.size() - run);
+  out += '"';
+}
@@ -179,7 +179,7 @@ size_t SimpleTokenizer::simulateWordpiece(const std::string &word, bool addSpeci
   }
   
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_lock<std::shared_mutex> lock(mutex_);
     if (auto it = cache_.find(word); it != cache_.end())
       return it->second;    
   }
@@ -203,7 +203,7 @@ size_t SimpleTokenizer::simulateWordpiece(const std::string &word, bool addSpeci
   }
 
   {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
     cache_[word] = tokens;
   }
   return tokens;